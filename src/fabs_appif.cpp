@@ -3,12 +3,22 @@
 #include "fabs_callback.hpp"
 #include "fabs_ether.hpp"
 
+#include <fcntl.h>
+#include <signal.h>
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
 
 #include <arpa/inet.h>
 
+#ifdef __linux__
+    #define __FAVOR_BSD
+#endif
+
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
 #include <sys/ioctl.h>
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -18,6 +28,7 @@
 
 #include <pcap/pcap.h>
 
+#include <algorithm>
 #include <list>
 #include <iostream>
 #include <fstream>
@@ -26,6 +37,7 @@
 #include <memory>
 #include <functional>
 #include <chrono>
+#include <limits>
 
 #include <boost/lexical_cast.hpp>
 
@@ -33,26 +45,83 @@
 
 namespace fs = boost::filesystem;
 
+#define CONSUME_BATCH 256 // events consumed before running classify jobs
+#define MAX_EVENT_BUF 65536 // control events kept while a backlog is full
+#define GROUP_VNODE 64 // virtual nodes per reader of a consumer group
+
 #define SWAP_ENDIAN4(val) ((int) ( \
     (((val) & 0x000000ff) << 24) | \
     (((val) & 0x0000ff00) <<  8) | \
     (((val) & 0x00ff0000) >>  8) | \
     (((val) & 0xff000000) >> 24) ))
 
+static inline uint32_t
+mix_hash(uint64_t x)
+{
+    // finalizer of MurmurHash3
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ULL;
+    x ^= x >> 33;
+
+    return (uint32_t)x;
+}
+
+static void append_prefix(std::string &s, const fabs_id_dir &id_dir);
+
 void ux_read(int fd, short events, void *arg);
 void ux_read_loopback7(int fd, short events, void *arg);
 void ux_read_pcap(int fd, short events, void *arg);
-bool read_loopback7(int fd, fabs_appif *appif);
+bool read_loopback7(int fd, fabs_appif *appif, fabs_appif::loopback_state &state);
+bool input_loopback7(int fd, fabs_appif *appif, fabs_appif::loopback_state &state);
+
+#define LB7_BUF_BYTES    (128 * 1024) // receive buffer of loopback7, > 64KB body
+#define LB7_MAX_BODY     65535        // bodies of text and binary headers
+#define LB7_DIRECT_BYTES (16 * 1024)  // bodies read directly into fabs_bytes
+#define LB7_MAX_READ     16           // reads per wakeup
+
+// binary headers cannot tell a longer body
+static_assert(std::numeric_limits<decltype(fabs_appif_header::len)>::max() <=
+              LB7_MAX_BODY, "len of fabs_appif_header exceeds LB7_MAX_BODY");
+
+#define IFPCAP_BUF_BYTES (1024 * 1024) // receive buffer of the pcap interface
 
 fabs_appif::fabs_appif(fabs_ether &ether) :
     m_fd7(-1),
     m_fd3(-1),
-    m_lb7_format(IF_TEXT),
+    m_rule_gen(1),
+    m_udp_timeout(30),
+    m_udp_flow_size(65536),
+    m_peer_id(0),
+    m_flow_id(0),
     m_num_tcp_threads(1),
     m_num_consumer(1),
+    m_is_classify_pool(false),
+    m_num_job(0),
+    m_num_writer(2),
+    m_writer_rr(0),
+    m_num_io(1),
+    m_io_rr(0),
+    m_flush_bytes(65536),
+    m_backlog_bytes(16 * 1024 * 1024),
+    m_overflow(OVERFLOW_KEEP_CONTROL),
+    m_ev_reload(nullptr),
     m_home(new fs::path(fs::current_path())),
     m_is_lru(true),
     m_is_cache(true),
+    m_is_ep_cache(false),
+    m_is_ep_validate(true),
+    m_ep_ttl(300),
+    m_ep_size(4096),
+    m_ep_prefix4(0),
+    m_ep_prefix6(0),
+    m_classify_bytes(65536),
+    m_classify_time(0),
+    m_is_unidir(false),
+    m_classify_bytes_max(65536),
+    m_classify_time_max(0),
+    m_has_unidir(false),
     m_ether(ether)
 {
 
@@ -76,6 +145,20 @@ fabs_appif::run()
         m_thread_listen = ptr_thread(new std::thread(std::bind(&fabs_appif::ux_listen, this)));
         m_thread_listen->detach();
 
+        for (int i = 0; i < m_num_writer; i++) {
+            m_writer.push_back(ptr_writer(new appif_writer(i, *this)));
+        }
+
+        for (int i = 0; i < m_num_io; i++) {
+            m_io.push_back(ptr_io(new appif_io(i, *this)));
+        }
+
+        for (int i = 0; i < m_num_consumer; i++) {
+            m_job_queue.push_back(ptr_job_queue(new job_queue));
+        }
+
+        m_rcu = std::unique_ptr<fabs_rcu>(new fabs_rcu(m_num_consumer));
+
         for (int i = 0; i < m_num_consumer; i++) {
             m_consumer.push_back(ptr_consumer(new appif_consumer(i, *this)));
         }
@@ -108,43 +191,85 @@ ux_accept(int fd, short events, void *arg)
         return;
     }
 
-    struct timeval tv;
+    if (it->second->m_name == "loopback7" || it->second->m_name == "pcap") {
+        // input is read by I/O threads, not to delay accepting analyzers
+        auto &io = appif->m_io[appif->m_io_rr++ % appif->m_io.size()];
 
-    tv.tv_sec  = 1;
-    tv.tv_usec = 0;
-    setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, (char *)&tv, sizeof(tv));
+        std::cout << "accepted on " << it2->second << " (fd = " << sock
+                  << ", I/O thread = " << io->m_id << ")" << std::endl;
 
-    event *ev;
-    if (it->second->m_name == "loopback7") {
-        auto ptr = fabs_appif::ptr_loopback_state(new fabs_appif::loopback_state);
-        appif->m_lb7_state[sock] = std::move(ptr);
-        ev = event_new(appif->m_ev_base, sock, EV_READ | EV_PERSIST, ux_read_loopback7, arg);
-    } else if (it->second->m_name == "pcap") {
-        auto ptr = fabs_appif::ptr_ifpcap_info(new fabs_appif::ifpcap_info);
-        appif->m_ifpcap_info[sock] = std::move(ptr);
-        ev = event_new(appif->m_ev_base, sock, EV_READ | EV_PERSIST, ux_read_pcap, arg);
-    } else {
-        ev = event_new(appif->m_ev_base, sock, EV_READ | EV_PERSIST, ux_read, arg);
+        io->add_conn(sock, it->second->m_name == "loopback7",
+                     it->second->m_format);
+        return;
+    }
+
+    auto peer = fabs_appif::ptr_uxpeer(new fabs_appif::uxpeer);
+
+    event *ev = event_new(appif->m_ev_base, sock, EV_READ | EV_PERSIST, ux_read, arg);
+
+    // events to analyzers are written by a writer thread
+    peer->m_writer = appif->m_writer_rr++ % appif->m_num_writer;
+
+    fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+
+    peer->m_backlog_max = it->second->m_backlog_bytes < 0 ?
+        appif->m_backlog_bytes : it->second->m_backlog_bytes;
+    peer->m_overflow    = it->second->m_overflow == fabs_appif::OVERFLOW_DEFAULT ?
+        appif->m_overflow : it->second->m_overflow;
+
+    if (! it->second->m_spill_dir.empty()) {
+        peer->m_spill = std::unique_ptr<fabs_spill>(
+            new fabs_spill(it->second->m_spill_dir,
+                           it->second->m_spill_quota));
+    }
+
+    if (it->second->m_tcp_fd.count(fd) > 0) {
+        // events are batched by the writer thread
+        int on = 1;
+        setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    } else if (it->second->m_is_shm) {
+        peer->m_shm = std::unique_ptr<fabs_shm>(new fabs_shm);
+
+        if (! peer->m_shm->open(sock, it->second->m_shm_size)) {
+            std::cerr << "could not create shared memory for "
+                      << it2->second << ", use the socket instead"
+                      << std::endl;
+            peer->m_shm.reset();
+        }
     }
 
     event_add(ev, NULL);
 
-    auto peer = fabs_appif::ptr_uxpeer(new fabs_appif::uxpeer);
     peer->m_fd       = sock;
     peer->m_ev       = ev;
     peer->m_ifrule   = it->second;
     peer->m_path     = it2->second;
+    peer->m_id       = ++appif->m_peer_id;
+
+    if (it->second->m_is_group) {
+        auto &grp = appif->m_name2group[it2->second];
+        grp.add(sock, peer->m_id);
+
+        std::cout << "joined the consumer group of " << peer->m_path
+                  << " (readers = " << grp.m_member.size() << ")" << std::endl;
+    }
 
     std::cout << "accepted on " << peer->m_path
               << " (fd = " << sock << ")" << std::endl;
 
+    appif->m_writer[peer->m_writer]->add_peer(peer);
+
     appif->m_fd2uxpeer[sock] = std::move(peer);
     appif->m_name2uxpeer[it2->second].insert(sock);
+
+    appif->update_routes(it2->second);
 }
 
 void
 ux_close(int fd, fabs_appif *appif)
 {
+    bool is_writer = false;
+
     auto it1 = appif->m_fd2uxpeer.find(fd);
     if (it1 != appif->m_fd2uxpeer.end()) {
         auto it2 = appif->m_name2uxpeer.find(it1->second->m_path);
@@ -159,158 +284,177 @@ ux_close(int fd, fabs_appif *appif)
         event_del(it1->second->m_ev);
         event_free(it1->second->m_ev);
 
+        auto it5 = appif->m_name2group.find(it1->second->m_path);
+        if (it5 != appif->m_name2group.end()) {
+            // flows of the reader are moved to others by the generation
+            it5->second.remove(fd);
+        }
+
         std::cout << "closed on " << it1->second->m_path
                   << " (fd = " << fd << ")" << std::endl;
 
+        // the writer thread closes fd after discarding queued events
+        is_writer = true;
+        it1->second->m_is_closed = true;
+        appif->m_writer[it1->second->m_writer]->notify();
+
+        auto path = it1->second->m_path;
+
         appif->m_fd2uxpeer.erase(it1);
+
+        // the peer is freed after consumers leave the old routes
+        appif->update_routes(path);
     }
 
     shutdown(fd, SHUT_RDWR);
-    close(fd);
-
-    auto it3 = appif->m_lb7_state.find(fd);
-    if (it3 != appif->m_lb7_state.end()) {
-        fabs_id_dir id_dir;
 
-        for (auto it4 = it3->second->streams.begin();
-             it4 != it3->second->streams.end(); ++it4) {
-            id_dir.m_id  = *it4;
-            id_dir.m_dir = FROM_NONE;
+    if (! is_writer)
+        close(fd);
+}
 
-            ptr_fabs_bytes buf(new fabs_bytes);
-            gettimeofday(&buf->m_tm, nullptr);
-            appif->in_event(STREAM_DESTROYED, id_dir, std::move(buf));
-        }
+void
+ux_reload(int fd, short events, void *arg)
+{
+    fabs_appif *appif = static_cast<fabs_appif*>(arg);
 
-        appif->m_lb7_state.erase(it3);
-    }
+    appif->reload_conf();
 }
 
 void
 ux_read_loopback7(int fd, short events, void *arg)
 {
-    fabs_appif *appif = static_cast<fabs_appif*>(arg);
+    auto io = static_cast<fabs_appif::appif_io*>(arg);
 
-    if (read_loopback7(fd, appif)) {
-        fabs_spin_rwlock_write lock(appif->m_rw_mutex);
+    auto it = io->m_lb7_state.find(fd);
+    assert(it != io->m_lb7_state.end());
 
-        ux_close(fd, appif);
-    }
+    if (read_loopback7(fd, &io->m_appif, *it->second))
+        io->close_conn(fd);
 }
 
+// records are parsed in place in the receive buffer, and frames are input
+// from there
 void
 ux_read_pcap(int fd, short events, void *arg)
 {
-    fabs_appif *appif = static_cast<fabs_appif*>(arg);
+    auto io    = static_cast<fabs_appif::appif_io*>(arg);
+    auto appif = &io->m_appif;
+
+    auto it = io->m_ifpcap_info.find(fd);
+    assert(it != io->m_ifpcap_info.end());
 
-    int count;
-    ioctl(fd, FIONREAD, &count);
+    auto &info = *it->second;
+    auto &buf  = info.m_buf;
 
-    ptr_fabs_bytes bytes = std::unique_ptr<fabs_bytes>(new fabs_bytes);
+    if (buf.empty())
+        buf.resize(IFPCAP_BUF_BYTES);
 
-    bytes->alloc(count);
+    // move a partial record to the front
+    if (info.m_head > 0) {
+        memmove(&buf[0], &buf[info.m_head], info.m_tail - info.m_head);
+        info.m_tail -= info.m_head;
+        info.m_head  = 0;
+    }
 
-    int recv_size = read(fd, bytes->get_head(), count);
+    ssize_t recv_size = read(fd, &buf[info.m_tail], buf.size() - info.m_tail);
 
-    if (recv_size <= 0) {
-        appif->m_ifpcap_info.erase(fd);
-        fabs_spin_rwlock_write lock(appif->m_rw_mutex);
+    if (recv_size < 0 && errno == EINTR)
+        return;
 
-        ux_close(fd, appif);
+    if (recv_size <= 0) {
+        io->close_conn(fd);
         return;
     }
 
-    auto it = appif->m_ifpcap_info.find(fd);
+    if (info.m_is_fail) {
+        // discard until closed
+        return;
+    }
 
-    it->second->m_bytes.push_back(std::move(bytes));
+    info.m_tail += recv_size;
 
     for (;;) {
-        if (it->second->m_state == fabs_appif::IFPCAP_GLOBAL) {
+        const char *p   = &buf[info.m_head];
+        size_t      len = info.m_tail - info.m_head;
+
+        if (info.m_state == fabs_appif::IFPCAP_GLOBAL) {
             pcap_hdr_t ghdr;
-            int len = read_bytes(it->second->m_bytes, (char*)&ghdr, sizeof(ghdr));
-            if (len != sizeof(ghdr))
+
+            if (len < sizeof(ghdr))
                 break;
 
-            skip_bytes(it->second->m_bytes, sizeof(ghdr));
+            memcpy(&ghdr, p, sizeof(ghdr));
+            info.m_head += sizeof(ghdr);
 
             if (ghdr.magic_number == 0xa1b2c3d4) {
-                it->second->m_is_native = true;
+                info.m_is_native = true;
             } else if (ghdr.magic_number == 0xd4c3b2a1) {
-                it->second->m_is_native = false;
+                info.m_is_native = false;
             } else {
-                it->second->m_is_fail = true;
-                it->second->m_bytes.clear();
+                info.m_is_fail = true;
                 break;
             }
 
-            if (it->second->m_is_native) {
-                if (ghdr.network != DLT_EN10MB) {
-                    it->second->m_is_fail = true;
-                    it->second->m_bytes.clear();
-                    std::cerr << "datalink type of pcap file is not Ethernet!" << std::endl;
-                    break;
-                }
-            } else {
-                if (SWAP_ENDIAN4(ghdr.network) == DLT_EN10MB) {
-                    it->second->m_is_fail = true;
-                    it->second->m_bytes.clear();
-                    std::cerr << "datalink type of pcap file is not Ethernet!" << std::endl;
-                    break;
-                }
-            }
+            uint32_t network = info.m_is_native ? ghdr.network :
+                SWAP_ENDIAN4(ghdr.network);
 
-            memcpy(it->second->m_global_header, &ghdr, sizeof(it->second->m_global_header));
-
-            it->second->m_state = fabs_appif::IFPCAP_HEADER;
-        } else if (it->second->m_state == fabs_appif::IFPCAP_HEADER) {
-            if (it->second->m_is_fail) {
-                it->second->m_bytes.clear();
+            if (network != DLT_EN10MB) {
+                info.m_is_fail = true;
+                std::cerr << "datalink type of pcap file is not Ethernet!" << std::endl;
                 break;
             }
 
+            memcpy(info.m_global_header, &ghdr, sizeof(info.m_global_header));
+
+            info.m_state = fabs_appif::IFPCAP_HEADER;
+        } else {
             pcaprec_hdr_t hdr;
-            int len = read_bytes(it->second->m_bytes, (char*)&hdr, sizeof(hdr));
-            if (len != sizeof(hdr))
+
+            if (len < sizeof(hdr))
                 break;
 
-            if (memcmp(it->second->m_global_header, &hdr, sizeof(it->second->m_global_header)) == 0) {
-                it->second->m_state = fabs_appif::IFPCAP_GLOBAL;
+            // pcap files may be concatenated
+            if (memcmp(info.m_global_header, p, sizeof(info.m_global_header)) == 0) {
+                info.m_state = fabs_appif::IFPCAP_GLOBAL;
                 continue;
             }
 
-            skip_bytes(it->second->m_bytes, sizeof(hdr));
+            memcpy(&hdr, p, sizeof(hdr));
 
-            if (it->second->m_is_native) {
-                it->second->m_dlen       = hdr.incl_len;
-                it->second->m_tm.tv_sec  = hdr.ts_sec;
-                it->second->m_tm.tv_usec = hdr.ts_usec;
+            uint32_t dlen;
+            timeval  tm;
+
+            if (info.m_is_native) {
+                dlen       = hdr.incl_len;
+                tm.tv_sec  = hdr.ts_sec;
+                tm.tv_usec = hdr.ts_usec;
             } else {
-                it->second->m_dlen = SWAP_ENDIAN4(hdr.incl_len);
-                it->second->m_tm.tv_sec  = SWAP_ENDIAN4(hdr.ts_sec);
-                it->second->m_tm.tv_usec = SWAP_ENDIAN4(hdr.ts_usec);
+                dlen       = SWAP_ENDIAN4(hdr.incl_len);
+                tm.tv_sec  = SWAP_ENDIAN4(hdr.ts_sec);
+                tm.tv_usec = SWAP_ENDIAN4(hdr.ts_usec);
             }
 
-            it->second->m_state = fabs_appif::IFPCAP_DATA;
-        } else if (it->second->m_state == fabs_appif::IFPCAP_DATA) {
-            if (it->second->m_is_fail) {
-                it->second->m_bytes.clear();
+            if (dlen > buf.size() - sizeof(hdr)) {
+                info.m_is_fail = true;
+                std::cerr << "too large record of pcap file! (incl_len = "
+                          << dlen << ")" << std::endl;
                 break;
             }
 
-            std::vector<char> buf;
-            buf.resize(it->second->m_dlen);
-
-            auto len = read_bytes(it->second->m_bytes, &buf[0], it->second->m_dlen);
-            if ((uint32_t)len != it->second->m_dlen)
+            if (len < sizeof(hdr) + dlen)
                 break;
 
-            skip_bytes(it->second->m_bytes, it->second->m_dlen);
+            appif->m_ether.ether_input((const uint8_t*)p + sizeof(hdr), dlen,
+                                       tm, true);
 
-            appif->m_ether.ether_input((uint8_t*)&buf[0], it->second->m_dlen, it->second->m_tm, true);
-
-            it->second->m_state = fabs_appif::IFPCAP_HEADER;
+            info.m_head += sizeof(hdr) + dlen;
         }
     }
+
+    if (info.m_head == info.m_tail) {
+        info.m_head = 0;
+        info.m_tail = 0;
+    }
 }
 
 void
@@ -337,258 +481,466 @@ ux_read(int fd, short events, void *arg)
     }
 }
 
-bool
-read_loopback7(int fd, fabs_appif *appif)
+// a field of a text header of loopback7, pointing into the receive buffer
+struct lb7_field {
+    const char *m_ptr;
+    size_t      m_len;
+
+    lb7_field() : m_ptr(nullptr), m_len(0) { }
+
+    bool operator == (const char *str) const {
+        return m_ptr != nullptr && strlen(str) == m_len &&
+            memcmp(m_ptr, str, m_len) == 0;
+    }
+};
+
+static bool
+lb7_to_uint(const lb7_field &f, uint32_t max, uint32_t &n)
 {
-    fabs_appif_header *header;
-    fabs_id_dir        id_dir;
+    if (f.m_len == 0 || f.m_len > 10)
+        return false;
 
-    auto it = appif->m_lb7_state.find(fd);
-    assert(it != appif->m_lb7_state.end());
+    uint64_t v = 0;
 
-    header = &it->second->header;
+    for (size_t i = 0; i < f.m_len; i++) {
+        if (f.m_ptr[i] < '0' || f.m_ptr[i] > '9')
+            return false;
 
-    if (it->second->is_header) {
-        if (appif->m_lb7_format == fabs_appif::IF_BINARY) {
-            // read binary header
-            ssize_t len = read(fd, header, sizeof(*header));
+        v = v * 10 + f.m_ptr[i] - '0';
+    }
 
-            if (len <= 0) {
-                // must close fd
-                return true;
-            } else if (len != sizeof(*header)) {
-                std::cerr << "CAUTION! LOOPBACK 7 RECEIVED INVALID HEADER!: socket = "
-                          << fd << std::endl;
-                return false;
-            }
+    if (v > max)
+        return false;
 
-            header->hop++;
-        } else {
-            // read text header
-            std::map<std::string, std::string> h;
-            std::string s;
+    n = v;
 
-            for (;;) {
-                char c;
-                ssize_t len = read(fd, &c, 1);
+    return true;
+}
 
-                if (len <= 0) {
-                    // must close fd
-                    return true;
-                }
+static bool
+lb7_to_addr(const lb7_field &f, int af, void *addr)
+{
+    char buf[INET6_ADDRSTRLEN];
 
-                if (c == '\n')
-                    break;
+    if (f.m_len == 0 || f.m_len >= sizeof(buf))
+        return false;
 
-                s += c;
-            }
+    memcpy(buf, f.m_ptr, f.m_len);
+    buf[f.m_len] = '\0';
 
-            std::stringstream ss1(s);
-            while (ss1) {
-                std::string elm;
-                std::getline(ss1, elm, ',');
+    return inet_pton(af, buf, addr) > 0;
+}
 
-                if (elm.empty())
-                    continue;
+// "seconds.fraction"
+static bool
+lb7_to_time(const lb7_field &f, timeval &tm)
+{
+    const char *p   = f.m_ptr;
+    const char *end = f.m_ptr + f.m_len;
+    uint64_t    sec = 0, usec = 0;
+    int         digits = 0;
 
-                std::stringstream ss2(elm);
-                std::string key, val;
-                std::getline(ss2, key, '=');
-                std::getline(ss2, val);
+    if (p == end)
+        return false;
 
-                h[key] = val;
-            }
+    for (; p < end && *p != '.'; p++) {
+        if (*p < '0' || *p > '9')
+            return false;
 
-            uint8_t l3_proto, l4_proto;
-            int af;
+        sec = sec * 10 + *p - '0';
+    }
 
-            if (h["l3"] == "ipv4") {
-                l3_proto = IPPROTO_IP;
-                af = AF_INET;
-            } else if (h["l3"] == "ipv6") {
-                l3_proto = IPPROTO_IPV6;
-                af = AF_INET6;
-            } else {
+    if (p < end) {
+        for (p++; p < end; p++) {
+            if (*p < '0' || *p > '9')
                 return false;
-            }
 
-            if (h["l4"] == "tcp") {
-                l4_proto = IPPROTO_TCP;
-            } else if (h["l4"] == "udp") {
-                l4_proto = IPPROTO_UDP;
-            } else {
-                return false;
+            if (digits < 6) {
+                usec = usec * 10 + *p - '0';
+                digits++;
             }
+        }
+    }
 
-            if (inet_pton(af, h["ip1"].c_str(), &header->l3_addr1) <= 0) {
-                std::cerr << "CAUTION! LOOPBACK 7 RECEIVED INVALID HEADER! (inet_pton ip1): header = "
-                          << s << std::endl;
-                return false;
+    for (; digits < 6; digits++)
+        usec *= 10;
+
+    tm.tv_sec  = sec;
+    tm.tv_usec = usec;
+
+    return true;
+}
+
+// parse a text header of loopback7 in [s, end), which excludes '\n'
+// fields are scanned in place, without allocation
+static bool
+parse_loopback7_text(const char *s, const char *end, fabs_appif_header *header)
+{
+    lb7_field ip1, ip2, port1, port2, hop, l3, l4, event, from, len, tm;
+
+    while (s < end) {
+        const char *comma = (const char*)memchr(s, ',', end - s);
+        if (comma == nullptr)
+            comma = end;
+
+        const char *eq = (const char*)memchr(s, '=', comma - s);
+        if (eq != nullptr) {
+            lb7_field  key, *val = nullptr;
+
+            key.m_ptr = s;
+            key.m_len = eq - s;
+
+            switch (key.m_len) {
+            case 2:
+                if (key == "l3")
+                    val = &l3;
+                else if (key == "l4")
+                    val = &l4;
+                break;
+            case 3:
+                if (key == "ip1")
+                    val = &ip1;
+                else if (key == "ip2")
+                    val = &ip2;
+                else if (key == "hop")
+                    val = &hop;
+                else if (key == "len")
+                    val = &len;
+                break;
+            case 4:
+                if (key == "from")
+                    val = &from;
+                else if (key == "time")
+                    val = &tm;
+                break;
+            case 5:
+                if (key == "port1")
+                    val = &port1;
+                else if (key == "port2")
+                    val = &port2;
+                else if (key == "event")
+                    val = &event;
+                break;
+            default:
+                break;
             }
 
-            if (inet_pton(af, h["ip2"].c_str(), &header->l3_addr2) <= 0) {
-                std::cerr << "CAUTION! LOOPBACK 7 RECEIVED INVALID HEADER! (inet_pton ip2): header = "
-                          << s << std::endl;
-                return false;
+            if (val) {
+                val->m_ptr = eq + 1;
+                val->m_len = comma - eq - 1;
             }
+        }
 
-            header->l3_proto = l3_proto;
-            header->l4_proto = l4_proto;
+        s = comma + 1;
+    }
 
-            try {
-                header->l4_port1 = boost::lexical_cast<int>(h["port1"]);
-                header->l4_port2 = boost::lexical_cast<int>(h["port2"]);
-                header->hop      = boost::lexical_cast<int>(h["hop"]);
+    int af;
 
-                auto it_len = h.find("len");
-                if (it_len != h.end()) {
-                    header->len = boost::lexical_cast<int>(it_len->second);
-                }
-            } catch (boost::bad_lexical_cast e) {
-                std::cerr << "CAUTION! LOOPBACK 7 RECEIVED INVALID HEADER! (lexical_cast): header = "
-                          << s << std::endl;
-                return false;
-            }
+    if (l3 == "ipv4") {
+        header->l3_proto = IPPROTO_IP;
+        af = AF_INET;
+    } else if (l3 == "ipv6") {
+        header->l3_proto = IPPROTO_IPV6;
+        af = AF_INET6;
+    } else {
+        return false;
+    }
 
-            header->hop++;
-            header->l4_port1 = htons(header->l4_port1);
-            header->l4_port2 = htons(header->l4_port2);
+    if (l4 == "tcp") {
+        header->l4_proto = IPPROTO_TCP;
+    } else if (l4 == "udp") {
+        header->l4_proto = IPPROTO_UDP;
+    } else {
+        return false;
+    }
 
-            if (h["event"] == "CREATED") {
-                header->event = STREAM_CREATED;
-            } else if (h["event"] == "DESTROYED") {
-                header->event = STREAM_DESTROYED;
-            } else if (h["event"] == "DATA") {
-                header->event = STREAM_DATA;
-            } else {
-                return false;
-            }
+    if (! lb7_to_addr(ip1, af, &header->l3_addr1) ||
+        ! lb7_to_addr(ip2, af, &header->l3_addr2))
+        return false;
 
-            if (h["from"] == "1") {
-                header->from = FROM_ADDR1;
-            } else if (h["from"] == "2") {
-                header->from = FROM_ADDR2;
-            } else {
-                header->from = FROM_NONE;
-            }
+    uint32_t n1, n2, n3, n4 = 0;
 
-            auto t = h.find("time");
-            if (t == h.end()) {
-                gettimeofday(&header->tm, nullptr);
-            } else {
-                double integer, fraction;
-                fraction = modf(std::stod(t->second), &integer);
-                header->tm.tv_sec = integer;
-                header->tm.tv_usec = fraction * 1e6;
-            }
+    if (! lb7_to_uint(port1, 65535, n1) ||
+        ! lb7_to_uint(port2, 65535, n2) ||
+        ! lb7_to_uint(hop, 255, n3) ||
+        (len.m_ptr != nullptr && ! lb7_to_uint(len, LB7_MAX_BODY, n4)))
+        return false;
 
-            fabs_peer peer1, peer2;
+    header->l4_port1 = htons(n1);
+    header->l4_port2 = htons(n2);
+    header->hop      = n3 + 1;
+    header->len      = n4;
+
+    if (event == "CREATED") {
+        header->event = STREAM_CREATED;
+    } else if (event == "DESTROYED") {
+        header->event = STREAM_DESTROYED;
+    } else if (event == "DATA") {
+        header->event = STREAM_DATA;
+    } else {
+        return false;
+    }
 
-            peer1.padding = 0;
-            peer2.padding = 0;
+    if (from == "1") {
+        header->from = FROM_ADDR1;
+    } else if (from == "2") {
+        header->from = FROM_ADDR2;
+    } else {
+        header->from = FROM_NONE;
+    }
 
-            memcpy(&peer1.l3_addr, &header->l3_addr1, sizeof(peer1.l3_addr));
-            memcpy(&peer2.l3_addr, &header->l3_addr2, sizeof(peer2.l3_addr));
+    if (tm.m_ptr == nullptr) {
+        gettimeofday(&header->tm, nullptr);
+    } else {
+        timeval t;
 
-            peer1.l4_port = header->l4_port1;
-            peer2.l4_port = header->l4_port2;
+        if (! lb7_to_time(tm, t))
+            return false;
 
-            if (peer1 > peer2) {
-                // swap
-                memcpy(&header->l3_addr1, &peer2.l3_addr, sizeof(peer2.l3_addr));
-                memcpy(&header->l3_addr2, &peer1.l3_addr, sizeof(peer1.l3_addr));
-                header->l4_port1 = peer2.l4_port;
-                header->l4_port2 = peer1.l4_port;
+        header->tm = t;
+    }
 
-                if (header->from == FROM_ADDR1)
-                    header->from = FROM_ADDR2;
-                else if (header->from == FROM_ADDR2)
-                    header->from = FROM_ADDR1;
-            }
-        }
+    fabs_peer peer1, peer2;
 
-        header->match = fabs_appif::MATCH_NONE;
+    peer1.padding = 0;
+    peer2.padding = 0;
 
-        id_dir.m_id.set_appif_header(*header);
+    memcpy(&peer1.l3_addr, &header->l3_addr1, sizeof(peer1.l3_addr));
+    memcpy(&peer2.l3_addr, &header->l3_addr2, sizeof(peer2.l3_addr));
 
-        if (header->from == FROM_ADDR1) {
-            id_dir.m_dir = FROM_ADDR1;
-        } else if (header->from == FROM_ADDR2) {
-            id_dir.m_dir = FROM_ADDR2;
-        } else {
-            id_dir.m_dir = FROM_NONE;
-        }
+    peer1.l4_port = header->l4_port1;
+    peer2.l4_port = header->l4_port2;
 
-        it->second->id_dir = id_dir;
+    if (peer1 > peer2) {
+        // swap
+        memcpy(&header->l3_addr1, &peer2.l3_addr, sizeof(peer2.l3_addr));
+        memcpy(&header->l3_addr2, &peer1.l3_addr, sizeof(peer1.l3_addr));
+        header->l4_port1 = peer2.l4_port;
+        header->l4_port2 = peer1.l4_port;
 
-        if (header->event == STREAM_DATA) {
-            it->second->is_header = false;
-            return false;
-        } else if (header->event == STREAM_CREATED) {
-            // invoke CREATED event
-            ptr_fabs_bytes buf(new fabs_bytes);
-            buf->m_tm = header->tm;
-            appif->in_event(STREAM_CREATED, id_dir, std::move(buf));
+        if (header->from == FROM_ADDR1)
+            header->from = FROM_ADDR2;
+        else if (header->from == FROM_ADDR2)
+            header->from = FROM_ADDR1;
+    }
 
-            it->second->streams.insert(id_dir.m_id);
+    return true;
+}
 
-            return false;
-        } else if (header->event == STREAM_DESTROYED) {
-            // invoke DESTROYED event
-            ptr_fabs_bytes buf(new fabs_bytes);
-            buf->m_tm = header->tm;
-            appif->in_event(STREAM_DESTROYED, id_dir, std::move(buf));
+// read what the socket has into the receive buffer, and input all
+// complete headers and bodies in it
+// a large body is read directly into its own buffer instead
+// return true if fd must be closed
+bool
+read_loopback7(int fd, fabs_appif *appif, fabs_appif::loopback_state &state)
+{
+    auto &buf    = state.buf;
+    auto  header = &state.header;
 
-            it->second->streams.erase(id_dir.m_id);
+    if (buf.empty())
+        buf.resize(LB7_BUF_BYTES);
 
-            return false;
+    // bounded not to starve other sockets of the I/O thread
+    for (int i = 0; i < LB7_MAX_READ; i++) {
+        ssize_t rlen;
+
+        if (state.body) {
+            rlen = read(fd, state.body->get_head() + state.body_pos,
+                        header->len - state.body_pos);
         } else {
-            std::cerr << "CAUTION! LOOPBACK 7 RECEIVED INVALID EVENT!: event = "
-                      << header->event << std::endl;
+            // move a partial message to the front
+            if (state.head > 0) {
+                memmove(&buf[0], &buf[state.head], state.tail - state.head);
+                state.tail -= state.head;
+                state.head  = 0;
+            }
+
+            rlen = read(fd, &buf[state.tail], buf.size() - state.tail);
+        }
+
+        if (rlen == 0) {
+            // must close fd
+            return true;
+        } else if (rlen < 0) {
+            if (errno == EINTR)
+                continue;
+            else if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+
+            perror("read");
             // must close fd
             return true;
         }
-    } else {
-        auto bytes = ptr_fabs_bytes(new fabs_bytes);
 
-        bytes->alloc(header->len);
-        if (bytes->get_len() == 0)
-            return false;
+        if (state.body) {
+            state.body_pos += rlen;
 
-        bytes->m_tm = header->tm;
+            if (state.body_pos < header->len)
+                continue;
 
-        ssize_t len = read(fd, bytes->get_head(), header->len);
+            // invoke DATA event
+            appif->in_event(STREAM_DATA, state.id_dir, std::move(state.body));
 
-        if (len == 0) {
-            // must close fd
-            return true;
-        } if (len < 0) {
-            perror("error");
-            // must close fd
-            return true;
-        } else if (len != header->len) {
-            std::cerr << "CAUTION! LOOPBACK 7 RECEIVED INVALID BODY LENGTH!: len = "
-                      << header->len << std::endl;
-            // must close fd
-            return true;
+            state.body.reset();
+            state.is_header = true;
+            continue;
         }
 
-        // invoke DATA event
-        appif->in_event(STREAM_DATA, it->second->id_dir, std::move(bytes));
+        state.tail += rlen;
+
+        if (input_loopback7(fd, appif, state))
+            return true;
+    }
+
+    return false;
+}
 
-        it->second->is_header = true;
+// input all complete headers and bodies in the receive buffer
+// return true if fd must be closed
+bool
+input_loopback7(int fd, fabs_appif *appif, fabs_appif::loopback_state &state)
+{
+    auto &buf    = state.buf;
+    auto  header = &state.header;
 
-        return false;
+    for (;;) {
+        const char *p   = &buf[state.head];
+        size_t      len = state.tail - state.head;
+
+        if (state.is_header) {
+            if (state.format == fabs_appif::IF_BINARY) {
+                if (len < sizeof(*header))
+                    break;
+
+                memcpy(header, p, sizeof(*header));
+                state.head += sizeof(*header);
+
+                if ((header->l3_proto != IPPROTO_IP &&
+                     header->l3_proto != IPPROTO_IPV6) ||
+                    (header->l4_proto != IPPROTO_TCP &&
+                     header->l4_proto != IPPROTO_UDP)) {
+                    // the stream is out of sync
+                    std::cerr << "CAUTION! LOOPBACK 7 RECEIVED INVALID HEADER!: socket = "
+                              << fd << std::endl;
+                    // must close fd
+                    return true;
+                }
+
+                header->hop++;
+            } else {
+                auto nl = (const char*)memchr(p, '\n', len);
+
+                if (nl == nullptr) {
+                    if (len == buf.size()) {
+                        std::cerr << "CAUTION! LOOPBACK 7 RECEIVED TOO LONG HEADER!: socket = "
+                                  << fd << std::endl;
+                        // must close fd
+                        return true;
+                    }
+                    break;
+                }
+
+                state.head += nl - p + 1;
+
+                if (! parse_loopback7_text(p, nl, header)) {
+                    std::cerr << "CAUTION! LOOPBACK 7 RECEIVED INVALID HEADER!: header = "
+                              << std::string(p, nl) << std::endl;
+                    continue;
+                }
+            }
+
+            header->match = fabs_appif::MATCH_NONE;
+
+            fabs_id_dir id_dir;
+
+            id_dir.m_id.set_appif_header(*header);
+
+            if (header->from == FROM_ADDR1) {
+                id_dir.m_dir = FROM_ADDR1;
+            } else if (header->from == FROM_ADDR2) {
+                id_dir.m_dir = FROM_ADDR2;
+            } else {
+                id_dir.m_dir = FROM_NONE;
+            }
+
+            state.id_dir = id_dir;
+
+            if (header->event == STREAM_DATA) {
+                state.is_header = false;
+            } else if (header->event == STREAM_CREATED) {
+                // invoke CREATED event
+                timeval tm = header->tm;
+                appif->in_event(STREAM_CREATED, id_dir, tm);
+
+                state.streams.insert(id_dir.m_id);
+            } else if (header->event == STREAM_DESTROYED) {
+                // invoke DESTROYED event
+                timeval tm = header->tm;
+                appif->in_event(STREAM_DESTROYED, id_dir, tm);
+
+                state.streams.erase(id_dir.m_id);
+            } else {
+                std::cerr << "CAUTION! LOOPBACK 7 RECEIVED INVALID EVENT!: event = "
+                          << (int)header->event << std::endl;
+                // must close fd
+                return true;
+            }
+        } else {
+            if (len < header->len) {
+                if (header->len >= LB7_DIRECT_BYTES) {
+                    // read the rest directly into the body
+                    state.body = ptr_fabs_bytes(new fabs_bytes);
+                    state.body->alloc(header->len);
+                    if (state.body->get_len() == 0)
+                        return true;
+
+                    state.body->m_tm = header->tm;
+
+                    memcpy(state.body->get_head(), p, len);
+                    state.body_pos = len;
+                    state.head     = state.tail;
+                }
+
+                // a body is at most LB7_MAX_BODY by both formats, so a
+                // shorter one fits in the buffer
+                break;
+            }
+
+            state.head     += header->len;
+            state.is_header = true;
+
+            if (header->len == 0)
+                continue;
+
+            auto bytes = ptr_fabs_bytes(new fabs_bytes);
+
+            bytes->set_buf(p, header->len);
+            if (bytes->get_len() == 0)
+                continue;
+
+            bytes->m_tm = header->tm;
+
+            // invoke DATA event
+            appif->in_event(STREAM_DATA, state.id_dir, std::move(bytes));
+        }
+    }
+
+    if (state.head == state.tail) {
+        state.head = 0;
+        state.tail = 0;
     }
+
+    return false;
 }
 
-void
+// return false if path cannot be a directory
+bool
 fabs_appif::makedir(fs::path path)
 {
     if (fs::exists(path)) {
         if (! fs::is_directory(path)) {
             std::cerr << path.string() << " is not directory" << std::endl;
-            exit(-1);
+            return false;
         }
     } else {
         try {
@@ -596,20 +948,67 @@ fabs_appif::makedir(fs::path path)
         } catch (fs::filesystem_error e) {
             std::cerr << "cannot create directories: " << e.path1().string()
                       << std::endl;
-            exit(-1);
+            return false;
         }
     }
+
+    return true;
 }
 
-void
-fabs_appif::ux_listen_ifrule(ptr_ifrule ifrule)
+// open pcap files and directories of spilled events
+// a capture taken over from the replaced rule is kept
+bool
+fabs_appif::prepare_ifrule(ptr_ifrule ifrule)
+{
+    if (! ifrule->m_capture_dir.empty() && ! ifrule->m_capture) {
+        fs::path dir(ifrule->m_capture_dir);
+
+        if (dir.is_relative())
+            dir = *m_home / dir;
+
+        if (! makedir(dir))
+            return false;
+
+        ifrule->m_capture = std::make_shared<fabs_capture>(
+            dir.string(), ifrule->m_name, ifrule->m_capture_bytes,
+            ifrule->m_capture_time);
+
+        std::cout << "capturing " << ifrule->m_name << " to "
+                  << dir.string() << std::endl;
+    }
+
+    if (! ifrule->m_spill_dir.empty()) {
+        fs::path dir(ifrule->m_spill_dir);
+
+        if (dir.is_relative()) {
+            dir = *m_home / dir;
+            ifrule->m_spill_dir = dir.string();
+        }
+
+        if (! makedir(dir))
+            return false;
+    }
+
+    return true;
+}
+
+// listen on the sockets of a rule, which are not accepted until
+// register_ifrule, and return false on errors
+// when reloading, UNIX domain sockets are bound to temporary paths pushed
+// to renames, so that the current ones are kept until the new rules are
+// published
+bool
+fabs_appif::ux_listen_ifrule(ptr_ifrule ifrule, renames_t *renames)
 {
+    if (! prepare_ifrule(ifrule))
+        return false;
+
     for (int i = 0; i < ifrule->m_balance; i++) {
         int sock = socket(AF_UNIX, SOCK_STREAM, 0);
 
         if (sock == -1) {
             perror("socket");
-            exit(-1);
+            return false;
         }
 
         struct sockaddr_un sa = {0};
@@ -629,19 +1028,29 @@ fabs_appif::ux_listen_ifrule(ptr_ifrule ifrule)
             path += fs::path(boost::lexical_cast<std::string>(i));
         }
 
-        strncpy(sa.sun_path, path.string().c_str(), sizeof(sa.sun_path));
+        std::string bound = path.string();
+
+        if (renames)
+            bound += ".reload";
+
+        strncpy(sa.sun_path, bound.c_str(), sizeof(sa.sun_path));
 
         remove(sa.sun_path);
 
         if (::bind(sock, (struct sockaddr*) &sa,
                    sizeof(struct sockaddr_un)) == -1) {
             perror("bind");
-            exit(-1);
+            close(sock);
+            return false;
         }
 
+        if (renames)
+            renames->push_back(std::make_pair(bound, path.string()));
+
         if (listen(sock, 128) == -1) {
             perror("listen");
-            exit(-1);
+            close(sock);
+            return false;
         }
 
         event *ev = event_new(m_ev_base, sock, EV_READ | EV_PERSIST,
@@ -650,18 +1059,147 @@ fabs_appif::ux_listen_ifrule(ptr_ifrule ifrule)
 
         ifrule->m_balance_name.push_back(path.string());
         ifrule->m_fd2path[sock] = path.string();
-        m_fd2ifrule[sock] = ifrule;
+        ifrule->m_listen_ev[sock] = ev;
 
         std::cout << "listening on " << path.string()
                   << " (" << ifrule->m_balance_name[i] << ")" << std::endl;
 
-        if (ifrule->m_name == "loopback7") {
-            m_fd7 = sock;
+        if (! ifrule->m_listen.empty() &&
+            ! tcp_listen_ifrule(ifrule, i, path.string()))
+            return false;
+
+        if (ifrule->m_name == "loopback7")
             break;
-        }
     }
+
+    return true;
+}
+
+
+// listen on TCP as well as the UNIX domain socket of path
+// readers on both sockets are treated the same
+// idx is added to the port number when the rule is balanced
+bool
+fabs_appif::tcp_listen_ifrule(ptr_ifrule ifrule, int idx,
+                              const std::string &path)
+{
+    // validated by read_ifrule
+    auto pos = ifrule->m_listen.rfind(':');
+    if (pos == std::string::npos)
+        return false;
+
+    std::string host = ifrule->m_listen.substr(0, pos);
+    int         port;
+
+    try {
+        port = boost::lexical_cast<int>(ifrule->m_listen.substr(pos + 1));
+    } catch (boost::bad_lexical_cast e) {
+        return false;
+    }
+
+    // [::1]:9000
+    if (host.size() >= 2 && host.front() == '[' && host.back() == ']')
+        host = host.substr(1, host.size() - 2);
+
+    std::string service = boost::lexical_cast<std::string>(port + idx);
+
+    addrinfo hints, *res;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family   = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags    = AI_PASSIVE;
+
+    int err = getaddrinfo(host.empty() ? nullptr : host.c_str(),
+                          service.c_str(), &hints, &res);
+    if (err != 0) {
+        std::cerr << "getaddrinfo: " << ifrule->m_listen << ": "
+                  << gai_strerror(err) << std::endl;
+        return false;
+    }
+
+    int sock = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+
+    if (sock == -1) {
+        perror("socket");
+        freeaddrinfo(res);
+        return false;
+    }
+
+    int on = 1;
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+    if (::bind(sock, res->ai_addr, res->ai_addrlen) == -1) {
+        perror("bind");
+        freeaddrinfo(res);
+        close(sock);
+        return false;
+    }
+
+    freeaddrinfo(res);
+
+    if (listen(sock, 128) == -1) {
+        perror("listen");
+        close(sock);
+        return false;
+    }
+
+    event *ev = event_new(m_ev_base, sock, EV_READ | EV_PERSIST,
+                          ux_accept, this);
+    event_add(ev, NULL);
+
+    ifrule->m_fd2path[sock] = path;
+    ifrule->m_listen_ev[sock] = ev;
+    ifrule->m_tcp_fd.insert(sock);
+
+    std::cout << "listening on " << host << ":" << service
+              << " (" << path << ")" << std::endl;
+
+    return true;
+}
+
+// let the listener accept on the sockets of a rule, and consumers write its
+// pcap files, must be called with m_rw_mutex locked for writing
+void
+fabs_appif::register_ifrule(ptr_ifrule ifrule)
+{
+    for (auto &it: ifrule->m_fd2path) {
+        m_fd2ifrule[it.first] = ifrule;
+    }
+
+    if (ifrule->m_capture)
+        m_ifcapture.push_back(ifrule);
+
+    if (ifrule->m_name == "loopback7" && ! ifrule->m_fd2path.empty())
+        m_fd7 = ifrule->m_fd2path.begin()->first;
+
+    m_routed.push_back(ifrule);
 }
 
+// close the listen sockets of a rule, and unlink UNIX domain sockets if
+// is_unlink
+void
+fabs_appif::close_listen(ifrule &rule, bool is_unlink)
+{
+    for (auto &it: rule.m_listen_ev) {
+        event_del(it.second);
+        event_free(it.second);
+    }
+
+    for (auto &it: rule.m_fd2path) {
+        close(it.first);
+
+        if (is_unlink && rule.m_tcp_fd.count(it.first) == 0) {
+            remove(it.second.c_str());
+
+            std::cout << "closed listening on " << it.second << std::endl;
+        }
+    }
+
+    rule.m_listen_ev.clear();
+    rule.m_fd2path.clear();
+    rule.m_tcp_fd.clear();
+}
 
 void
 fabs_appif::ux_listen()
@@ -684,55 +1222,263 @@ fabs_appif::ux_listen()
     {
         fabs_spin_rwlock_write lock(m_rw_mutex);
 
-        makedir(*m_home);
-        makedir(*m_home / fs::path("tcp"));
-        makedir(*m_home / fs::path("udp"));
+        if (! makedir(*m_home) ||
+            ! makedir(*m_home / fs::path("tcp")) ||
+            ! makedir(*m_home / fs::path("udp")))
+            exit(-1);
+
+        std::vector<ptr_ifrule> rules;
+        get_ifrules(rules);
+
+        for (auto &rule: rules) {
+            if (! ux_listen_ifrule(rule, nullptr))
+                exit(-1);
+
+            register_ifrule(rule);
+        }
+
+        m_ev_reload = evsignal_new(m_ev_base, SIGHUP, ux_reload, this);
+        event_add(m_ev_reload, NULL);
+    }
+
+    {
+        boost::unique_lock<std::mutex> lock(m_mutex_init);
+        m_condition_init.notify_all();
+    }
+
+    event_base_dispatch(m_ev_base);
+}
 
-        for (auto it_tcp = m_ifrule_tcp.begin(); it_tcp != m_ifrule_tcp.end();
-             ++it_tcp) {
-            for (auto it1 = it_tcp->second->ifrule.begin();
-                 it1 != it_tcp->second->ifrule.end(); ++it1) {
-                ux_listen_ifrule(*it1);
+// every rule having interfaces
+void
+fabs_appif::get_ifrules(std::vector<ptr_ifrule> &rules)
+{
+    for (auto storage: {&m_ifrule_tcp, &m_ifrule_udp}) {
+        for (auto &it: *storage) {
+            for (auto lst: {&it.second->ifrule_classifier, &it.second->ifrule,
+                            &it.second->ifrule_no_regex}) {
+                rules.insert(rules.end(), lst->begin(), lst->end());
             }
+        }
+    }
+
+    for (auto rule: {m_ifrule7, m_tcp_default, m_udp_default, m_ifpcap,
+                     m_ifflows}) {
+        if (rule)
+            rules.push_back(rule);
+    }
+}
+
+// whether rhs listens on the same sockets as lhs, and its readers can be
+// kept, which needs every setting fixed to a reader at accepting, e.g. the
+// format, transport, group and backlog
+bool
+fabs_appif::is_same_if(const ifrule &lhs, const ifrule &rhs)
+{
+    // prepare_ifrule has made the spill directory of lhs absolute
+    auto spill_dir = [&](const ifrule &rule) {
+        fs::path dir(rule.m_spill_dir);
+
+        if (! rule.m_spill_dir.empty() && dir.is_relative())
+            dir = *m_home / dir;
+
+        return dir.string();
+    };
+
+    return lhs.m_name == rhs.m_name && lhs.m_proto == rhs.m_proto &&
+        *lhs.m_ux == *rhs.m_ux && lhs.m_balance == rhs.m_balance &&
+        lhs.m_listen == rhs.m_listen && lhs.m_format == rhs.m_format &&
+        lhs.m_is_shm == rhs.m_is_shm && lhs.m_shm_size == rhs.m_shm_size &&
+        lhs.m_is_group == rhs.m_is_group &&
+        lhs.m_backlog_bytes == rhs.m_backlog_bytes &&
+        lhs.m_overflow == rhs.m_overflow &&
+        lhs.m_flush_latency == rhs.m_flush_latency &&
+        spill_dir(lhs) == spill_dir(rhs) &&
+        lhs.m_spill_quota == rhs.m_spill_quota;
+}
+
+// move the listen sockets of old to rule, and old keeps the names of its
+// readers so that flows classified to it are still delivered
+void
+fabs_appif::take_over_ifrule(ptr_ifrule old, ptr_ifrule rule)
+{
+    rule->m_balance_name = old->m_balance_name;
+    rule->m_fd2path      = std::move(old->m_fd2path);
+    rule->m_listen_ev    = std::move(old->m_listen_ev);
+    rule->m_tcp_fd       = std::move(old->m_tcp_fd);
+
+    old->m_fd2path.clear();
+    old->m_listen_ev.clear();
+    old->m_tcp_fd.clear();
+}
+
+// stop accepting on the sockets of a removed rule, and close its readers,
+// must be called with m_rw_mutex locked for writing
+void
+fabs_appif::disconnect_ifrule(ptr_ifrule rule)
+{
+    for (auto &it: rule->m_fd2path) {
+        m_fd2ifrule.erase(it.first);
+    }
+
+    if (rule->m_name == "loopback7")
+        m_fd7 = -1;
+
+    for (auto &name: rule->m_balance_name) {
+        auto it = m_name2uxpeer.find(name);
+        if (it == m_name2uxpeer.end())
+            continue;
+
+        std::set<int> fds = it->second;
+
+        for (auto fd: fds) {
+            ux_close(fd, this);
+        }
+    }
+}
+
+// replace the rules by those of the configuration file
+// regular expressions, sockets and pcap files are made before locking, and
+// any error keeps the current rules
+// consumers switch to the new rules by the generation, while flows
+// classified before keep their rules
+// global settings are not reloaded
+void
+fabs_appif::reload_conf()
+{
+    fabs_conf conf;
+
+    if (m_conf_path.empty() || ! conf.read_conf(m_conf_path)) {
+        std::cerr << "could not reload " << m_conf_path
+                  << ", keep the current rules" << std::endl;
+        return;
+    }
+
+    std::vector<ptr_ifrule> newrules;
 
-            for (auto it2 = it_tcp->second->ifrule_no_regex.begin();
-                 it2 != it_tcp->second->ifrule_no_regex.end(); ++it2) {
-                ux_listen_ifrule(*it2);
+    for (auto &it: conf.m_conf) {
+        if (it.first == "global")
+            continue;
+
+        auto rule = read_ifrule(it.first, it.second);
+        if (! rule) {
+            std::cerr << "could not reload " << m_conf_path
+                      << ", keep the current rules" << std::endl;
+            return;
+        }
+
+        // ignored by add_ifrule
+        if (rule->m_proto == IF_OTHER && rule->m_name != "loopback7" &&
+            rule->m_name != "pcap" && rule->m_name != "flows")
+            continue;
+
+        newrules.push_back(rule);
+    }
+
+    // only this thread replaces the rules
+    std::vector<ptr_ifrule> oldrules;
+    get_ifrules(oldrules);
+
+    std::vector<std::pair<ptr_ifrule, ptr_ifrule>> kept;
+    std::vector<ptr_ifrule> added;
+    renames_t renames;
+
+    for (auto &rule: newrules) {
+        auto it = std::find_if(oldrules.begin(), oldrules.end(),
+                               [&](const ptr_ifrule &old) {
+                                   return is_same_if(*old, *rule);
+                               });
+
+        bool is_ok;
+
+        if (it != oldrules.end()) {
+            auto &old = *it;
+
+            if (old->m_capture && rule->m_capture_dir == old->m_capture_dir &&
+                rule->m_capture_bytes == old->m_capture_bytes &&
+                rule->m_capture_time == old->m_capture_time) {
+                rule->m_capture = old->m_capture;
             }
+
+            kept.push_back(std::make_pair(old, rule));
+            oldrules.erase(it);
+
+            is_ok = prepare_ifrule(rule);
+        } else {
+            added.push_back(rule);
+
+            is_ok = ux_listen_ifrule(rule, &renames);
         }
 
-        for (auto it_udp = m_ifrule_udp.begin(); it_udp != m_ifrule_udp.end();
-             ++it_udp) {
-            for (auto it1 = it_udp->second->ifrule.begin();
-                 it1 != it_udp->second->ifrule.end(); ++it1) {
-                ux_listen_ifrule(*it1);
+        if (! is_ok) {
+            for (auto &r: added) {
+                close_listen(*r, false);
             }
 
-            for (auto it2 = it_udp->second->ifrule_no_regex.begin();
-                 it2 != it_udp->second->ifrule_no_regex.end(); ++it2) {
-                ux_listen_ifrule(*it2);
+            for (auto &r: renames) {
+                remove(r.first.c_str());
             }
+
+            std::cerr << "could not reload " << m_conf_path
+                      << ", keep the current rules" << std::endl;
+            return;
+        }
+    }
+
+    {
+        fabs_spin_rwlock_write lock(m_rw_mutex);
+
+        m_ifrule_tcp.clear();
+        m_ifrule_udp.clear();
+        m_ifrule7.reset();
+        m_tcp_default.reset();
+        m_udp_default.reset();
+        m_ifpcap.reset();
+        m_ifflows.reset();
+        m_ifcapture.clear();
+
+        for (auto &rule: newrules) {
+            add_ifrule(rule);
+        }
+
+        set_classify_limit();
+
+        for (auto &k: kept) {
+            take_over_ifrule(k.first, k.second);
+        }
+
+        for (auto &rule: oldrules) {
+            disconnect_ifrule(rule);
         }
 
-        if (m_ifrule7)
-            ux_listen_ifrule(m_ifrule7);
+        for (auto &rule: newrules) {
+            register_ifrule(rule);
+            update_route(*rule);
+        }
 
-        if (m_tcp_default)
-            ux_listen_ifrule(m_tcp_default);
+        m_rule_gen++;
+    }
 
-        if (m_udp_default)
-            ux_listen_ifrule(m_udp_default);
+    // paths of removed rules may be reused by added ones
+    for (auto &rule: oldrules) {
+        close_listen(*rule, true);
 
-        if (m_ifpcap)
-            ux_listen_ifrule(m_ifpcap);
+        // connections feeding the removed input
+        if (rule->m_name == "loopback7" || rule->m_name == "pcap") {
+            for (auto &io: m_io) {
+                io->close_conns(rule->m_name == "loopback7");
+            }
+        }
     }
 
-    {
-        boost::unique_lock<std::mutex> lock(m_mutex_init);
-        m_condition_init.notify_all();
+    for (auto &r: renames) {
+        if (rename(r.first.c_str(), r.second.c_str()) < 0)
+            perror("rename");
     }
 
-    event_base_dispatch(m_ev_base);
+    std::cout << "reloaded " << m_conf_path << ": rules = " << newrules.size()
+              << ", added = " << added.size()
+              << ", removed = " << oldrules.size() << std::endl;
 }
 
 void
@@ -778,6 +1524,72 @@ fabs_appif::read_conf(fabs_conf &conf)
                 }
             }
 
+            it2 = it1->second.find("endpoint_cache");
+            if (it2 != it1->second.end()) {
+                if (it2->second == "yes") {
+                    m_is_ep_cache = true;
+                } else if (it2->second == "no") {
+                    m_is_ep_cache = false;
+                } else {
+                    // error
+                }
+            }
+
+            it2 = it1->second.find("endpoint_cache_validate");
+            if (it2 != it1->second.end()) {
+                if (it2->second == "yes") {
+                    m_is_ep_validate = true;
+                } else if (it2->second == "no") {
+                    m_is_ep_validate = false;
+                } else {
+                    // error
+                }
+            }
+
+            it2 = it1->second.find("endpoint_cache_ttl");
+            if (it2 != it1->second.end()) {
+                try {
+                    m_ep_ttl = boost::lexical_cast<time_t>(it2->second);
+                } catch (boost::bad_lexical_cast e) {
+                    std::cerr << "cannot convert \"" << it2->second
+                              << "\" to time_t" << std::endl;
+                }
+            }
+
+            it2 = it1->second.find("endpoint_cache_size");
+            if (it2 != it1->second.end()) {
+                try {
+                    m_ep_size = boost::lexical_cast<size_t>(it2->second);
+                } catch (boost::bad_lexical_cast e) {
+                    std::cerr << "cannot convert \"" << it2->second
+                              << "\" to size_t" << std::endl;
+                }
+            }
+
+            it2 = it1->second.find("endpoint_cache_prefix4");
+            if (it2 != it1->second.end()) {
+                try {
+                    m_ep_prefix4 = boost::lexical_cast<int>(it2->second);
+                    if (m_ep_prefix4 < 0 || m_ep_prefix4 > 32)
+                        m_ep_prefix4 = 0;
+                } catch (boost::bad_lexical_cast e) {
+                    std::cerr << "cannot convert \"" << it2->second
+                              << "\" to int" << std::endl;
+                }
+            }
+
+            it2 = it1->second.find("endpoint_cache_prefix6");
+            if (it2 != it1->second.end()) {
+                try {
+                    m_ep_prefix6 = boost::lexical_cast<int>(it2->second);
+                    if (m_ep_prefix6 < 0 || m_ep_prefix6 > 128)
+                        m_ep_prefix6 = 0;
+                } catch (boost::bad_lexical_cast e) {
+                    std::cerr << "cannot convert \"" << it2->second
+                              << "\" to int" << std::endl;
+                }
+            }
+
             it2 = it1->second.find("regex_threads");
             if (it2 != it1->second.end()) {
                 try {
@@ -797,10 +1609,10 @@ fabs_appif::read_conf(fabs_conf &conf)
                 m_num_consumer = 1024;
             }
 
-            it2 = it1->second.find("tcp_threads");
+            it2 = it1->second.find("classify_bytes");
             if (it2 != it1->second.end()) {
                 try {
-                    m_num_tcp_threads = boost::lexical_cast<int>(it2->second);
+                    m_classify_bytes = boost::lexical_cast<int>(it2->second);
                 } catch (boost::bad_lexical_cast e) {
                     std::cerr << "cannot convert \"" << it2->second
                               << "\" to int" << std::endl;
@@ -808,202 +1620,737 @@ fabs_appif::read_conf(fabs_conf &conf)
                 }
             }
 
-            m_num_tcp_threads = m_num_tcp_threads - (m_num_tcp_threads % 2);
-
-            if (m_num_tcp_threads <= 1) {
-                m_num_tcp_threads = 2;
-            } else if (m_num_tcp_threads > 1024) {
-                m_num_tcp_threads = 1024;
-            }
-        } else {
-            ptr_ifrule rule = ptr_ifrule(new ifrule);
-
-            rule->m_name = it1->first;
-            auto it3 = it1->second.find("if");
-            if (it3 == it1->second.end()) {
-                rule->m_ux = ptr_path(new fs::path(it1->first));
-            } else {
-                rule->m_ux = ptr_path(new fs::path(it3->second));
-            }
-
-            RE2::RE2::Options opt;
-            opt.set_dot_nl(true);
-            opt.set_utf8(false);
-
-            it3 = it1->second.find("utf8");
-            if (it3 != it1->second.end()) {
-                if (it3->second == "yes")
-                    opt.set_utf8(true);
-            }
-
-            it3 = it1->second.find("up");
-            if (it3 != it1->second.end()) {
-                rule->m_up = ptr_regex(new RE2(it3->second, opt));
-            }
-
-            it3 = it1->second.find("down");
-            if (it3 != it1->second.end()) {
-                rule->m_down = ptr_regex(new RE2(it3->second, opt));
-            }
-
-            it3 = it1->second.find("nice");
-            if (it3 != it1->second.end()) {
+            it2 = it1->second.find("classify_time");
+            if (it2 != it1->second.end()) {
                 try {
-                    rule->m_nice = boost::lexical_cast<int>(it3->second);
+                    m_classify_time = boost::lexical_cast<int>(it2->second);
                 } catch (boost::bad_lexical_cast e) {
-                    std::cerr << "cannot convert \"" << it3->second
+                    std::cerr << "cannot convert \"" << it2->second
                               << "\" to int" << std::endl;
                     continue;
                 }
             }
 
-
-            it3 = it1->second.find("proto");
-            if (it3 != it1->second.end()) {
-                if (it3->second == "TCP") {
-                    rule->m_proto = IF_TCP;
-                } else if (it3->second == "UDP") {
-                    rule->m_proto = IF_UDP;
+            it2 = it1->second.find("unidirectional");
+            if (it2 != it1->second.end()) {
+                if (it2->second == "yes") {
+                    m_is_unidir = true;
                 } else {
-                    // error
+                    m_is_unidir = false;
                 }
-            } else {
-                // error
             }
 
-            it3 = it1->second.find("format");
-            if (it3 != it1->second.end()) {
-                if (it3->second == "binary") {
-                    rule->m_format = IF_BINARY;
-                } else if (it3->second == "text") {
-                    rule->m_format = IF_TEXT;
+            it2 = it1->second.find("classify_pool");
+            if (it2 != it1->second.end()) {
+                if (it2->second == "yes") {
+                    m_is_classify_pool = true;
                 } else {
-                    // error
+                    m_is_classify_pool = false;
                 }
             }
 
-            it3 = it1->second.find("body");
-            if (it3 != it1->second.end()) {
-                if (it3->second == "yes") {
-                    rule->m_is_body = true;
-                } else if (it3->second == "no") {
-                    rule->m_is_body = false;
-                } else {
-                    // error
+            it2 = it1->second.find("tcp_threads");
+            if (it2 != it1->second.end()) {
+                try {
+                    m_num_tcp_threads = boost::lexical_cast<int>(it2->second);
+                } catch (boost::bad_lexical_cast e) {
+                    std::cerr << "cannot convert \"" << it2->second
+                              << "\" to int" << std::endl;
+                    continue;
                 }
             }
 
-            it3 = it1->second.find("balance");
-            if (it3 != it1->second.end()) {
-                try {
-                    rule->m_balance = boost::lexical_cast<int>(it3->second);
-                    if (rule->m_balance < 1) {
-                        rule->m_balance = 1;
-                    }
+            m_num_tcp_threads = m_num_tcp_threads - (m_num_tcp_threads % 2);
 
-                    if (rule->m_balance > 1) {
-                        rule->m_balance = rule->m_balance - (rule->m_balance % 2);
-                    }
+            if (m_num_tcp_threads <= 1) {
+                m_num_tcp_threads = 2;
+            } else if (m_num_tcp_threads > 1024) {
+                m_num_tcp_threads = 1024;
+            }
+
+            it2 = it1->second.find("writer_threads");
+            if (it2 != it1->second.end()) {
+                try {
+                    m_num_writer = boost::lexical_cast<int>(it2->second);
                 } catch (boost::bad_lexical_cast e) {
-                    std::cerr << "cannot convert \"" << it3->second
+                    std::cerr << "cannot convert \"" << it2->second
                               << "\" to int" << std::endl;
                     continue;
                 }
             }
 
-            it3 = it1->second.find("port");
-            if (it3 != it1->second.end()) {
-                std::stringstream ss(it3->second);
-
-                while (ss) {
-                    std::string port, n1, n2;
-                    std::getline(ss, port, ',');
+            if (m_num_writer < 1) {
+                m_num_writer = 1;
+            } else if (m_num_writer > 1024) {
+                m_num_writer = 1024;
+            }
 
-                    if (port.empty())
-                        break;
+            it2 = it1->second.find("io_threads");
+            if (it2 != it1->second.end()) {
+                try {
+                    m_num_io = boost::lexical_cast<int>(it2->second);
+                } catch (boost::bad_lexical_cast e) {
+                    std::cerr << "cannot convert \"" << it2->second
+                              << "\" to int" << std::endl;
+                    continue;
+                }
+            }
 
-                    port = trim(port);
+            if (m_num_io < 1) {
+                m_num_io = 1;
+            } else if (m_num_io > 1024) {
+                m_num_io = 1024;
+            }
 
-                    std::stringstream ss2(port);
-                    std::getline(ss2, n1, '-');
-                    std::getline(ss2, n2);
+            it2 = it1->second.find("hugepage");
+            if (it2 != it1->second.end()) {
+                fabs_pool::set_hugepage(it2->second == "yes");
+            }
 
-                    n1 = trim(n1);
-                    n2 = trim(n2);
+            it2 = it1->second.find("udp_timeout");
+            if (it2 != it1->second.end()) {
+                try {
+                    m_udp_timeout = boost::lexical_cast<time_t>(it2->second);
+                } catch (boost::bad_lexical_cast e) {
+                    std::cerr << "cannot convert \"" << it2->second
+                              << "\" to time_t" << std::endl;
+                    continue;
+                }
+            }
 
-                    std::pair<uint16_t, uint16_t> range;
+            it2 = it1->second.find("udp_flow_size");
+            if (it2 != it1->second.end()) {
+                try {
+                    m_udp_flow_size = boost::lexical_cast<size_t>(it2->second);
+                } catch (boost::bad_lexical_cast e) {
+                    std::cerr << "cannot convert \"" << it2->second
+                              << "\" to size_t" << std::endl;
+                    continue;
+                }
+            }
 
-                    try {
-                        range.first = boost::lexical_cast<uint16_t>(n1);
-                    } catch (boost::bad_lexical_cast e) {
-                        std::cerr << "cannot convert \"" << n1
-                                  << "\" to uint16_t" << std::endl;
-                        continue;
-                    }
+            it2 = it1->second.find("flush_bytes");
+            if (it2 != it1->second.end()) {
+                try {
+                    m_flush_bytes = boost::lexical_cast<size_t>(it2->second);
+                } catch (boost::bad_lexical_cast e) {
+                    std::cerr << "cannot convert \"" << it2->second
+                              << "\" to int" << std::endl;
+                    continue;
+                }
+            }
 
-                    if (n2.size() > 0) {
-                        try {
-                            range.second = boost::lexical_cast<uint16_t>(n2);
-                        } catch (boost::bad_lexical_cast e) {
-                            std::cerr << "cannot convert \"" << n2
-                                      << "\" to uint16_t" << std::endl;
-                            continue;
-                        }
-                    } else {
-                        range.second = range.first;
-                    }
+            it2 = it1->second.find("backlog_bytes");
+            if (it2 != it1->second.end()) {
+                try {
+                    m_backlog_bytes = boost::lexical_cast<size_t>(it2->second);
+                } catch (boost::bad_lexical_cast e) {
+                    std::cerr << "cannot convert \"" << it2->second
+                              << "\" to int" << std::endl;
+                    continue;
+                }
+            }
 
-                    rule->m_port->push_back(range);
+            it2 = it1->second.find("overflow");
+            if (it2 != it1->second.end()) {
+                if (it2->second == "drop") {
+                    m_overflow = OVERFLOW_DROP;
+                } else if (it2->second == "keep_control") {
+                    m_overflow = OVERFLOW_KEEP_CONTROL;
+                } else if (it2->second == "disconnect") {
+                    m_overflow = OVERFLOW_DISCONNECT;
+                } else {
+                    std::cerr << "unknown overflow policy \"" << it2->second
+                              << "\"" << std::endl;
                 }
             }
 
-            // insert interface rule
-            if (rule->m_name == "loopback7") {
-                m_ifrule7 = rule;
-                m_lb7_format = rule->m_format;
-            } else if (rule->m_name == "tcp_default") {
-                m_tcp_default = rule;
-            } else if (rule->m_name == "udp_default") {
-                m_udp_default = rule;
-            } else if (rule->m_name == "pcap") {
-                m_ifpcap = rule;
-            } else if (rule->m_proto == IF_UDP) {
-                auto it_udp = m_ifrule_udp.find(rule->m_nice);
-                if (it_udp == m_ifrule_udp.end()) {
-                    m_ifrule_udp[rule->m_nice] = ptr_ifrule_storage(new ifrule_storage);
-                    it_udp = m_ifrule_udp.find(rule->m_nice);
+            uint64_t mem_soft = 0, mem_hard = 0;
+
+            it2 = it1->second.find("mem_soft_limit");
+            if (it2 != it1->second.end()) {
+                try {
+                    mem_soft = boost::lexical_cast<uint64_t>(it2->second);
+                } catch (boost::bad_lexical_cast e) {
+                    std::cerr << "cannot convert \"" << it2->second
+                              << "\" to int" << std::endl;
+                    continue;
                 }
+            }
 
-                if (rule->m_up)
-                    it_udp->second->ifrule.push_back(rule);
-                else
-                    it_udp->second->ifrule_no_regex.push_back(rule);
-            } else if (rule->m_proto == IF_TCP) {
-                auto it_tcp = m_ifrule_tcp.find(rule->m_nice);
-                if (it_tcp == m_ifrule_tcp.end()) {
-                    m_ifrule_tcp[rule->m_nice] = ptr_ifrule_storage(new ifrule_storage);
-                    it_tcp = m_ifrule_tcp.find(rule->m_nice);
+            it2 = it1->second.find("mem_hard_limit");
+            if (it2 != it1->second.end()) {
+                try {
+                    mem_hard = boost::lexical_cast<uint64_t>(it2->second);
+                } catch (boost::bad_lexical_cast e) {
+                    std::cerr << "cannot convert \"" << it2->second
+                              << "\" to int" << std::endl;
+                    continue;
                 }
+            }
 
-                if (rule->m_up && rule->m_down) {
-                    it_tcp->second->ifrule.push_back(rule);
-                } else {
-                    it_tcp->second->ifrule_no_regex.push_back(rule);
+            fabs_mem::set_limit(mem_soft, mem_hard);
+        } else {
+            auto rule = read_ifrule(it1->first, it1->second);
+            if (rule)
+                add_ifrule(rule);
+        }
+    }
+
+    m_conf_path = conf.m_path;
+
+    set_classify_limit();
+}
+
+// parse the configuration of an interface, return nullptr on errors
+fabs_appif::ptr_ifrule
+fabs_appif::read_ifrule(const std::string &name,
+                        const std::map<std::string, std::string> &conf)
+{
+    ptr_ifrule rule = ptr_ifrule(new ifrule);
+
+    rule->m_name = name;
+    auto it3 = conf.find("if");
+    if (it3 == conf.end()) {
+        rule->m_ux = ptr_path(new fs::path(name));
+    } else {
+        rule->m_ux = ptr_path(new fs::path(it3->second));
+    }
+
+    RE2::RE2::Options opt;
+    opt.set_dot_nl(true);
+    opt.set_utf8(false);
+
+    it3 = conf.find("utf8");
+    if (it3 != conf.end()) {
+        if (it3->second == "yes")
+            opt.set_utf8(true);
+    }
+
+    it3 = conf.find("up");
+    if (it3 != conf.end()) {
+        rule->m_up = ptr_regex(new RE2(it3->second, opt));
+    }
+
+    it3 = conf.find("down");
+    if (it3 != conf.end()) {
+        rule->m_down = ptr_regex(new RE2(it3->second, opt));
+    }
+
+    it3 = conf.find("classifier");
+    if (it3 != conf.end()) {
+        fabs_classifier_type type = fabs_classifier::get_type(it3->second);
+        if (type == CLASSIFIER_NONE) {
+            std::cerr << "unknown classifier \"" << it3->second
+                      << "\"" << std::endl;
+        } else {
+            rule->m_classifier = ptr_classifier(new fabs_classifier(type));
+        }
+    }
+
+    it3 = conf.find("nice");
+    if (it3 != conf.end()) {
+        try {
+            rule->m_nice = boost::lexical_cast<int>(it3->second);
+        } catch (boost::bad_lexical_cast e) {
+            std::cerr << "cannot convert \"" << it3->second
+                      << "\" to int" << std::endl;
+            return nullptr;
+        }
+    }
+
+    it3 = conf.find("classify_bytes");
+    if (it3 != conf.end()) {
+        try {
+            rule->m_classify_bytes = boost::lexical_cast<int>(it3->second);
+        } catch (boost::bad_lexical_cast e) {
+            std::cerr << "cannot convert \"" << it3->second
+                      << "\" to int" << std::endl;
+            return nullptr;
+        }
+    }
+
+    it3 = conf.find("classify_time");
+    if (it3 != conf.end()) {
+        try {
+            rule->m_classify_time = boost::lexical_cast<int>(it3->second);
+        } catch (boost::bad_lexical_cast e) {
+            std::cerr << "cannot convert \"" << it3->second
+                      << "\" to int" << std::endl;
+            return nullptr;
+        }
+    }
+
+    it3 = conf.find("unidirectional");
+    if (it3 != conf.end()) {
+        if (it3->second == "yes") {
+            rule->m_unidir = 1;
+        } else if (it3->second == "no") {
+            rule->m_unidir = 0;
+        } else {
+            // error
+        }
+    }
+
+    it3 = conf.find("flush_latency");
+    if (it3 != conf.end()) {
+        try {
+            rule->m_flush_latency = boost::lexical_cast<int>(it3->second);
+        } catch (boost::bad_lexical_cast e) {
+            std::cerr << "cannot convert \"" << it3->second
+                      << "\" to int" << std::endl;
+            return nullptr;
+        }
+    }
+
+    it3 = conf.find("max_body_per_dir");
+    if (it3 != conf.end()) {
+        try {
+            rule->m_max_body = boost::lexical_cast<long>(it3->second);
+        } catch (boost::bad_lexical_cast e) {
+            std::cerr << "cannot convert \"" << it3->second
+                      << "\" to int" << std::endl;
+            return nullptr;
+        }
+    }
+
+    it3 = conf.find("max_event_len");
+    if (it3 != conf.end()) {
+        try {
+            rule->m_max_event_len = boost::lexical_cast<int>(it3->second);
+        } catch (boost::bad_lexical_cast e) {
+            std::cerr << "cannot convert \"" << it3->second
+                      << "\" to int" << std::endl;
+            return nullptr;
+        }
+    }
+
+    it3 = conf.find("sample");
+    if (it3 != conf.end()) {
+        // "1/N" or "N"
+        std::string n = it3->second;
+        auto pos = n.find('/');
+
+        if (pos != std::string::npos) {
+            if (n.substr(0, pos) != "1") {
+                std::cerr << "sample must be \"1/N\": " << n
+                          << std::endl;
+                return nullptr;
+            }
+
+            n = n.substr(pos + 1);
+        }
+
+        try {
+            rule->m_sample = boost::lexical_cast<int>(n);
+        } catch (boost::bad_lexical_cast e) {
+            std::cerr << "cannot convert \"" << n
+                      << "\" to int" << std::endl;
+            return nullptr;
+        }
+
+        if (rule->m_sample < 1)
+            rule->m_sample = 1;
+    }
+
+    it3 = conf.find("group");
+    if (it3 != conf.end()) {
+        if (it3->second == "yes") {
+            rule->m_is_group = true;
+        } else if (it3->second == "no") {
+            rule->m_is_group = false;
+        } else {
+            // error
+        }
+    }
+
+    it3 = conf.find("summary");
+    if (it3 != conf.end()) {
+        if (it3->second == "yes") {
+            rule->m_is_summary = true;
+        } else if (it3->second == "no") {
+            rule->m_is_summary = false;
+        } else {
+            // error
+        }
+    }
+
+    it3 = conf.find("capture");
+    if (it3 != conf.end()) {
+        rule->m_capture_dir = it3->second;
+    }
+
+    it3 = conf.find("capture_bytes");
+    if (it3 != conf.end()) {
+        try {
+            rule->m_capture_bytes = boost::lexical_cast<uint64_t>(it3->second);
+        } catch (boost::bad_lexical_cast e) {
+            std::cerr << "cannot convert \"" << it3->second
+                      << "\" to int" << std::endl;
+            return nullptr;
+        }
+    }
+
+    it3 = conf.find("capture_time");
+    if (it3 != conf.end()) {
+        try {
+            rule->m_capture_time = boost::lexical_cast<time_t>(it3->second);
+        } catch (boost::bad_lexical_cast e) {
+            std::cerr << "cannot convert \"" << it3->second
+                      << "\" to time_t" << std::endl;
+            return nullptr;
+        }
+    }
+
+    it3 = conf.find("spill");
+    if (it3 != conf.end()) {
+        rule->m_spill_dir = it3->second;
+    }
+
+    it3 = conf.find("spill_quota");
+    if (it3 != conf.end()) {
+        try {
+            rule->m_spill_quota = boost::lexical_cast<uint64_t>(it3->second);
+        } catch (boost::bad_lexical_cast e) {
+            std::cerr << "cannot convert \"" << it3->second
+                      << "\" to int" << std::endl;
+            return nullptr;
+        }
+    }
+
+    it3 = conf.find("listen");
+    if (it3 != conf.end()) {
+        rule->m_listen = it3->second;
+
+        auto pos = rule->m_listen.rfind(':');
+        if (pos == std::string::npos) {
+            std::cerr << "listen must be \"host:port\": " << rule->m_listen
+                      << std::endl;
+            return nullptr;
+        }
+
+        int port;
+
+        try {
+            port = boost::lexical_cast<int>(rule->m_listen.substr(pos + 1));
+        } catch (boost::bad_lexical_cast e) {
+            std::cerr << "cannot convert \"" << rule->m_listen.substr(pos + 1)
+                      << "\" to int" << std::endl;
+            return nullptr;
+        }
+
+        if (port <= 0 || port > 65535) {
+            std::cerr << "invalid port of listen: " << rule->m_listen
+                      << std::endl;
+            return nullptr;
+        }
+    }
+
+    it3 = conf.find("transport");
+    if (it3 != conf.end()) {
+        if (it3->second == "shm") {
+            rule->m_is_shm = true;
+        } else if (it3->second == "socket") {
+            rule->m_is_shm = false;
+        } else {
+            std::cerr << "unknown transport \"" << it3->second
+                      << "\"" << std::endl;
+        }
+    }
+
+    it3 = conf.find("shm_size");
+    if (it3 != conf.end()) {
+        try {
+            rule->m_shm_size = boost::lexical_cast<size_t>(it3->second);
+        } catch (boost::bad_lexical_cast e) {
+            std::cerr << "cannot convert \"" << it3->second
+                      << "\" to int" << std::endl;
+            return nullptr;
+        }
+    }
+
+    it3 = conf.find("backlog_bytes");
+    if (it3 != conf.end()) {
+        try {
+            rule->m_backlog_bytes = boost::lexical_cast<long>(it3->second);
+        } catch (boost::bad_lexical_cast e) {
+            std::cerr << "cannot convert \"" << it3->second
+                      << "\" to int" << std::endl;
+            return nullptr;
+        }
+    }
+
+    it3 = conf.find("overflow");
+    if (it3 != conf.end()) {
+        if (it3->second == "drop") {
+            rule->m_overflow = OVERFLOW_DROP;
+        } else if (it3->second == "keep_control") {
+            rule->m_overflow = OVERFLOW_KEEP_CONTROL;
+        } else if (it3->second == "disconnect") {
+            rule->m_overflow = OVERFLOW_DISCONNECT;
+        } else {
+            std::cerr << "unknown overflow policy \"" << it3->second
+                      << "\"" << std::endl;
+        }
+    }
+
+    it3 = conf.find("proto");
+    if (it3 != conf.end()) {
+        if (it3->second == "TCP") {
+            rule->m_proto = IF_TCP;
+        } else if (it3->second == "UDP") {
+            rule->m_proto = IF_UDP;
+        } else {
+            // error
+        }
+    } else {
+        // error
+    }
+
+    it3 = conf.find("format");
+    if (it3 != conf.end()) {
+        if (it3->second == "binary") {
+            rule->m_format = IF_BINARY;
+        } else if (it3->second == "binary2") {
+            rule->m_format = IF_BINARY2;
+        } else if (it3->second == "text") {
+            rule->m_format = IF_TEXT;
+        } else {
+            // error
+        }
+    }
+
+    // loopback7 reads headers of text or binary alone
+    if (name == "loopback7" && rule->m_format == IF_BINARY2) {
+        std::cerr << "loopback7 cannot read format binary2" << std::endl;
+        return nullptr;
+    }
+
+    it3 = conf.find("body");
+    if (it3 != conf.end()) {
+        if (it3->second == "yes") {
+            rule->m_is_body = true;
+        } else if (it3->second == "no") {
+            rule->m_is_body = false;
+        } else {
+            // error
+        }
+    }
+
+    it3 = conf.find("balance");
+    if (it3 != conf.end()) {
+        try {
+            rule->m_balance = boost::lexical_cast<int>(it3->second);
+            if (rule->m_balance < 1) {
+                rule->m_balance = 1;
+            }
+
+            if (rule->m_balance > 1) {
+                rule->m_balance = rule->m_balance - (rule->m_balance % 2);
+            }
+        } catch (boost::bad_lexical_cast e) {
+            std::cerr << "cannot convert \"" << it3->second
+                      << "\" to int" << std::endl;
+            return nullptr;
+        }
+    }
+
+    it3 = conf.find("port");
+    if (it3 != conf.end()) {
+        std::stringstream ss(it3->second);
+
+        while (ss) {
+            std::string port, n1, n2;
+            std::getline(ss, port, ',');
+
+            if (port.empty())
+                break;
+
+            port = trim(port);
+
+            std::stringstream ss2(port);
+            std::getline(ss2, n1, '-');
+            std::getline(ss2, n2);
+
+            n1 = trim(n1);
+            n2 = trim(n2);
+
+            std::pair<uint16_t, uint16_t> range;
+
+            try {
+                range.first = boost::lexical_cast<uint16_t>(n1);
+            } catch (boost::bad_lexical_cast e) {
+                std::cerr << "cannot convert \"" << n1
+                          << "\" to uint16_t" << std::endl;
+                continue;
+            }
+
+            if (n2.size() > 0) {
+                try {
+                    range.second = boost::lexical_cast<uint16_t>(n2);
+                } catch (boost::bad_lexical_cast e) {
+                    std::cerr << "cannot convert \"" << n2
+                              << "\" to uint16_t" << std::endl;
+                    continue;
                 }
+            } else {
+                range.second = range.first;
+            }
+
+            rule->m_port->push_back(range);
+        }
+    }
+
+    return rule;
+}
+
+// insert an interface rule
+void
+fabs_appif::add_ifrule(ptr_ifrule rule)
+{
+    if (rule->m_name == "loopback7") {
+        m_ifrule7 = rule;
+    } else if (rule->m_name == "tcp_default") {
+        m_tcp_default = rule;
+    } else if (rule->m_name == "udp_default") {
+        m_udp_default = rule;
+    } else if (rule->m_name == "pcap") {
+        m_ifpcap = rule;
+    } else if (rule->m_name == "flows") {
+        // records share the framing of binary2
+        if (rule->m_format == IF_BINARY)
+            rule->m_format = IF_BINARY2;
+
+        m_ifflows = rule;
+    } else if (rule->m_proto == IF_UDP) {
+        auto it_udp = m_ifrule_udp.find(rule->m_nice);
+        if (it_udp == m_ifrule_udp.end()) {
+            m_ifrule_udp[rule->m_nice] = ptr_ifrule_storage(new ifrule_storage);
+            it_udp = m_ifrule_udp.find(rule->m_nice);
+        }
+
+        if (rule->m_classifier)
+            it_udp->second->ifrule_classifier.push_back(rule);
+        else if (rule->m_up)
+            it_udp->second->ifrule.push_back(rule);
+        else
+            it_udp->second->ifrule_no_regex.push_back(rule);
+    } else if (rule->m_proto == IF_TCP) {
+        auto it_tcp = m_ifrule_tcp.find(rule->m_nice);
+        if (it_tcp == m_ifrule_tcp.end()) {
+            m_ifrule_tcp[rule->m_nice] = ptr_ifrule_storage(new ifrule_storage);
+            it_tcp = m_ifrule_tcp.find(rule->m_nice);
+        }
+
+        if (rule->m_classifier) {
+            it_tcp->second->ifrule_classifier.push_back(rule);
+        } else if (rule->m_up && rule->m_down) {
+            it_tcp->second->ifrule.push_back(rule);
+        } else {
+            it_tcp->second->ifrule_no_regex.push_back(rule);
+        }
+    }
+}
+
+// apply global classification settings to the rules which do not have
+// their own, and get the limits of each priority
+void
+fabs_appif::set_classify_limit()
+{
+    m_classify_bytes_max = -1;
+    m_classify_time_max  = -1;
+    m_has_unidir = false;
+
+    // larger one, but 0 of time means no limit
+    auto max_time = [](int a, int b) {
+        if (a < 0)
+            return b;
+        if (a == 0 || b == 0)
+            return 0;
+        return std::max(a, b);
+    };
+
+    for (auto &it_tcp: m_ifrule_tcp) {
+        auto &st = it_tcp.second;
+
+        st->max_bytes = -1;
+        st->max_time  = -1;
+
+        for (auto lst: {&st->ifrule_classifier, &st->ifrule,
+                        &st->ifrule_no_regex}) {
+            for (auto &rule: *lst) {
+                if (rule->m_classify_bytes < 0)
+                    rule->m_classify_bytes = m_classify_bytes;
+
+                if (rule->m_classify_time < 0)
+                    rule->m_classify_time = m_classify_time;
+
+                if (rule->m_unidir < 0)
+                    rule->m_unidir = m_is_unidir ? 1 : 0;
+
+                if (rule->m_unidir)
+                    m_has_unidir = true;
+
+                st->max_bytes = std::max(st->max_bytes, rule->m_classify_bytes);
+                st->max_time  = max_time(st->max_time, rule->m_classify_time);
             }
         }
+
+        // a unidirectional rule can have only one of up and down
+        for (auto it = st->ifrule_no_regex.begin();
+             it != st->ifrule_no_regex.end(); ) {
+            if ((*it)->m_unidir && ((*it)->m_up || (*it)->m_down)) {
+                st->ifrule.push_back(*it);
+                it = st->ifrule_no_regex.erase(it);
+            } else {
+                ++it;
+            }
+        }
+
+        m_classify_bytes_max = std::max(m_classify_bytes_max, st->max_bytes);
+        m_classify_time_max  = max_time(m_classify_time_max, st->max_time);
     }
+
+    if (m_classify_bytes_max < 0)
+        m_classify_bytes_max = m_classify_bytes;
+
+    if (m_classify_time_max < 0)
+        m_classify_time_max = m_classify_time;
 }
 
 void
 fabs_appif::in_event(fabs_stream_event st_event,
                      const fabs_id_dir &id_dir, ptr_fabs_bytes bytes)
 {
-    appif_event *ev = new appif_event;
+    appif_event ev;
+
+    bytes->charge(MEM_QUEUE);
+
+    ev.st_event = st_event;
+    ev.id_dir   = id_dir;
+    ev.tm       = bytes->m_tm;
+    ev.bytes    = std::move(bytes);
+    ev.is_stat  = false;
+
+    int id = id_dir.m_id.get_hash() & (m_num_consumer - 1);
+
+    m_consumer[id]->produce(ev);
+}
+
+void
+fabs_appif::in_event(fabs_stream_event st_event,
+                     const fabs_id_dir &id_dir, const timeval &tm,
+                     const fabs_flow_stat *stat)
+{
+    appif_event ev;
+
+    ev.st_event = st_event;
+    ev.id_dir   = id_dir;
+    ev.tm       = tm;
+    ev.is_stat  = stat != nullptr;
 
-    ev->st_event = st_event;
-    ev->id_dir   = id_dir;
-    ev->bytes    = std::move(bytes);
+    if (stat)
+        ev.stat = *stat;
 
     int id = id_dir.m_id.get_hash() & (m_num_consumer - 1);
 
@@ -1011,18 +2358,35 @@ fabs_appif::in_event(fabs_stream_event st_event,
 }
 
 void
-fabs_appif::appif_consumer::in_stream_event(fabs_stream_event st_event,
-                                            const fabs_id_dir &id_dir,
-                                            ptr_fabs_bytes bytes)
+fabs_appif::appif_consumer::in_stream_event(appif_event &ev)
 {
-    switch (st_event) {
+    const fabs_id_dir &id_dir = ev.id_dir;
+    const timeval     &tm     = ev.tm;
+    ptr_fabs_bytes    &bytes  = ev.bytes;
+
+    switch (ev.st_event) {
     case STREAM_SYN:
     case STREAM_CREATED:
     {
         auto it = m_info.find(id_dir.m_id);
 
         if (it == m_info.end()) {
-            ptr_info info = ptr_info(new stream_info(id_dir.m_id, bytes->m_tm));
+            ptr_info info = ptr_info(new stream_info(id_dir.m_id, tm));
+
+            info->m_flow_id = ++m_appif.m_flow_id;
+
+            if (ev.st_event == STREAM_SYN && bytes &&
+                bytes->get_len() >= (int)sizeof(tcphdr)) {
+                // the sender of SYN is the client, and of SYN/ACK is the server
+                tcphdr *tcph = (tcphdr*)bytes->get_head();
+                if (! (tcph->th_flags & TH_ACK)) {
+                    info->m_client_dir = id_dir.m_dir;
+                } else if (id_dir.m_dir == FROM_ADDR1) {
+                    info->m_client_dir = FROM_ADDR2;
+                } else if (id_dir.m_dir == FROM_ADDR2) {
+                    info->m_client_dir = FROM_ADDR1;
+                }
+            }
 
             m_info[id_dir.m_id] = std::move(info);
 
@@ -1047,6 +2411,10 @@ fabs_appif::appif_consumer::in_stream_event(fabs_stream_event st_event,
             return;
         }
 
+        it->second->m_last_time = tm;
+
+        bytes->charge(MEM_CLASSIFY);
+
         if (id_dir.m_dir == FROM_ADDR1) {
             it->second->m_dsize1 += bytes->get_len();
             it->second->m_buf1.push_back(std::move(bytes));
@@ -1073,6 +2441,7 @@ fabs_appif::appif_consumer::in_stream_event(fabs_stream_event st_event,
 
         it->second->m_is_buf1 = true;
         it->second->m_is_buf2 = true;
+        it->second->m_is_closing = true;
 
         if (! it->second->m_buf1.empty()) {
             fabs_id_dir id_dir2 = id_dir;
@@ -1086,29 +2455,64 @@ fabs_appif::appif_consumer::in_stream_event(fabs_stream_event st_event,
             send_tcp_data(it->second.get(), id_dir2);
         }
 
+        // counters of fabs_tcp are carried by DESTROYED
+        auto p_info = it->second.get();
+        fabs_flow_stat stat;
 
-        if (it->second->m_ifrule) {
+        if (ev.is_stat) {
+            stat = ev.stat;
+        } else {
+            // closed through loopback7, so only the payload is known
+            memset(&stat, 0, sizeof(stat));
+
+            stat.start    = p_info->m_create_time.tv_sec * 1000000ULL +
+                            p_info->m_create_time.tv_usec;
+            stat.end      = tm.tv_sec * 1000000ULL + tm.tv_usec;
+            stat.bytes[0] = p_info->m_dsize1;
+            stat.bytes[1] = p_info->m_dsize2;
+        }
+
+        if (p_info->m_ifrule) {
             // invoke DESTROYED event
-            int idx;
-            if (it->second->m_ifrule->m_balance == 1) {
-                idx = 0;
-            } else {
-                idx = it->second->m_hash & (it->second->m_ifrule->m_balance - 1);
-            }
-            std::string &name = it->second->m_ifrule->m_balance_name[idx];
+            peer_list fdvec;
 
-            fabs_spin_rwlock_read lock(m_appif.m_rw_mutex);
+            fabs_rcu_read lock(*m_appif.m_rcu, m_id);
 
-            auto it2 = m_appif.m_name2uxpeer.find(name);
-            if (it2 != m_appif.m_name2uxpeer.end()) {
-                for (auto it3 = it2->second.begin(); it3 != it2->second.end();
-                     ++it3) {
-                    m_appif.write_event(*it3, id_dir, it->second->m_ifrule,
-                                        STREAM_DESTROYED, MATCH_NONE, it->second->m_reason,
-                                        &it->second->m_header, NULL, 0,
-                                        &bytes->m_tm);
+            bool is_moved = get_peers(p_info, fdvec);
+
+            if (is_moved && ! fdvec.empty()) {
+                auto ev = m_appif.make_event(id_dir, p_info->m_ifrule,
+                                             STREAM_CREATED, MATCH_NONE,
+                                             CLOSED_NORMAL, &p_info->m_header,
+                                             nullptr, &p_info->m_create_time,
+                                             &p_info->m_prefix, &p_info->m_meta,
+                                             p_info->m_flow_id);
+
+                for (auto peer: fdvec) {
+                    m_appif.write_event(peer, ev);
                 }
             }
+
+            if (! fdvec.empty()) {
+                auto ev = m_appif.make_event(id_dir, p_info->m_ifrule,
+                                             STREAM_DESTROYED, MATCH_NONE,
+                                             p_info->m_reason,
+                                             &p_info->m_header, nullptr,
+                                             &tm, &p_info->m_prefix,
+                                             nullptr, p_info->m_flow_id,
+                                             p_info->m_dsize1, p_info->m_dsize2,
+                                             p_info->m_ifrule->m_is_summary ?
+                                             &stat : nullptr);
+
+                for (auto peer: fdvec) {
+                    m_appif.write_event(peer, ev);
+                }
+            }
+        }
+
+        if (m_ifflows) {
+            send_flow(id_dir, p_info->m_flow_id, p_info->m_ifrule,
+                      p_info->m_reason, stat);
         }
 
         m_info.erase(it);
@@ -1152,7 +2556,7 @@ fabs_appif::appif_consumer::in_stream_event(fabs_stream_event st_event,
         // nothing to do
         break;
     default:
-        assert(st_event != STREAM_CREATED);
+        assert(ev.st_event != STREAM_CREATED);
     }
 }
 
@@ -1161,210 +2565,466 @@ fabs_appif::appif_consumer::send_tcp_data(stream_info *p_info, fabs_id_dir id_di
 {
     bool is_classified = false;
 
-    if (! p_info->m_ifrule && p_info->m_is_buf1 && p_info->m_is_buf2) {
-        // classify
-        ptr_ifrule ifrule;
-        char buf1[4096], buf2[4096];
-        int  len1, len2;
-
-        len1 = read_bytes(p_info->m_buf1, buf1, sizeof(buf1));
-        len2 = read_bytes(p_info->m_buf2, buf2, sizeof(buf2));
-
-        for (auto it_tcp = m_ifrule_tcp.begin();
-             it_tcp != m_ifrule_tcp.end(); ++it_tcp) {
-            auto cache_up   = it_tcp->second->cache_up;
-            auto cache_down = it_tcp->second->cache_down;
-
-            // check cache
-            if (m_appif.m_is_cache) {
-                uint8_t idx;
-
-                if (len1 > 0) {
-                    idx = (uint8_t)buf1[0];
-                    if (cache_up[idx] &&
-                        RE2::PartialMatch(std::string(buf1, len1),
-                                          *cache_up[idx]->m_up) &&
-                        RE2::PartialMatch(std::string(buf2, len2),
-                                          *cache_up[idx]->m_down)) {
-                        ifrule = cache_up[idx];
-                        is_classified = true;
-                        p_info->m_match_dir[0] = MATCH_UP;
-                        p_info->m_match_dir[1] = MATCH_DOWN;
-                        p_info->m_ifrule = ifrule;
-
-                        break;
-                    } else if (cache_down[idx] &&
-                               RE2::PartialMatch(std::string(buf1, len1),
-                                                 *cache_down[idx]->m_down) &&
-                               RE2::PartialMatch(std::string(buf2, len2),
-                                                 *cache_down[idx]->m_up)) {
-                        ifrule = cache_down[idx];
-                        is_classified = true;
-                        p_info->m_match_dir[0] = MATCH_DOWN;
-                        p_info->m_match_dir[1] = MATCH_UP;
-                        p_info->m_ifrule = ifrule;
-
-                        break;
-                    }
-                }
+    if (p_info->m_is_classifying) {
+        if (! p_info->m_is_closing)
+            return false; // buffered until the job is applied
 
-                if (len2 > 0) {
-                    idx = (uint8_t)buf2[0];
-                    if (cache_up[idx] &&
-                        RE2::PartialMatch(std::string(buf1, len1),
-                                          *cache_up[idx]->m_up) &&
-                        RE2::PartialMatch(std::string(buf2, len2),
-                                          *cache_up[idx]->m_down)) {
-                        ifrule = cache_up[idx];
-                        is_classified = true;
-                        p_info->m_match_dir[0] = MATCH_DOWN;
-                        p_info->m_match_dir[1] = MATCH_UP;
-                        p_info->m_ifrule = ifrule;
-
-                        break;
-                    } else if (cache_down[idx] &&
-                               RE2::PartialMatch(std::string(buf1, len1),
-                                                 *cache_down[idx]->m_down) &&
-                               RE2::PartialMatch(std::string(buf2, len2),
-                                                 *cache_down[idx]->m_up)) {
-                        ifrule = cache_down[idx];
-                        is_classified = true;
-                        p_info->m_match_dir[0] = MATCH_UP;
-                        p_info->m_match_dir[1] = MATCH_DOWN;
-                        p_info->m_ifrule = ifrule;
-
-                        break;
-                    }
+        // the flow is being destroyed, so do not wait for the job
+        p_info->m_is_classifying = false;
+    }
+
+    if (! p_info->m_ifrule && m_appif.m_is_ep_cache &&
+        ! m_appif.m_is_ep_validate) {
+        // a known server is trusted without waiting for both sides
+        is_classified = classify_ep(p_info, id_dir, nullptr, 0, nullptr, 0);
+    }
+
+    bool is_both = p_info->m_is_buf1 && p_info->m_is_buf2;
+    bool is_one  = m_has_unidir && (p_info->m_is_buf1 || p_info->m_is_buf2);
+
+    // the prefix which will be classified
+    int len1 = (int)std::min<uint64_t>(p_info->m_dsize1, sizeof(classify_job::m_buf1));
+    int len2 = (int)std::min<uint64_t>(p_info->m_dsize2, sizeof(classify_job::m_buf2));
+
+    if (! p_info->m_ifrule && (is_both || is_one) &&
+        (p_info->m_is_force || len1 != p_info->m_last_len1 ||
+         len2 != p_info->m_last_len2 || is_both != p_info->m_last_both)) {
+        // classify, unless the same bytes have failed already
+        bool is_pool = m_appif.m_is_classify_pool && ! p_info->m_is_closing;
+        classify_job  job_local;
+        classify_job *job = is_pool ? new classify_job : &job_local;
+
+        job->m_owner    = m_id;
+        job->m_id_dir   = id_dir;
+        job->m_len1     = read_bytes(p_info->m_buf1, job->m_buf1, sizeof(job->m_buf1));
+        job->m_len2     = read_bytes(p_info->m_buf2, job->m_buf2, sizeof(job->m_buf2));
+        job->m_is_both  = is_both;
+        job->m_is_force = p_info->m_is_force;
+        job->m_dsize    = std::max(p_info->m_dsize1, p_info->m_dsize2);
+        job->m_elapsed  = p_info->m_last_time.tv_sec - p_info->m_create_time.tv_sec;
+
+        if (is_both && m_appif.m_is_ep_cache && m_appif.m_is_ep_validate &&
+            classify_ep(p_info, id_dir, job->m_buf1, job->m_len1,
+                        job->m_buf2, job->m_len2)) {
+            is_classified = true;
+
+            if (is_pool)
+                delete job;
+        } else if (is_pool) {
+            // data is flushed when the owner applies the result
+            job->m_seq = ++m_job_seq;
+            p_info->m_job_seq = job->m_seq;
+            p_info->m_is_classifying = true;
+            submit_job(job);
+            return false;
+        } else {
+            classify_tcp(job);
+            is_classified = apply_job(p_info, job);
+        }
+    }
+
+    return flush_tcp_data(p_info, id_dir, is_classified);
+}
+
+// classify the buffered prefix of a flow by the rules of this consumer
+void
+fabs_appif::appif_consumer::classify_tcp(classify_job *job)
+{
+    const fabs_id_dir &id_dir = job->m_id_dir;
+    const char *buf1 = job->m_buf1;
+    const char *buf2 = job->m_buf2;
+    int  len1 = job->m_len1;
+    int  len2 = job->m_len2;
+    ptr_ifrule ifrule;
+
+    for (auto it_tcp = m_ifrule_tcp.begin();
+         it_tcp != m_ifrule_tcp.end(); ++it_tcp) {
+        auto cache_up   = it_tcp->second->cache_up;
+        auto cache_down = it_tcp->second->cache_down;
+
+        // skip the priority if its limits have been exceeded
+        if (! job->m_is_force &&
+            (job->m_dsize > (uint64_t)it_tcp->second->max_bytes ||
+             (it_tcp->second->max_time > 0 &&
+              job->m_elapsed > it_tcp->second->max_time)))
+            continue;
+
+        // check built-in classifiers before regex
+        auto &lst = it_tcp->second->ifrule_classifier;
+        for (auto it0 = lst.begin(); it0 != lst.end(); ++it0) {
+            bool is_up1;
+
+            if (! m_appif.is_in_port(*(*it0)->m_port, id_dir.get_port_src(),
+                                     id_dir.get_port_dst()))
+                continue;
+
+            if (job->m_is_both &&
+                (*it0)->m_classifier->match_stream(buf1, len1, buf2, len2,
+                                                   is_up1, job->m_meta)) {
+                job->m_match_dir[0] = is_up1 ? MATCH_UP : MATCH_DOWN;
+                job->m_match_dir[1] = is_up1 ? MATCH_DOWN : MATCH_UP;
+            } else if (! (*it0)->m_unidir || ! match_oneway(**it0, job)) {
+                continue;
+            }
+
+            ifrule = *it0;
+            job->m_ifrule = ifrule;
+
+            if (m_appif.m_is_lru) {
+                lst.erase(it0);
+                lst.push_front(ifrule);
+            }
+
+            job->m_is_ep = true;
+
+            return;
+        }
+
+        // check cache
+        if (m_appif.m_is_cache && job->m_is_both) {
+            uint8_t idx;
+
+            if (len1 > 0) {
+                idx = (uint8_t)buf1[0];
+                if (cache_up[idx] &&
+                    RE2::PartialMatch(std::string(buf1, len1),
+                                      *cache_up[idx]->m_up) &&
+                    RE2::PartialMatch(std::string(buf2, len2),
+                                      *cache_up[idx]->m_down)) {
+                    ifrule = cache_up[idx];
+                    job->m_match_dir[0] = MATCH_UP;
+                    job->m_match_dir[1] = MATCH_DOWN;
+                    job->m_ifrule = ifrule;
+
+                    return;
+                } else if (cache_down[idx] &&
+                           RE2::PartialMatch(std::string(buf1, len1),
+                                             *cache_down[idx]->m_down) &&
+                           RE2::PartialMatch(std::string(buf2, len2),
+                                             *cache_down[idx]->m_up)) {
+                    ifrule = cache_down[idx];
+                    job->m_match_dir[0] = MATCH_DOWN;
+                    job->m_match_dir[1] = MATCH_UP;
+                    job->m_ifrule = ifrule;
+
+                    return;
                 }
             }
 
-            // check list
-            for (auto it1 = it_tcp->second->ifrule.begin();
-                 it1 != it_tcp->second->ifrule.end(); ++it1) {
-                if (m_appif.is_in_port(*(*it1)->m_port, id_dir.get_port_src(),
-                                       id_dir.get_port_dst())) {
-                    if (RE2::PartialMatch(std::string(buf1, len1),
-                                          *(*it1)->m_up) &&
-                        RE2::PartialMatch(std::string(buf2, len2),
-                                          *(*it1)->m_down)) {
-                        ifrule = *it1;
-                        is_classified = true;
-                        p_info->m_match_dir[0] = MATCH_UP;
-                        p_info->m_match_dir[1] = MATCH_DOWN;
-                        p_info->m_ifrule = ifrule;
-
-                        if (m_appif.m_is_cache) {
-                            if (len1 > 0)
-                                cache_up[(uint8_t)buf1[0]] = ifrule;
-
-                            if (len2 > 0)
-                                cache_down[(uint8_t)buf2[0]] = ifrule;
-                        }
-
-                        if (m_appif.m_is_lru) {
-                            it_tcp->second->ifrule.erase(it1);
-                            it_tcp->second->ifrule.push_front(ifrule);
-                        }
-
-                        goto brk;
-                    } else if (RE2::PartialMatch(std::string(buf1, len1),
-                                                 *(*it1)->m_down) &&
-                               RE2::PartialMatch(std::string(buf2, len2),
-                                                 *(*it1)->m_up)) {
-                        ifrule = *it1;
-                        is_classified = true;
-                        p_info->m_match_dir[0] = MATCH_DOWN;
-                        p_info->m_match_dir[1] = MATCH_UP;
-                        p_info->m_ifrule = ifrule;
-
-                        if (m_appif.m_is_cache) {
-                            if (len1 > 0)
-                                cache_down[(uint8_t)buf1[0]] = ifrule;
-
-                            if (len2 > 0)
-                                cache_up[(uint8_t)buf2[0]] = ifrule;
-                        }
-
-                        if (m_appif.m_is_lru) {
-                            it_tcp->second->ifrule.erase(it1);
-                            it_tcp->second->ifrule.push_front(ifrule);
-                        }
-
-                        goto brk;
-                    }
+            if (len2 > 0) {
+                idx = (uint8_t)buf2[0];
+                if (cache_up[idx] &&
+                    RE2::PartialMatch(std::string(buf1, len1),
+                                      *cache_up[idx]->m_up) &&
+                    RE2::PartialMatch(std::string(buf2, len2),
+                                      *cache_up[idx]->m_down)) {
+                    ifrule = cache_up[idx];
+                    job->m_match_dir[0] = MATCH_DOWN;
+                    job->m_match_dir[1] = MATCH_UP;
+                    job->m_ifrule = ifrule;
+
+                    return;
+                } else if (cache_down[idx] &&
+                           RE2::PartialMatch(std::string(buf1, len1),
+                                             *cache_down[idx]->m_down) &&
+                           RE2::PartialMatch(std::string(buf2, len2),
+                                             *cache_down[idx]->m_up)) {
+                    ifrule = cache_down[idx];
+                    job->m_match_dir[0] = MATCH_UP;
+                    job->m_match_dir[1] = MATCH_DOWN;
+                    job->m_ifrule = ifrule;
+
+                    return;
                 }
             }
+        }
 
-            // check no regex list
-            for (auto it2 = it_tcp->second->ifrule_no_regex.begin();
-                 it2 != it_tcp->second->ifrule_no_regex.end(); ++it2) {
-                if (m_appif.is_in_port(*(*it2)->m_port, id_dir.get_port_src(),
-                                       id_dir.get_port_dst())) {
-                    ifrule = *it2;
-                    is_classified = true;
-                    p_info->m_ifrule = ifrule;
+        // check list
+        for (auto it1 = it_tcp->second->ifrule.begin();
+             it1 != it_tcp->second->ifrule.end(); ++it1) {
+            // unidirectional rules may have only one of up and down
+            bool is_both = job->m_is_both && (*it1)->m_up && (*it1)->m_down;
+
+            if (m_appif.is_in_port(*(*it1)->m_port, id_dir.get_port_src(),
+                                   id_dir.get_port_dst())) {
+                if (is_both &&
+                    RE2::PartialMatch(std::string(buf1, len1),
+                                      *(*it1)->m_up) &&
+                    RE2::PartialMatch(std::string(buf2, len2),
+                                      *(*it1)->m_down)) {
+                    ifrule = *it1;
+                    job->m_match_dir[0] = MATCH_UP;
+                    job->m_match_dir[1] = MATCH_DOWN;
+                    job->m_ifrule = ifrule;
+
+                    if (m_appif.m_is_cache) {
+                        if (len1 > 0)
+                            cache_up[(uint8_t)buf1[0]] = ifrule;
+
+                        if (len2 > 0)
+                            cache_down[(uint8_t)buf2[0]] = ifrule;
+                    }
 
                     if (m_appif.m_is_lru) {
-                        it_tcp->second->ifrule_no_regex.erase(it2);
-                        it_tcp->second->ifrule_no_regex.push_front(ifrule);
+                        it_tcp->second->ifrule.erase(it1);
+                        it_tcp->second->ifrule.push_front(ifrule);
                     }
 
-                    goto brk;
+                    job->m_is_ep = true;
+
+                    return;
+                } else if (is_both &&
+                           RE2::PartialMatch(std::string(buf1, len1),
+                                             *(*it1)->m_down) &&
+                           RE2::PartialMatch(std::string(buf2, len2),
+                                             *(*it1)->m_up)) {
+                    ifrule = *it1;
+                    job->m_match_dir[0] = MATCH_DOWN;
+                    job->m_match_dir[1] = MATCH_UP;
+                    job->m_ifrule = ifrule;
+
+                    if (m_appif.m_is_cache) {
+                        if (len1 > 0)
+                            cache_down[(uint8_t)buf1[0]] = ifrule;
+
+                        if (len2 > 0)
+                            cache_up[(uint8_t)buf2[0]] = ifrule;
+                    }
+
+                    if (m_appif.m_is_lru) {
+                        it_tcp->second->ifrule.erase(it1);
+                        it_tcp->second->ifrule.push_front(ifrule);
+                    }
+
+                    job->m_is_ep = true;
+
+                    return;
+                } else if ((*it1)->m_unidir && match_oneway(**it1, job)) {
+                    ifrule = *it1;
+                    job->m_ifrule = ifrule;
+
+                    if (m_appif.m_is_lru) {
+                        it_tcp->second->ifrule.erase(it1);
+                        it_tcp->second->ifrule.push_front(ifrule);
+                    }
+
+                    job->m_is_ep = true;
+
+                    return;
                 }
             }
         }
 
-        if (! p_info->m_ifrule && m_appif.m_tcp_default) {
-            // default I/F
-            is_classified = true;
-            p_info->m_ifrule = m_appif.m_tcp_default;
+        // check no regex list
+        for (auto it2 = it_tcp->second->ifrule_no_regex.begin();
+             it2 != it_tcp->second->ifrule_no_regex.end(); ++it2) {
+            if ((job->m_is_both || (*it2)->m_unidir) &&
+                m_appif.is_in_port(*(*it2)->m_port, id_dir.get_port_src(),
+                                   id_dir.get_port_dst())) {
+                ifrule = *it2;
+                job->m_ifrule = ifrule;
+
+                if (m_appif.m_is_lru) {
+                    it_tcp->second->ifrule_no_regex.erase(it2);
+                    it_tcp->second->ifrule_no_regex.push_front(ifrule);
+                }
+
+                job->m_is_ep = true;
+
+                return;
+            }
         }
     }
+}
 
-    brk:
+// match a unidirectional rule by the first bytes of either direction
+bool
+fabs_appif::appif_consumer::match_oneway(const ifrule &rule, classify_job *job)
+{
+    const char *buf[2] = {job->m_buf1, job->m_buf2};
+    int         len[2] = {job->m_len1, job->m_len2};
 
-    if (! p_info->m_ifrule) {
-        // give up?
-        if (p_info->m_dsize1 > 65536 * 2 || p_info->m_dsize2 > 65536 * 2) {
-            p_info->m_is_giveup = true;
-            p_info->clear_buf();
-            return is_classified;
-        } else if (p_info->m_dsize1 > 65536 || p_info->m_dsize2 > 65536) {
-            p_info->m_is_buf1 = true;
-            p_info->m_is_buf2 = true;
-            return is_classified;
+    for (int i = 0; i < 2; i++) {
+        bool is_client;
+
+        if (len[i] <= 0)
+            continue;
+
+        if (rule.m_classifier) {
+            if (! rule.m_classifier->match_oneway(buf[i], len[i], is_client,
+                                                  job->m_meta))
+                continue;
+        } else if (rule.m_up &&
+                   RE2::PartialMatch(std::string(buf[i], len[i]), *rule.m_up)) {
+            is_client = true;
+        } else if (rule.m_down &&
+                   RE2::PartialMatch(std::string(buf[i], len[i]), *rule.m_down)) {
+            is_client = false;
+        } else {
+            continue;
         }
 
+        job->m_match_dir[i]     = is_client ? MATCH_UP : MATCH_DOWN;
+        job->m_match_dir[1 - i] = is_client ? MATCH_DOWN : MATCH_UP;
+
+        return true;
+    }
+
+    return false;
+}
+
+// apply the result of a classify job to the flow
+bool
+fabs_appif::appif_consumer::apply_job(stream_info *p_info, classify_job *job)
+{
+    if (job->m_ifrule) {
+        p_info->m_ifrule = job->m_ifrule;
+        p_info->m_match_dir[0] = job->m_match_dir[0];
+        p_info->m_match_dir[1] = job->m_match_dir[1];
+        p_info->m_meta = std::move(job->m_meta);
+
+        if (job->m_is_ep && m_appif.m_is_ep_cache)
+            insert_ep(p_info, job->m_id_dir);
+
+        return true;
+    } else if (job->m_is_both && m_tcp_default) {
+        // default I/F
+        p_info->m_ifrule = m_tcp_default;
+        return true;
+    }
+
+    // not to try the same bytes again
+    p_info->m_last_len1 = job->m_len1;
+    p_info->m_last_len2 = job->m_len2;
+    p_info->m_last_both = job->m_is_both;
+
+    return false;
+}
+
+// the route slot of a rule for hash, must be called in a read section
+// of m_rcu
+const fabs_appif::route_slot *
+fabs_appif::appif_consumer::get_slot(const ifrule &rule, uint32_t hash)
+{
+    route *rt = rule.m_route.load();
+    if (rt == nullptr)
+        return nullptr;
+
+    size_t idx = rule.m_balance == 1 ? 0 : hash & (rule.m_balance - 1);
+    if (idx >= rt->m_slot.size())
+        return nullptr;
+
+    return &rt->m_slot[idx];
+}
+
+// select readers of a flow, must be called in a read section of m_rcu
+// a flow of a consumer group is sent to one reader chosen by consistent
+// hashing, and stays there until the reader leaves
+// return true if the flow has been assigned to another reader
+bool
+fabs_appif::appif_consumer::get_peers(stream_info *p_info, peer_list &peers)
+{
+    auto &rule = *p_info->m_ifrule;
+
+    if (rule.m_sample > 1 && mix_hash(p_info->m_hash) % rule.m_sample != 0) {
+        // not sampled
         return false;
     }
 
-    int idx;
-    if (p_info->m_ifrule->m_balance == 1) {
-        idx = 0;
-    } else {
-        idx = p_info->m_hash & (p_info->m_ifrule->m_balance - 1);
+    auto slot = get_slot(rule, p_info->m_hash);
+    if (slot == nullptr)
+        return false;
+
+    if (! rule.m_is_group) {
+        peers = peer_list(slot->m_peer.data(), slot->m_peer.size());
+        return false;
     }
-    std::string &name = p_info->m_ifrule->m_balance_name[idx];
 
-    std::vector<int> fdvec;
+    auto &grp     = slot->m_group;
+    bool is_moved = false;
+
+    if (p_info->m_group_gen != grp.m_gen) {
+        p_info->m_group_gen = grp.m_gen;
 
-    fabs_spin_rwlock_read(m_appif.m_rw_mutex);
+        auto it2 = grp.m_member.find(p_info->m_group_fd);
+        if (it2 == grp.m_member.end() || it2->second != p_info->m_group_peer) {
+            // a new flow, or the reader has left
+            p_info->m_group_idx = slot->lookup(p_info->m_hash);
 
-    auto it = m_appif.m_name2uxpeer.find(name);
+            if (p_info->m_group_idx >= 0) {
+                auto peer = slot->m_peer[p_info->m_group_idx];
 
-    if (it != m_appif.m_name2uxpeer.end()) {
-        for (auto fd: it->second) {
-            fdvec.push_back(fd);
+                p_info->m_group_fd   = peer->m_fd;
+                p_info->m_group_peer = peer->m_id;
+                is_moved = true;
+            } else {
+                p_info->m_group_fd = -1;
+            }
+        } else {
+            // the reader stays, but its index may have changed
+            auto it3 = slot->m_fd2idx.find(p_info->m_group_fd);
+            p_info->m_group_idx = it3 == slot->m_fd2idx.end() ? -1 : it3->second;
         }
     }
 
-    if (is_classified) {
-        // invoke CREATED event
-        for (auto fd: fdvec) {
-            m_appif.write_event(fd, id_dir, p_info->m_ifrule,
-                                STREAM_CREATED, MATCH_NONE, CLOSED_NORMAL,
-                                &p_info->m_header, NULL, 0,
-                                &p_info->m_create_time);
+    // indices are the same while the generation is, since a slot is
+    // built from the same readers in the same order
+    if (p_info->m_group_idx >= 0)
+        peers = peer_list(&slot->m_peer[p_info->m_group_idx], 1);
+
+    return is_moved;
+}
+
+bool
+fabs_appif::appif_consumer::flush_tcp_data(stream_info *p_info,
+                                           const fabs_id_dir &id_dir,
+                                           bool is_classified)
+{
+    if (! p_info->m_ifrule) {
+        // give up?
+        if (p_info->m_is_force) {
+            // the last try ignoring the limits has failed
+            p_info->m_is_giveup = true;
+            p_info->clear_buf();
+            return is_classified;
+        }
+
+        uint64_t dsize   = std::max(p_info->m_dsize1, p_info->m_dsize2);
+        time_t   elapsed = p_info->m_last_time.tv_sec -
+                           p_info->m_create_time.tv_sec;
+
+        // buffered memory over the soft limit also gives up
+        if (dsize > (uint64_t)m_classify_bytes_max ||
+            (m_classify_time_max > 0 &&
+             elapsed > m_classify_time_max) ||
+            fabs_mem::get_level() != fabs_mem::LEVEL_NORMAL) {
+            // out of the limits of all priorities, classify by any rule
+            // with whatever has been received, then give up
+            p_info->m_is_buf1  = true;
+            p_info->m_is_buf2  = true;
+            p_info->m_is_force = true;
+            return send_tcp_data(p_info, id_dir);
+        }
+
+        return false;
+    }
+
+    peer_list fdvec;
+
+    fabs_rcu_read lock(*m_appif.m_rcu, m_id);
+
+    bool is_moved = get_peers(p_info, fdvec);
+
+    if ((is_classified || is_moved) && ! fdvec.empty()) {
+        // invoke CREATED event, also for a reader taking over the flow
+        auto ev = m_appif.make_event(id_dir, p_info->m_ifrule,
+                                     STREAM_CREATED, MATCH_NONE, CLOSED_NORMAL,
+                                     &p_info->m_header, nullptr,
+                                     &p_info->m_create_time, &p_info->m_prefix,
+                                     &p_info->m_meta, p_info->m_flow_id);
+
+        for (auto peer: fdvec) {
+            m_appif.write_event(peer, ev);
         }
     }
 
@@ -1387,28 +3047,76 @@ fabs_appif::appif_consumer::send_tcp_data(stream_info *p_info, fabs_id_dir id_di
     id_dir1.m_dir = FROM_ADDR1;
     id_dir2.m_dir = FROM_ADDR2;
 
-    auto func = [&](fabs_id_dir id_dir, match_dir mdir, fabs_bytes *pkt) {
-        for (auto fd: fdvec) {
-            m_appif.write_event(fd, id_dir, p_info->m_ifrule,
-                                STREAM_DATA, mdir, CLOSED_NORMAL,
-                                &p_info->m_header,
-                                pkt->get_head(),
-                                pkt->get_len(),
-                                &pkt->m_tm);
+    // flows in pcap files are identified by the prefix and ID
+    // flows from loopback7 (hop > 0) carry payloads alone, not frames
+    std::string   desc;
+    fabs_capture *capture = nullptr;
+
+    if (p_info->m_ifrule->m_capture && id_dir.m_id.m_hop == 0) {
+        capture = p_info->m_ifrule->m_capture.get();
+
+        if (p_info->m_prefix.empty())
+            append_prefix(p_info->m_prefix, id_dir);
+
+        desc = p_info->m_prefix + ",id=" + std::to_string(p_info->m_flow_id);
+    }
+
+    // the event and its body are shared by all peers
+    auto func = [&](fabs_id_dir id_dir, match_dir mdir, ptr_fabs_bytes &pkt) {
+        auto &rule = p_info->m_ifrule;
+
+        if (capture)
+            capture->write(desc, *pkt);
+
+        if (fdvec.empty())
+            return;
+
+        int len = pkt->get_len();
+
+        if (rule->m_max_event_len >= 0 && len > rule->m_max_event_len)
+            len = rule->m_max_event_len;
+
+        if (rule->m_max_body >= 0) {
+            // payload beyond the limit is counted by DESTROYED alone
+            uint64_t &sent = p_info->m_sent[id_dir.m_dir];
+
+            if (sent >= (uint64_t)rule->m_max_body)
+                return;
+
+            if (sent + len > (uint64_t)rule->m_max_body)
+                len = rule->m_max_body - sent;
+
+            sent += len;
+        }
+
+        if (len < pkt->get_len())
+            pkt->skip_tail(pkt->get_len() - len);
+
+        sptr_fabs_bytes body(std::move(pkt));
+
+        // counted as MEM_BACKLOG by the peers from now on
+        body->uncharge();
+
+        auto ev = m_appif.make_event(id_dir, p_info->m_ifrule,
+                                     STREAM_DATA, mdir, CLOSED_NORMAL,
+                                     &p_info->m_header, body,
+                                     &body->m_tm, &p_info->m_prefix,
+                                     nullptr, p_info->m_flow_id);
+
+        for (auto peer: fdvec) {
+            m_appif.write_event(peer, ev);
         }
     };
 
     while (! (buf1->empty() && buf2->empty())) {
         if (buf2->empty()) {
-            auto pkt = buf1->front().get();
             // write addr1
-            func(id_dir1, mdir1, pkt);
+            func(id_dir1, mdir1, buf1->front());
             buf1->pop_front();
             continue;
         } else if (buf1->empty()) {
-            auto pkt = buf2->front().get();
             // write  addr2
-            func(id_dir2, mdir2, pkt);
+            func(id_dir2, mdir2, buf2->front());
             buf2->pop_front();
             continue;
         }
@@ -1421,11 +3129,11 @@ fabs_appif::appif_consumer::send_tcp_data(stream_info *p_info, fabs_id_dir id_di
 
         if (t1 < t2) {
             // write addr1
-            func(id_dir1, mdir1, pkt1);
+            func(id_dir1, mdir1, buf1->front());
             buf1->pop_front();
         } else {
             // write addr2
-            func(id_dir2, mdir2, pkt2);
+            func(id_dir2, mdir2, buf2->front());
             buf2->pop_front();
         }
     }
@@ -1433,101 +3141,393 @@ fabs_appif::appif_consumer::send_tcp_data(stream_info *p_info, fabs_id_dir id_di
     return is_classified;
 }
 
-static
 void
-print_write_err(int fd, std::string path)
+fabs_appif::appif_consumer::get_ep_key(const fabs_id &id,
+                                       fabs_direction server, ep_key &key)
 {
-     std::cerr << "could not write to " << fd
-               << "(" << path << ")\n"
-               << "Data is discarded because the send buffer is full!\n"
-               << "Consider to use the load balance mechanism or SF-TAP cell incubator.\n"
-               << "See http://sf-tap.github.io/tutorial/2015/11/23/load-balancing.html or\n"
-               << "http://sf-tap.github.io/tutorial/2015/11/21/tutorial-qb.html for more details.\n"
-               << std::endl;
+    const fabs_peer *client;
+    int prefix;
+
+    if (server == FROM_ADDR1) {
+        key.m_server = *id.m_addr1;
+        client = id.m_addr2.get();
+    } else {
+        key.m_server = *id.m_addr2;
+        client = id.m_addr1.get();
+    }
+
+    key.m_l3_proto = id.get_l3_proto();
+
+    if (key.m_l3_proto == IPPROTO_IP) {
+        prefix = m_appif.m_ep_prefix4;
+    } else {
+        prefix = m_appif.m_ep_prefix6;
+    }
+
+    // clients are distinguished only by their address prefix
+    for (int i = 0; i < (int)sizeof(key.m_client.l3_addr.b128); i++) {
+        int bits = prefix - i * 8;
+
+        if (bits >= 8) {
+            key.m_client.l3_addr.b128[i] = client->l3_addr.b128[i];
+        } else if (bits > 0) {
+            key.m_client.l3_addr.b128[i] = client->l3_addr.b128[i] &
+                (uint8_t)(0xff << (8 - bits));
+        } else {
+            break;
+        }
+    }
 }
 
+// classify a flow by the server endpoint cache
+// buf1 and buf2 are null if the cached rule is trusted without validation
 bool
-fabs_appif::write_event(int fd, const fabs_id_dir &id_dir, ptr_ifrule ifrule,
-                        fabs_stream_event event, match_dir match, CLOSED_REASON reason,
-                        fabs_appif_header *header, char *body, int bodylen,
-                        timeval *tm)
+fabs_appif::appif_consumer::classify_ep(stream_info *p_info,
+                                        const fabs_id_dir &id_dir,
+                                        const char *buf1, int len1,
+                                        const char *buf2, int len2)
 {
-    auto it = m_fd2uxpeer.find(fd);
-    if (it == m_fd2uxpeer.end())
-        return false;
+    fabs_direction servers[2];
+    int num = 0;
 
-    auto peer  = it->second.get();
-    auto &ebuf = peer->m_event_buf;
+    if (p_info->m_client_dir == FROM_ADDR1) {
+        servers[num++] = FROM_ADDR2;
+    } else if (p_info->m_client_dir == FROM_ADDR2) {
+        servers[num++] = FROM_ADDR1;
+    } else {
+        servers[num++] = FROM_ADDR2;
+        servers[num++] = FROM_ADDR1;
+    }
 
-    if (ebuf.size() > 0) {
-        fabs_spin_lock_ac lock(peer->m_lock);
+    time_t now = p_info->m_create_time.tv_sec;
 
-        if (ebuf.size() > 0) {
-            while (! ebuf.empty()) {
-                auto &p = ebuf.front();
+    for (int i = 0; i < num; i++) {
+        ep_key key;
+        get_ep_key(id_dir.m_id, servers[i], key);
 
-                if (ifrule->m_format == IF_TEXT) {
-                    if (write(fd, p->m_header_str.c_str(), p->m_header_str.size()) < 0) {
-                        break;
-                    }
-                } else {
-                    if (write(fd, &p->m_header, sizeof(p->m_header)) < 0) {
-                        break;
-                    }
-                }
+        auto it = m_ep_cache.find(key);
+        if (it == m_ep_cache.end())
+            continue;
+
+        if (now > it->m_expire) {
+            m_ep_cache.erase(it);
+            m_ep_expire++;
+            continue;
+        }
+
+        ptr_ifrule ifrule  = it->m_ifrule;
+        match_dir  mserver = it->m_server_match;
+        match_dir  mclient = MATCH_NONE;
 
-                ebuf.pop_front();
+        if (mserver == MATCH_UP) {
+            mclient = MATCH_DOWN;
+        } else if (mserver == MATCH_DOWN) {
+            mclient = MATCH_UP;
+        }
+
+        match_dir m1, m2;
+        if (servers[i] == FROM_ADDR1) {
+            m1 = mserver;
+            m2 = mclient;
+        } else {
+            m1 = mclient;
+            m2 = mserver;
+        }
+
+        if (! m_appif.is_in_port(*ifrule->m_port, id_dir.get_port_src(),
+                                 id_dir.get_port_dst())) {
+            m_ep_cache.erase(it);
+            m_ep_miss++;
+            continue;
+        }
+
+        if (buf1 && ifrule->m_classifier) {
+            bool is_up1;
+            std::string meta;
+
+            if (! ifrule->m_classifier->match_stream(buf1, len1, buf2, len2,
+                                                     is_up1, meta) ||
+                (is_up1 ? m1 != MATCH_UP : m1 != MATCH_DOWN)) {
+                m_ep_cache.erase(it);
+                m_ep_miss++;
+                continue;
+            }
+
+            p_info->m_meta = meta;
+            it->m_expire = now + m_appif.m_ep_ttl;
+        } else if (buf1 && ifrule->m_up && ifrule->m_down) {
+            // run only the cached rule to confirm
+            const RE2 *re1, *re2;
+
+            re1 = (m1 == MATCH_UP) ? ifrule->m_up.get() : ifrule->m_down.get();
+            re2 = (m2 == MATCH_UP) ? ifrule->m_up.get() : ifrule->m_down.get();
+
+            if (! (RE2::PartialMatch(re2::StringPiece(buf1, len1), *re1) &&
+                   RE2::PartialMatch(re2::StringPiece(buf2, len2), *re2))) {
+                m_ep_cache.erase(it);
+                m_ep_miss++;
+                continue;
             }
+
+            // confirmed by payloads
+            it->m_expire = now + m_appif.m_ep_ttl;
+        } else if (buf1) {
+            // other rules match by ports, so payloads cannot confirm them
+            m_ep_cache.erase(it);
+            m_ep_miss++;
+            continue;
         }
+
+        auto &seq = m_ep_cache.get<1>();
+        seq.relocate(seq.end(), m_ep_cache.project<1>(it));
+
+        p_info->m_ifrule = ifrule;
+        p_info->m_match_dir[FROM_ADDR1] = m1;
+        p_info->m_match_dir[FROM_ADDR2] = m2;
+
+        m_ep_hit++;
+        m_ep_len.store(m_ep_cache.size(), std::memory_order_relaxed);
+
+        return true;
     }
 
-    if (ifrule->m_format == IF_TEXT) {
-        std::string s;
-        char buf[256];
+    m_ep_len.store(m_ep_cache.size(), std::memory_order_relaxed);
+
+    return false;
+}
+
+void
+fabs_appif::appif_consumer::insert_ep(stream_info *p_info,
+                                      const fabs_id_dir &id_dir)
+{
+    fabs_direction server;
+
+    if (p_info->m_client_dir == FROM_ADDR1) {
+        server = FROM_ADDR2;
+    } else if (p_info->m_client_dir == FROM_ADDR2) {
+        server = FROM_ADDR1;
+    } else if (p_info->m_match_dir[FROM_ADDR1] == MATCH_DOWN) {
+        server = FROM_ADDR1;
+    } else if (p_info->m_match_dir[FROM_ADDR2] == MATCH_DOWN) {
+        server = FROM_ADDR2;
+    } else {
+        // cannot tell which side is the server
+        return;
+    }
 
-        s  = "ip1=";
-        id_dir.get_addr1(buf, sizeof(buf));
-        s += buf;
+    if (m_appif.m_ep_size == 0)
+        return;
 
-        s += ",ip2=";
-        id_dir.get_addr2(buf, sizeof(buf));
-        s += buf;
+    // classify_ep cannot confirm rules matching by ports
+    const ptr_ifrule &ifrule = p_info->m_ifrule;
+    if (m_appif.m_is_ep_validate && ! ifrule->m_classifier &&
+        ! (ifrule->m_up && ifrule->m_down))
+        return;
 
-        s += ",port1=";
-        s += boost::lexical_cast<std::string>(htons(id_dir.get_port1()));
+    ep_key key;
+    get_ep_key(id_dir.m_id, server, key);
 
-        s += ",port2=";
-        s += boost::lexical_cast<std::string>(htons(id_dir.get_port2()));
+    ep_entry entry(key, p_info->m_ifrule, p_info->m_match_dir[server],
+                   p_info->m_create_time.tv_sec + m_appif.m_ep_ttl);
 
-        s += ",hop=";
-        s += boost::lexical_cast<std::string>((int)id_dir.m_id.m_hop);
+    auto &seq = m_ep_cache.get<1>();
+    auto  it  = m_ep_cache.find(key);
 
-        if (id_dir.m_id.get_l3_proto() == IPPROTO_IP) {
-            s += ",l3=ipv4";
-        } else if (id_dir.m_id.get_l3_proto() == IPPROTO_IPV6) {
-            s += ",l3=ipv6";
-        }
+    if (it != m_ep_cache.end()) {
+        m_ep_cache.replace(it, entry);
+        seq.relocate(seq.end(), m_ep_cache.project<1>(it));
+        return;
+    }
+
+    while (seq.size() >= m_appif.m_ep_size) {
+        seq.pop_front();
+    }
+
+    m_ep_cache.insert(entry);
+    m_ep_len.store(m_ep_cache.size(), std::memory_order_relaxed);
+}
+
+// append an unsigned integer in decimal
+static inline void
+append_uint(std::string &s, uint64_t n)
+{
+    char  buf[24];
+    char *p = buf + sizeof(buf);
+
+    do {
+        *--p = '0' + n % 10;
+        n /= 10;
+    } while (n > 0);
+
+    s.append(p, buf + sizeof(buf) - p);
+}
+
+// append a time as "seconds.microseconds"
+static inline void
+append_time(std::string &s, const timeval *tm)
+{
+    char buf[6];
+    int  usec = tm->tv_usec;
+
+    append_uint(s, tm->tv_sec);
+
+    for (int i = 5; i >= 0; i--) {
+        buf[i] = '0' + usec % 10;
+        usec /= 10;
+    }
+
+    s += '.';
+    s.append(buf, sizeof(buf));
+}
+
+// "ip1=...,ip2=...,port1=...,port2=...,hop=...,l3=...,l4=..." of a flow
+static void
+append_prefix(std::string &s, const fabs_id_dir &id_dir)
+{
+    char buf[256];
+
+    s += "ip1=";
+    id_dir.get_addr1(buf, sizeof(buf));
+    s += buf;
+
+    s += ",ip2=";
+    id_dir.get_addr2(buf, sizeof(buf));
+    s += buf;
+
+    s += ",port1=";
+    append_uint(s, htons(id_dir.get_port1()));
+
+    s += ",port2=";
+    append_uint(s, htons(id_dir.get_port2()));
+
+    s += ",hop=";
+    append_uint(s, id_dir.m_id.m_hop);
+
+    if (id_dir.m_id.get_l3_proto() == IPPROTO_IP) {
+        s += ",l3=ipv4";
+    } else if (id_dir.m_id.get_l3_proto() == IPPROTO_IPV6) {
+        s += ",l3=ipv6";
+    }
+
+    if (id_dir.m_id.get_l4_proto() == IPPROTO_TCP) {
+        s += ",l4=tcp";
+    } else if (id_dir.m_id.get_l4_proto() == IPPROTO_UDP) {
+        s += ",l4=udp";
+    }
+}
+
+// append counters of a flow in text
+// bytes are omitted if already appended for max_body_per_dir
+static void
+append_stat(std::string &s, const fabs_flow_stat &stat, bool is_bytes)
+{
+    timeval start;
+
+    start.tv_sec  = stat.start / 1000000;
+    start.tv_usec = stat.start % 1000000;
+
+    s += ",packets1=";
+    append_uint(s, stat.packets[0]);
+    s += ",packets2=";
+    append_uint(s, stat.packets[1]);
+
+    if (is_bytes) {
+        s += ",bytes1=";
+        append_uint(s, stat.bytes[0]);
+        s += ",bytes2=";
+        append_uint(s, stat.bytes[1]);
+    }
+
+    s += ",retrans1=";
+    append_uint(s, stat.retrans[0]);
+    s += ",retrans2=";
+    append_uint(s, stat.retrans[1]);
+    s += ",ooo1=";
+    append_uint(s, stat.ooo[0]);
+    s += ",ooo2=";
+    append_uint(s, stat.ooo[1]);
+    s += ",start=";
+    append_time(s, &start);
+}
+
+static void
+append_reason(std::string &s, int reason)
+{
+    switch (reason) {
+    case 0:
+        s += ",reason=NORMAL";
+        break;
+    case 1:
+        s += ",reason=RESET";
+        break;
+    case 2:
+        s += ",reason=TIMEOUT";
+        break;
+    case 3:
+        s += ",reason=COMPROMISED";
+        break;
+    }
+}
+
+// serialize an event once, then it is queued to every peer of the rule
+// prefix caches the text prefix of the flow if not null
+fabs_appif::ptr_out_event
+fabs_appif::make_event(const fabs_id_dir &id_dir, ptr_ifrule ifrule,
+                       fabs_stream_event event, match_dir match,
+                       CLOSED_REASON reason, fabs_appif_header *header,
+                       const sptr_fabs_bytes &body, const timeval *tm,
+                       std::string *prefix, const std::string *meta,
+                       uint64_t flow_id, uint64_t dsize1, uint64_t dsize2,
+                       const fabs_flow_stat *stat)
+{
+    int bodylen = body ? body->get_len() : 0;
+
+    ptr_out_event ev(new out_event);
+
+    ev->m_event = event;
+
+    if (bodylen > 0 && ifrule->m_is_body) {
+        ev->m_body = body;
+    }
+
+    if (ifrule->m_format == IF_TEXT) {
+        std::string &s = ev->m_header;
+
+        s.reserve(192);
+
+        if (prefix == nullptr) {
+            append_prefix(s, id_dir);
+        } else {
+            if (prefix->empty())
+                append_prefix(*prefix, id_dir);
 
-        if (id_dir.m_id.get_l4_proto() == IPPROTO_TCP) {
-            s += ",l4=tcp";
-        } else if (id_dir.m_id.get_l4_proto() == IPPROTO_UDP) {
-            s += ",l4=udp";
+            s = *prefix;
         }
 
         switch (event) {
         case STREAM_CREATED:
             s += ",event=CREATED";
+
+            if (meta && ! meta->empty()) {
+                s += ",";
+                s += *meta;
+            }
+
             break;
         case STREAM_DESTROYED:
             s += ",event=DESTROYED";
-            if (reason == CLOSED_NORMAL)
-                s += ",reason=NORMAL";
-            else if (reason == CLOSED_RST)
-                s += ",reason=RESET";
-            else if (reason == CLOSED_TIMEOUT)
-                s += ",reason=TIMEOUT";
-            else if (reason == CLOSED_COMPROMISED)
-                s += ",reason=COMPROMISED";
+            append_reason(s, reason);
+
+            if (ifrule->m_max_body >= 0) {
+                // payload may have been truncated
+                s += ",bytes1=";
+                append_uint(s, dsize1);
+                s += ",bytes2=";
+                append_uint(s, dsize2);
+            }
+
+            if (stat)
+                append_stat(s, *stat, ifrule->m_max_body < 0);
             break;
         case STREAM_DATA:
             s += ",event=DATA,from=";
@@ -1549,48 +3549,102 @@ fabs_appif::write_event(int fd, const fabs_id_dir &id_dir, ptr_ifrule ifrule,
                 s += "none";
             }
 
+            // datagrams have no CREATED to carry it
+            if (meta && ! meta->empty()) {
+                s += ",";
+                s += *meta;
+            }
+
             s += ",len=";
-            s += boost::lexical_cast<std::string>(bodylen);
+            append_uint(s, bodylen);
             break;
         default:
             assert(false);
         }
 
-        double t = tm->tv_sec + tm->tv_usec * 0.000001;
-
         s += ",time=";
-        s += boost::lexical_cast<std::string>(t);
+        append_time(s, tm);
         s += "\n";
+    } else if (ifrule->m_format == IF_BINARY2) {
+        fabs_appif_header2 h2;
+        fabs_appif_tuple   tuple;
+        bool is_tuple = false;
 
-        if (bodylen > 0 && ifrule->m_is_body) {
-            iovec iov[2];
+        memset(&h2, 0, sizeof(h2));
 
-            iov[0].iov_base = const_cast<char*>(s.c_str());
-            iov[0].iov_len  = s.size();
+        h2.id     = flow_id;
+        h2.tm     = tm->tv_sec * 1000000ULL + tm->tv_usec;
+        h2.from   = id_dir.m_dir;
+        h2.match  = match;
+        h2.reason = reason;
 
-            iov[1].iov_base = body;
-            iov[1].iov_len  = bodylen;
-
-            if (writev(fd, iov, 2) < 0) {
-                print_write_err(fd, peer->m_path);
-                return false;
+        switch (event) {
+        case STREAM_CREATED:
+            h2.event = APPIF2_CREATED;
+            is_tuple = true;
+            break;
+        case STREAM_DESTROYED:
+            h2.event = APPIF2_DESTROYED;
+            break;
+        case STREAM_DATA:
+            if (flow_id == 0) {
+                // datagrams have no CREATED
+                h2.event = APPIF2_DATAGRAM;
+                is_tuple = true;
+            } else {
+                h2.event = APPIF2_DATA;
             }
-        } else {
-            if (write(fd, s.c_str(), s.size()) < 0) {
-                print_write_err(fd, peer->m_path);
+            break;
+        default:
+            assert(false);
+        }
 
-                if (event == STREAM_CREATED || event == STREAM_DESTROYED) {
-                    std::unique_ptr<event_buf> evbuf(new event_buf);
+        if (is_tuple) {
+            memset(&tuple, 0, sizeof(tuple));
+            memcpy(tuple.l3_addr1, &header->l3_addr1, sizeof(tuple.l3_addr1));
+            memcpy(tuple.l3_addr2, &header->l3_addr2, sizeof(tuple.l3_addr2));
 
-                    evbuf->m_header_str = s;
+            tuple.l4_port1 = header->l4_port1;
+            tuple.l4_port2 = header->l4_port2;
+            tuple.hop      = id_dir.m_id.m_hop;
+            tuple.l3_proto = id_dir.m_id.get_l3_proto();
+            tuple.l4_proto = id_dir.m_id.get_l4_proto();
 
-                    fabs_spin_lock_ac lock(peer->m_lock);
-                    ebuf.push_back(std::move(evbuf));
-                }
+            h2.len = sizeof(tuple);
+        }
 
-                return false;
-            }
+        if (ev->m_body)
+            h2.len += bodylen;
+
+        if (event == STREAM_CREATED && meta)
+            h2.len += meta->size();
+
+        bool is_dsize = event == STREAM_DESTROYED && ifrule->m_max_body >= 0;
+        if (is_dsize)
+            h2.len += sizeof(dsize1) + sizeof(dsize2);
+
+        bool is_stat = event == STREAM_DESTROYED && stat;
+        if (is_stat)
+            h2.len += sizeof(*stat);
+
+        std::string &s = ev->m_header;
+
+        s.reserve(sizeof(h2) + sizeof(tuple));
+        s.assign((char*)&h2, sizeof(h2));
+
+        if (is_tuple)
+            s.append((char*)&tuple, sizeof(tuple));
+
+        if (event == STREAM_CREATED && meta)
+            s += *meta;
+
+        if (is_dsize) {
+            s.append((char*)&dsize1, sizeof(dsize1));
+            s.append((char*)&dsize2, sizeof(dsize2));
         }
+
+        if (is_stat)
+            s.append((const char*)stat, sizeof(*stat));
     } else {
         header->event    = event;
         header->from     = id_dir.m_dir;
@@ -1601,49 +3655,333 @@ fabs_appif::write_event(int fd, const fabs_id_dir &id_dir, ptr_ifrule ifrule,
         header->match    = match;
         header->reason   = reason;
 
-        memcpy(&header->tm, tm, sizeof(*tm));
+        memcpy(&header->tm, tm, sizeof(*tm));
+
+        ev->m_header.assign((char*)header, sizeof(*header));
+    }
+
+    return ev;
+}
+
+// serialize the summary of a flow for the flows interface
+fabs_appif::ptr_out_event
+fabs_appif::make_flow_event(const ifrule &flows,
+                            const fabs_id_dir &id_dir, uint64_t flow_id,
+                            const ptr_ifrule &ifrule, CLOSED_REASON reason,
+                            const fabs_flow_stat &stat)
+{
+    ptr_out_event ev(new out_event);
+    timeval       end;
+
+    // queued as a control event
+    ev->m_event = STREAM_DESTROYED;
+
+    end.tv_sec  = stat.end / 1000000;
+    end.tv_usec = stat.end % 1000000;
+
+    if (flows.m_format == IF_TEXT) {
+        std::string &s = ev->m_header;
+
+        s.reserve(320);
+
+        append_prefix(s, id_dir);
+
+        s += ",event=FLOW,id=";
+        append_uint(s, flow_id);
+
+        if (ifrule) {
+            s += ",rule=";
+            s += ifrule->m_name;
+        }
+
+        append_reason(s, reason);
+        append_stat(s, stat, true);
+
+        s += ",time=";
+        append_time(s, &end);
+        s += "\n";
+    } else {
+        fabs_appif_header2 h2;
+        fabs_appif_tuple   tuple;
+
+        memset(&h2, 0, sizeof(h2));
+        memset(&tuple, 0, sizeof(tuple));
+
+        memcpy(tuple.l3_addr1, &id_dir.m_id.m_addr1->l3_addr,
+               sizeof(tuple.l3_addr1));
+        memcpy(tuple.l3_addr2, &id_dir.m_id.m_addr2->l3_addr,
+               sizeof(tuple.l3_addr2));
+
+        tuple.l4_port1 = id_dir.m_id.m_addr1->l4_port;
+        tuple.l4_port2 = id_dir.m_id.m_addr2->l4_port;
+        tuple.hop      = id_dir.m_id.m_hop;
+        tuple.l3_proto = id_dir.m_id.get_l3_proto();
+        tuple.l4_proto = id_dir.m_id.get_l4_proto();
+
+        h2.id     = flow_id;
+        h2.tm     = stat.end;
+        h2.event  = APPIF2_FLOW;
+        h2.from   = FROM_NONE;
+        h2.match  = MATCH_NONE;
+        h2.reason = reason;
+        h2.len    = sizeof(tuple) + sizeof(stat);
+
+        if (ifrule)
+            h2.len += ifrule->m_name.size();
+
+        std::string &s = ev->m_header;
+
+        s.reserve(sizeof(h2) + h2.len);
+        s.assign((char*)&h2, sizeof(h2));
+        s.append((char*)&tuple, sizeof(tuple));
+        s.append((const char*)&stat, sizeof(stat));
+
+        if (ifrule)
+            s += ifrule->m_name;
+    }
+
+    return ev;
+}
+
+// publish a new route of a rule, must be called with m_rw_mutex locked
+// for writing
+void
+fabs_appif::update_route(ifrule &rule)
+{
+    auto rt = new route;
+
+    rt->m_slot.resize(rule.m_balance_name.size());
+
+    for (size_t i = 0; i < rule.m_balance_name.size(); i++) {
+        auto &name = rule.m_balance_name[i];
+        auto &slot = rt->m_slot[i];
+
+        auto it1 = m_name2uxpeer.find(name);
+        if (it1 != m_name2uxpeer.end()) {
+            for (auto fd: it1->second) {
+                auto it2 = m_fd2uxpeer.find(fd);
+                if (it2 == m_fd2uxpeer.end())
+                    continue;
+
+                slot.m_fd2idx[fd] = slot.m_peer.size();
+                slot.m_owner.push_back(it2->second);
+                slot.m_peer.push_back(it2->second.get());
+            }
+        }
+
+        auto it3 = m_name2group.find(name);
+        if (it3 != m_name2group.end())
+            slot.m_group = it3->second;
+    }
+
+    m_rcu->retire(rule.m_route.exchange(rt));
+}
+
+// publish new routes of the rules having path, must be called with
+// m_rw_mutex locked for writing
+void
+fabs_appif::update_routes(const std::string &path)
+{
+    for (auto it = m_routed.begin(); it != m_routed.end(); ) {
+        auto rule = it->lock();
+        if (! rule) {
+            it = m_routed.erase(it);
+            continue;
+        }
+
+        auto &names = rule->m_balance_name;
+        if (std::find(names.begin(), names.end(), path) != names.end())
+            update_route(*rule);
+
+        ++it;
+    }
+}
+
+fabs_appif::ifrule::~ifrule()
+{
+    delete m_route.load();
+}
+
+void
+fabs_appif::group::add(int fd, uint64_t id)
+{
+    m_member[fd] = id;
+
+    for (int i = 0; i < GROUP_VNODE; i++) {
+        m_ring[mix_hash(id * GROUP_VNODE + i)] = fd;
+    }
+
+    m_gen++;
+}
+
+void
+fabs_appif::group::remove(int fd)
+{
+    auto it = m_member.find(fd);
+    if (it == m_member.end())
+        return;
+
+    for (int i = 0; i < GROUP_VNODE; i++) {
+        auto it2 = m_ring.find(mix_hash(it->second * GROUP_VNODE + i));
+        if (it2 != m_ring.end() && it2->second == fd)
+            m_ring.erase(it2);
+    }
+
+    m_member.erase(it);
+    m_gen++;
+}
+
+// return the reader of a flow, or -1 if no reader
+int
+fabs_appif::group::lookup(uint32_t hash) const
+{
+    if (m_ring.empty())
+        return -1;
+
+    auto it = m_ring.lower_bound(mix_hash(hash));
+    if (it == m_ring.end())
+        it = m_ring.begin();
+
+    return it->second;
+}
+
+bool
+fabs_appif::write_event(uxpeer *peer, const ptr_out_event &ev)
+{
+    if (peer->m_is_closed)
+        return false;
+
+    bool result = push_event(peer, ev);
+
+    m_writer[peer->m_writer]->notify();
+
+    return result;
+}
+
+// queue an event to the writer thread of the peer, the same event is
+// shared by all peers of a rule
+// when the backlog is full, the overflow policy of the rule is applied
+bool
+fabs_appif::push_event(uxpeer *peer, ptr_out_event ev)
+{
+    if (peer->m_is_slow)
+        return false;
+
+    if (peer->m_spill)
+        return spill_event(peer, ev);
 
-        if (bodylen > 0 && ifrule->m_is_body) {
-            iovec iov[2];
+    auto &ebuf = peer->m_event_buf;
 
-            iov[0].iov_base = header;
-            iov[0].iov_len  = sizeof(*header);
+    // ebuf itself is read only with the lock
+    if (peer->m_num_event_buf == 0 && peer->push(ev))
+        return true;
 
-            iov[1].iov_base = body;
-            iov[1].iov_len  = bodylen;
+    fabs_spin_lock_ac lock(peer->m_lock);
 
-            if (writev(fd, iov, 2) < 0) {
-                print_write_err(fd, peer->m_path);
-                return false;
-            }
-        } else {
-            if (write(fd, header, sizeof(*header)) < 0) {
-                print_write_err(fd, peer->m_path);
+    while (! ebuf.empty()) {
+        if (! peer->push(ebuf.front()))
+            break;
 
-                if (event == STREAM_CREATED || event == STREAM_DESTROYED) {
-                    std::unique_ptr<event_buf> evbuf(new event_buf);
+        ebuf.pop_front();
+    }
 
-                    evbuf->m_header = *header;
+    peer->m_num_event_buf = ebuf.size();
 
-                    fabs_spin_lock_ac lock(peer->m_lock);
-                    ebuf.push_back(std::move(evbuf));
-                }
+    if (ebuf.empty() && peer->push(ev))
+        return true;
 
+    switch (peer->m_overflow) {
+    case OVERFLOW_KEEP_CONTROL:
+        if (ev->m_event == STREAM_CREATED || ev->m_event == STREAM_DESTROYED) {
+            if (ebuf.size() < MAX_EVENT_BUF) {
+                ebuf.push_back(std::move(ev));
+                peer->m_num_event_buf = ebuf.size();
                 return false;
             }
+
+            // the reader does not read even control events
+            disconnect_slow(peer);
         }
+        break;
+    case OVERFLOW_DISCONNECT:
+        disconnect_slow(peer);
+        break;
+    default:
+        break;
     }
 
-    return true;
+    peer->m_num_drop++;
+    peer->m_num_drop_bytes += ev->get_len();
+
+    return false;
+}
+
+// events go to the spill while it has events not replayed yet, and when
+// the backlog is full
+bool
+fabs_appif::spill_event(uxpeer *peer, ptr_out_event &ev)
+{
+    auto &spill      = peer->m_spill;
+    bool  is_control = peer->m_overflow == OVERFLOW_KEEP_CONTROL &&
+                       (ev->m_event == STREAM_CREATED ||
+                        ev->m_event == STREAM_DESTROYED);
+
+    const char *body = ev->m_body ? ev->m_body->get_head() : nullptr;
+    size_t      blen = ev->m_body ? ev->m_body->get_len() : 0;
+
+    auto result = spill->append(ev->m_header, body, blen, is_control, false);
+
+    if (result == fabs_spill::SPILL_INACTIVE) {
+        if (peer->push(ev))
+            return true;
+
+        result = spill->append(ev->m_header, body, blen, is_control, true);
+    }
+
+    if (result == fabs_spill::SPILL_OK)
+        return true;
+
+    // over the quota
+    if (peer->m_overflow == OVERFLOW_DISCONNECT)
+        disconnect_slow(peer);
+
+    peer->m_num_drop++;
+    peer->m_num_drop_bytes += ev->get_len();
+
+    return false;
+}
+
+// mark a reader not keeping up, then its writer thread, which is notified
+// by write_event, shuts down the socket and the listener thread closes it
+// by EOF
+// the socket is not touched here, since the writer may have closed it and
+// the fd may be reused
+void
+fabs_appif::disconnect_slow(uxpeer *peer)
+{
+    if (peer->m_is_slow.exchange(true))
+        return;
+
+    std::cerr << "disconnect slow reader on " << peer->m_path
+              << " (fd = " << peer->m_fd << ")" << std::endl;
 }
 
 fabs_appif::stream_info::stream_info(const fabs_id &id, const timeval &tm) :
     m_create_time(tm), m_dsize1(0), m_dsize2(0), m_is_created(false), m_is_giveup(false),
-    m_is_buf1(false), m_is_buf2(false), m_reason(CLOSED_NORMAL)
+    m_is_buf1(false), m_is_buf2(false), m_reason(CLOSED_NORMAL),
+    m_client_dir(FROM_NONE), m_is_classifying(false), m_is_closing(false),
+    m_is_force(false), m_job_seq(0), m_last_time(tm), m_last_len1(-1),
+    m_last_len2(-1), m_last_both(false), m_flow_id(0), m_group_fd(-1),
+    m_group_idx(-1),
+    m_group_peer(0),
+    m_group_gen(0)
 {
     m_match_dir[0] = MATCH_NONE;
     m_match_dir[1] = MATCH_NONE;
 
+    m_sent[0] = 0;
+    m_sent[1] = 0;
+
     memset(&m_header, 0, sizeof(m_header));
 
     memcpy(&m_header.l3_addr1, &id.m_addr1->l3_addr,
@@ -1691,12 +4029,35 @@ void
 fabs_appif::appif_consumer::in_datagram(const fabs_id_dir &id_dir,
                                         ptr_fabs_bytes bytes)
 {
-    uint8_t    idx = bytes->get_head()[0];
-    ptr_ifrule ifrule;
-    match_dir  match = MATCH_NONE;
+    uint8_t     idx = bytes->get_head()[0];
+    ptr_ifrule  ifrule;
+    match_dir   match = MATCH_NONE;
+    std::string dmeta; // by built-in classifiers
 
     for (auto it_udp = m_ifrule_udp.begin(); it_udp != m_ifrule_udp.end();
          ++it_udp) {
+        // check built-in classifiers
+        auto &lst = it_udp->second->ifrule_classifier;
+        for (auto it0 = lst.begin(); it0 != lst.end(); ++it0) {
+            std::string meta;
+
+            if (m_appif.is_in_port(*(*it0)->m_port, id_dir.get_port_src(),
+                                   id_dir.get_port_dst()) &&
+                (*it0)->m_classifier->match_datagram(bytes->get_head(),
+                                                     bytes->get_len(), meta)) {
+                ifrule = *it0;
+                match  = MATCH_UP;
+                dmeta  = std::move(meta);
+
+                if (m_appif.m_is_lru) {
+                    lst.erase(it0);
+                    lst.push_front(ifrule);
+                }
+
+                goto brk;
+            }
+        }
+
         // check cache
         auto cache_udp = it_udp->second->cache_up;
         if (m_appif.m_is_cache && cache_udp[idx] &&
@@ -1763,13 +4124,33 @@ fabs_appif::appif_consumer::in_datagram(const fabs_id_dir &id_dir,
         }
     }
 
-    if (m_appif.m_udp_default)
-        ifrule = m_appif.m_udp_default;
+    if (m_udp_default)
+        ifrule = m_udp_default;
 
 brk:
+    if (m_ifflows)
+        count_udp_flow(id_dir, ifrule, *bytes);
+
     if (! ifrule)
         return;
 
+    // datagrams from loopback7 (hop > 0) carry payloads alone, not frames
+    if (ifrule->m_capture && id_dir.m_id.m_hop == 0) {
+        std::string desc;
+        append_prefix(desc, id_dir);
+        ifrule->m_capture->write(desc, *bytes);
+    }
+
+    if (ifrule->m_sample > 1 &&
+        mix_hash(id_dir.m_id.get_hash()) % ifrule->m_sample != 0) {
+        // not sampled
+        return;
+    }
+
+    if (ifrule->m_max_event_len >= 0 &&
+        bytes->get_len() > ifrule->m_max_event_len) {
+        bytes->skip_tail(bytes->get_len() - ifrule->m_max_event_len);
+    }
 
     fabs_appif_header header;
 
@@ -1789,36 +4170,177 @@ brk:
     header.len      = bytes->get_len();
     header.match    = match;
 
-    int idx2;
-    if (ifrule->m_balance == 1) {
-        idx2 = 1;
-    } else {
-        idx2 = id_dir.m_id.get_hash() & (ifrule->m_balance - 1);
+    sptr_fabs_bytes body(std::move(bytes));
+
+    // counted as MEM_BACKLOG by the peers from now on
+    body->uncharge();
+
+    fabs_rcu_read lock(*m_appif.m_rcu, m_id);
+
+    auto slot = get_slot(*ifrule, id_dir.m_id.get_hash());
+    if (slot == nullptr || slot->m_peer.empty())
+        return;
+
+    if (ifrule->m_is_group) {
+        // datagrams have no state, so they are just hashed
+        int idx = slot->lookup(id_dir.m_id.get_hash());
+        if (idx >= 0) {
+            auto ev = m_appif.make_event(id_dir, ifrule, STREAM_DATA, match,
+                                         CLOSED_NORMAL, &header, body,
+                                         &body->m_tm, nullptr, &dmeta);
+            m_appif.write_event(slot->m_peer[idx], ev);
+        }
+
+        return;
     }
-    std::string &name = ifrule->m_balance_name[idx2];
 
-    fabs_spin_rwlock_read lock(m_appif.m_rw_mutex);
+    auto ev = m_appif.make_event(id_dir, ifrule, STREAM_DATA, match,
+                                 CLOSED_NORMAL, &header, body,
+                                 &body->m_tm, nullptr, &dmeta);
 
-    auto it3 = m_appif.m_name2uxpeer.find(name);
+    for (auto peer: slot->m_peer) {
+        m_appif.write_event(peer, ev);
+    }
+}
 
-    if (it3 != m_appif.m_name2uxpeer.end()) {
-        for (auto it4 = it3->second.begin();
-             it4 != it3->second.end(); ++it4) {
-            if (! m_appif.write_event(*it4, id_dir, ifrule, STREAM_DATA,
-                                      match, CLOSED_NORMAL, &header, bytes->get_head(),
-                                      bytes->get_len(), &bytes->m_tm)) {
-                continue;
-            }
+// write the summary of a flow to the flows interface
+// ifrule is the rule the flow was classified to, or null
+void
+fabs_appif::appif_consumer::send_flow(const fabs_id_dir &id_dir,
+                                      uint64_t flow_id,
+                                      const ptr_ifrule &ifrule,
+                                      CLOSED_REASON reason,
+                                      const fabs_flow_stat &stat)
+{
+    auto &flows = m_ifflows;
+
+    // removed by reloading
+    if (! flows)
+        return;
+
+    fabs_rcu_read lock(*m_appif.m_rcu, m_id);
+
+    auto slot = get_slot(*flows, id_dir.m_id.get_hash());
+    if (slot == nullptr || slot->m_peer.empty())
+        return;
+
+    if (flows->m_is_group) {
+        int idx = slot->lookup(id_dir.m_id.get_hash());
+        if (idx >= 0) {
+            m_appif.write_event(slot->m_peer[idx],
+                                m_appif.make_flow_event(*flows, id_dir,
+                                                        flow_id, ifrule,
+                                                        reason, stat));
         }
+
+        return;
+    }
+
+    auto ev = m_appif.make_flow_event(*flows, id_dir, flow_id, ifrule, reason,
+                                      stat);
+
+    for (auto peer: slot->m_peer) {
+        m_appif.write_event(peer, ev);
+    }
+}
+
+void
+fabs_appif::appif_consumer::count_udp_flow(const fabs_id_dir &id_dir,
+                                           const ptr_ifrule &ifrule,
+                                           fabs_bytes &bytes)
+{
+    auto &seq = m_udp_flow.get<1>();
+    auto  it  = m_udp_flow.find(id_dir.m_id);
+
+    if (it == m_udp_flow.end()) {
+        // new flows are not counted over the memory limits
+        if (fabs_mem::get_level() != fabs_mem::LEVEL_NORMAL)
+            return;
+
+        // the least recently seen flow is written early
+        if (m_appif.m_udp_flow_size > 0 &&
+            seq.size() >= m_appif.m_udp_flow_size)
+            pop_udp_flow();
+
+        it = m_udp_flow.insert(udp_flow(id_dir.m_id)).first;
+        fabs_mem::add(MEM_FLOW, sizeof(udp_flow));
+    } else {
+        seq.relocate(seq.end(), m_udp_flow.project<1>(it));
+    }
+
+    auto &flow = *it;
+    int   i    = id_dir.m_dir == FROM_ADDR2 ? 1 : 0;
+
+    uint64_t tm = bytes.m_tm.tv_sec * 1000000ULL + bytes.m_tm.tv_usec;
+
+    if (flow.m_flow_id == 0) {
+        flow.m_flow_id    = ++m_appif.m_flow_id;
+        flow.m_stat.start = tm;
+    }
+
+    if (! flow.m_ifrule)
+        flow.m_ifrule = ifrule;
+
+    flow.m_time = time(NULL);
+    flow.m_stat.end = tm;
+    flow.m_stat.packets[i]++;
+    flow.m_stat.bytes[i] += bytes.get_len();
+}
+
+// UDP flows idle for udp_timeout seconds are written to the flows interface
+// checked at most once a second
+void
+fabs_appif::appif_consumer::expire_udp_flow()
+{
+    time_t now = time(NULL);
+
+    if (now == m_udp_check)
+        return;
+
+    m_udp_check = now;
+
+    auto &seq = m_udp_flow.get<1>();
+
+    while (! seq.empty() &&
+           now - seq.front().m_time >= m_appif.m_udp_timeout) {
+        pop_udp_flow();
     }
 }
 
+// write the least recently seen UDP flow to the flows interface
+void
+fabs_appif::appif_consumer::pop_udp_flow()
+{
+    auto &seq  = m_udp_flow.get<1>();
+    auto &flow = seq.front();
+
+    fabs_id_dir id_dir;
+
+    id_dir.m_id  = flow.m_id;
+    id_dir.m_dir = FROM_NONE;
+
+    send_flow(id_dir, flow.m_flow_id, flow.m_ifrule, CLOSED_TIMEOUT,
+              flow.m_stat);
+
+    seq.pop_front();
+    fabs_mem::sub(MEM_FLOW, sizeof(udp_flow));
+}
+
+void
+fabs_appif::appif_consumer::clear_udp_flow()
+{
+    fabs_mem::sub(MEM_FLOW, m_udp_flow.size() * sizeof(udp_flow),
+                  m_udp_flow.size());
+    m_udp_flow.clear();
+}
+
 void
 fabs_appif::appif_consumer::consume(int id)
 {
     std::ostringstream os;
     os << "SF-TAP rgx[" << id << "]";
     SET_THREAD_NAME(pthread_self(), os.str().c_str());
+    fabs_mem::set_thread_name(os.str());
 
     for (;;) {
         {
@@ -1828,33 +4350,208 @@ fabs_appif::appif_consumer::consume(int id)
             if (m_is_break)
                 return;
 
-            while (m_ev_queue.get_len() == 0) {
+            while (m_ev_queue.get_len() == 0 &&
+                   m_done_queue.get_len() == 0 && m_appif.m_num_job <= 0) {
+                if (m_is_consuming) {
+                    // no more events for a while, so writers need not
+                    // wait for deadlines of batches
+                    for (auto &w: m_appif.m_writer) {
+                        w->notify_idle();
+                    }
+                }
+
                 m_is_consuming = false;
                 m_condition.wait_for(lock, std::chrono::milliseconds(50));
 
                 if (m_is_break)
                     return;
+
+                if (! m_udp_flow.empty() && time(NULL) != m_udp_check)
+                    break;
             }
             m_is_consuming = true;
         }
 
-        appif_event *ev;
-        while (m_ev_queue.pop(&ev)) {
-            if (ev->id_dir.m_id.get_l4_proto() == IPPROTO_TCP) {
-                in_stream_event(ev->st_event, ev->id_dir, std::move(ev->bytes));
-            } else if (ev->id_dir.m_id.get_l4_proto() == IPPROTO_UDP) {
-                in_datagram(ev->id_dir, std::move(ev->bytes));
+        if (m_rule_gen != m_appif.m_rule_gen)
+            load_rules();
+
+        appif_event ev;
+        int n = 0;
+        while (n++ < CONSUME_BATCH && m_ev_queue.pop(&ev)) {
+            if (ev.id_dir.m_id.get_l4_proto() == IPPROTO_TCP) {
+                in_stream_event(ev);
+            } else if (ev.id_dir.m_id.get_l4_proto() == IPPROTO_UDP) {
+                in_datagram(ev.id_dir, std::move(ev.bytes));
             }
-            delete ev;
+            ev.bytes.reset();
 
             if (m_is_break)
                 return;
         }
+
+        run_jobs();
+
+        if (! m_udp_flow.empty())
+            expire_udp_flow();
+    }
+}
+
+void
+fabs_appif::appif_consumer::wakeup()
+{
+    if (m_mutex.try_lock()) {
+        m_condition.notify_one();
+        m_mutex.unlock();
+    }
+}
+
+// queue a classify job which may be stolen by other consumers
+void
+fabs_appif::appif_consumer::submit_job(classify_job *job)
+{
+    auto  &q = m_appif.m_job_queue[m_id];
+    size_t len;
+
+    {
+        fabs_spin_lock_ac lock(q->m_lock);
+        q->m_jobs.push_back(job);
+        len = q->m_jobs.size();
+    }
+
+    m_appif.m_num_job++;
+
+    if (len > 1) {
+        // jobs are piling up, so let an idle consumer steal them
+        for (auto &c: m_appif.m_consumer) {
+            if (c.get() != this && ! c->m_is_consuming) {
+                c->wakeup();
+                break;
+            }
+        }
+    }
+}
+
+// called by the owner when the job has been run
+void
+fabs_appif::appif_consumer::done_job(classify_job *job)
+{
+    auto it = m_info.find(job->m_id_dir.m_id);
+
+    // the flow was destroyed or has been classified meanwhile
+    if (it == m_info.end() || ! it->second->m_is_classifying ||
+        it->second->m_job_seq != job->m_seq)
+        return;
+
+    auto p_info = it->second.get();
+
+    p_info->m_is_classifying = false;
+
+    bool is_classified = apply_job(p_info, job);
+
+    flush_tcp_data(p_info, job->m_id_dir, is_classified);
+}
+
+// finish own jobs run by other consumers
+// return true if any job was finished
+bool
+fabs_appif::appif_consumer::take_done_jobs()
+{
+    classify_job *job;
+    bool is_run = false;
+
+    while (m_done_queue.pop(&job)) {
+        done_job(job);
+        delete job;
+        is_run = true;
+    }
+
+    return is_run;
+}
+
+// run own jobs, and steal the oldest job of another consumer if idle
+// return true if any job was run
+bool
+fabs_appif::appif_consumer::run_jobs()
+{
+    classify_job *job;
+    bool is_run = take_done_jobs();
+
+    if (m_appif.m_num_job <= 0)
+        return is_run;
+
+    auto &q = m_appif.m_job_queue[m_id];
+
+    for (;;) {
+        {
+            fabs_spin_lock_ac lock(q->m_lock);
+
+            if (q->m_jobs.empty())
+                break;
+
+            job = q->m_jobs.back();
+            q->m_jobs.pop_back();
+        }
+
+        m_appif.m_num_job--;
+
+        classify_tcp(job);
+        done_job(job);
+        delete job;
+
+        m_job_local++;
+        is_run = true;
+    }
+
+    if (m_ev_queue.get_len() > 0)
+        return is_run;
+
+    for (int i = 1; i < m_appif.m_num_consumer; i++) {
+        auto &q2 = m_appif.m_job_queue[(m_id + i) % m_appif.m_num_consumer];
+
+        job = nullptr;
+
+        {
+            fabs_spin_lock_ac lock(q2->m_lock);
+
+            if (! q2->m_jobs.empty()) {
+                job = q2->m_jobs.front();
+                q2->m_jobs.pop_front();
+            }
+        }
+
+        if (job == nullptr)
+            continue;
+
+        m_appif.m_num_job--;
+
+        // classify by the rules of this consumer, and return the result
+        // to the owner which keeps the order of events of the flow
+        classify_tcp(job);
+
+        m_job_stolen++;
+
+        auto &owner = m_appif.m_consumer[job->m_owner];
+
+        while (! owner->m_done_queue.push(job)) {
+            // the owner may be spinning to return a job stolen from this
+            // consumer, so take ours meanwhile
+            take_done_jobs();
+
+            if (! owner->m_is_consuming)
+                owner->wakeup();
+        }
+
+        if (! owner->m_is_consuming)
+            owner->wakeup();
+
+        return true;
     }
+
+    return is_run;
 }
 
 void
-fabs_appif::appif_consumer::produce(appif_event *ev)
+fabs_appif::appif_consumer::produce(appif_event &ev)
 {
     // produce event
     while (! m_ev_queue.push(ev)) {
@@ -1873,27 +4570,76 @@ fabs_appif::appif_consumer::appif_consumer(int id, fabs_appif &appif) :
     m_is_break(false),
     m_is_consuming(false),
     m_appif(appif),
+    m_udp_check(0),
+    m_rule_gen(0),
+    m_classify_bytes_max(-1),
+    m_classify_time_max(-1),
+    m_has_unidir(false),
+    m_job_seq(0),
+    m_job_local(0),
+    m_job_stolen(0),
+    m_ep_hit(0),
+    m_ep_miss(0),
+    m_ep_expire(0),
+    m_ep_len(0),
     m_thread(std::bind(&fabs_appif::appif_consumer::consume, this, id))
 {
-    for (auto it_tcp = appif.m_ifrule_tcp.begin();
-         it_tcp != appif.m_ifrule_tcp.end(); ++it_tcp) {
+
+}
+
+// copy the rules of fabs_appif, which are replaced by reloading
+// flows keep the rules they were classified to, but the endpoint cache
+// is cleared, since the rules in it may have been removed
+void
+fabs_appif::appif_consumer::load_rules()
+{
+    fabs_spin_rwlock_read lock(m_appif.m_rw_mutex);
+
+    m_rule_gen = m_appif.m_rule_gen;
+
+    m_ifrule_tcp.clear();
+    m_ifrule_udp.clear();
+
+    for (auto it_tcp = m_appif.m_ifrule_tcp.begin();
+         it_tcp != m_appif.m_ifrule_tcp.end(); ++it_tcp) {
         ptr_ifrule_storage2 p = ptr_ifrule_storage2(new ifrule_storage2);
 
         p->ifrule = it_tcp->second->ifrule;
         p->ifrule_no_regex = it_tcp->second->ifrule_no_regex;
+        p->ifrule_classifier = it_tcp->second->ifrule_classifier;
+        p->max_bytes = it_tcp->second->max_bytes;
+        p->max_time  = it_tcp->second->max_time;
 
         m_ifrule_tcp[it_tcp->first] = std::move(p);
     }
 
-    for (auto it_udp = appif.m_ifrule_udp.begin();
-         it_udp != appif.m_ifrule_udp.end(); ++it_udp) {
+    for (auto it_udp = m_appif.m_ifrule_udp.begin();
+         it_udp != m_appif.m_ifrule_udp.end(); ++it_udp) {
         ptr_ifrule_storage2 p = ptr_ifrule_storage2(new ifrule_storage2);
 
         p->ifrule = it_udp->second->ifrule;
         p->ifrule_no_regex = it_udp->second->ifrule_no_regex;
+        p->ifrule_classifier = it_udp->second->ifrule_classifier;
+        p->max_bytes = it_udp->second->max_bytes;
+        p->max_time  = it_udp->second->max_time;
 
         m_ifrule_udp[it_udp->first] = std::move(p);
     }
+
+    m_tcp_default = m_appif.m_tcp_default;
+    m_udp_default = m_appif.m_udp_default;
+    m_ifflows     = m_appif.m_ifflows;
+
+    // UDP flows are counted only for the flows interface
+    if (! m_ifflows)
+        clear_udp_flow();
+
+    m_classify_bytes_max = m_appif.m_classify_bytes_max;
+    m_classify_time_max  = m_appif.m_classify_time_max;
+    m_has_unidir         = m_appif.m_has_unidir;
+
+    m_ep_cache.clear();
+    m_ep_len.store(0, std::memory_order_relaxed);
 }
 
 fabs_appif::appif_consumer::~appif_consumer()
@@ -1906,6 +4652,8 @@ fabs_appif::appif_consumer::~appif_consumer()
     }
 
     m_thread.join();
+
+    clear_udp_flow();
 }
 
 void
@@ -1921,3 +4669,101 @@ fabs_appif::print_info()
         }
     }
 }
+
+void
+fabs_appif::print_stat()
+{
+    if (m_is_ep_cache) {
+        uint64_t hit = 0, miss = 0, expire = 0;
+        size_t   size = 0;
+
+        for (auto &c: m_consumer) {
+            hit    += c->m_ep_hit;
+            miss   += c->m_ep_miss;
+            expire += c->m_ep_expire;
+            size   += c->m_ep_len.load(std::memory_order_relaxed);
+        }
+
+        std::cout << "endpoint cache: entries = " << size
+                  << ", hit = " << hit
+                  << ", miss = " << miss
+                  << ", expired = " << expire << std::endl;
+    }
+
+    if (m_is_classify_pool) {
+        uint64_t local = 0, stolen = 0;
+
+        for (auto &c: m_consumer) {
+            local  += c->m_job_local;
+            stolen += c->m_job_stolen;
+        }
+
+        std::cout << "classify jobs: queued = " << m_num_job
+                  << ", local = " << local
+                  << ", stolen = " << stolen << std::endl;
+    }
+
+    uint64_t num_writev = 0, num_event = 0;
+
+    for (auto &w: m_writer) {
+        num_writev += w->m_num_writev;
+        num_event  += w->m_num_event;
+    }
+
+    if (num_writev > 0) {
+        std::cout << "writers: writev = " << num_writev
+                  << ", events = " << num_event
+                  << ", events/writev = " << (double)num_event / num_writev
+                  << std::endl;
+    }
+
+    // routes retired by the last change of readers, and peers closed
+    if (m_rcu)
+        m_rcu->reclaim();
+
+    fabs_spin_rwlock_read lock(m_rw_mutex);
+
+    for (auto &rule: m_ifcapture) {
+        rule->m_capture->print_stat();
+    }
+
+    for (auto &it: m_name2group) {
+        std::cout << "consumer group " << it.first
+                  << ": readers = " << it.second.m_member.size()
+                  << ", generation = " << it.second.m_gen << std::endl;
+    }
+
+    // readers lagging behind
+    uint64_t now = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+
+    for (auto &it: m_fd2uxpeer) {
+        auto &peer = it.second;
+
+        uint64_t spilled = peer->m_spill ? peer->m_spill->get_bytes() : 0;
+
+        if (peer->m_backlog == 0 && peer->m_num_drop == 0 && spilled == 0)
+            continue;
+
+        uint64_t pending = peer->m_pending_time;
+        uint64_t lag     = pending > 0 && now > pending ? now - pending : 0;
+
+        std::cout << "reader " << peer->m_path << " (fd = " << peer->m_fd
+                  << "): backlog = " << peer->m_backlog
+                  << " bytes, lag = " << lag
+                  << " ms, sent = " << peer->m_num_sent
+                  << ", dropped = " << peer->m_num_drop
+                  << " (" << peer->m_num_drop_bytes << " bytes)";
+
+        if (peer->m_spill) {
+            uint64_t since = peer->m_spill->get_time();
+
+            std::cout << ", spilled = " << spilled << " bytes for "
+                      << (since > 0 && now > since ? now - since : 0)
+                      << " ms (total " << peer->m_spill->get_total()
+                      << " bytes)";
+        }
+
+        std::cout << std::endl;
+    }
+}
@@ -6,6 +6,11 @@
 #include "fabs_spin_rwlock.hpp"
 #include "fabs_cb.hpp"
 #include "fabs_conf.hpp"
+#include "fabs_classifier.hpp"
+#include "fabs_shm.hpp"
+#include "fabs_capture.hpp"
+#include "fabs_spill.hpp"
+#include "fabs_rcu.hpp"
 
 #include <event.h>
 #include <re2/re2.h>
@@ -19,12 +24,18 @@
 #include <deque>
 #include <memory>
 #include <thread>
+#include <atomic>
 #include <condition_variable>
 
 //#include <std/regex.hpp>
 #include <boost/filesystem/path.hpp>
 #include <boost/filesystem/operations.hpp>
 
+#include <boost/multi_index_container.hpp>
+#include <boost/multi_index/sequenced_index.hpp>
+#include <boost/multi_index/ordered_index.hpp>
+#include <boost/multi_index/member.hpp>
+
 enum fabs_stream_event {
     // abstraction events
     STREAM_CREATED   = 0,
@@ -70,10 +81,20 @@ public:
     void read_conf(fabs_conf &conf);
     void run();
 
+    // read the rules of the configuration file again, called by the
+    // listener thread on SIGHUP
+    void reload_conf();
+
     void in_event(fabs_stream_event st_event,
                   const fabs_id_dir &id_dir, ptr_fabs_bytes bytes);
 
+    // events without payload, and DESTROYED may carry counters of fabs_tcp
+    void in_event(fabs_stream_event st_event,
+                  const fabs_id_dir &id_dir, const timeval &tm,
+                  const fabs_flow_stat *stat = nullptr);
+
     void print_info();
+    void print_stat();
 
     int  get_tcp_timeout() const { return m_tcp_timeout; }
     int  get_num_tcp_threads() const { return m_num_tcp_threads; }
@@ -83,6 +104,10 @@ public:
         for (auto &c: m_consumer) {
             c->stop();
         }
+
+        for (auto &w: m_writer) {
+            w->stop();
+        }
     }
 
 private:
@@ -97,11 +122,23 @@ private:
 
     enum ifformat {
         IF_BINARY,
+        IF_BINARY2,
         IF_TEXT
     };
 
+    // what to do when the backlog of a reader is full
+    enum ifoverflow {
+        OVERFLOW_DROP,         // discard any event
+        OVERFLOW_KEEP_CONTROL, // discard data, but keep CREATED and DESTROYED
+        OVERFLOW_DISCONNECT,   // disconnect the reader
+        OVERFLOW_DEFAULT,      // use the global one
+    };
+
+    struct route;
+
     struct ifrule {
         ptr_regex   m_up, m_down;
+        ptr_classifier m_classifier;
         std::string m_name;
         ifproto     m_proto;
         ifformat    m_format;
@@ -109,30 +146,129 @@ private:
         bool        m_is_body;
         int         m_nice;
         int         m_balance;
+        int         m_classify_bytes; // per direction, -1 means global one
+        int         m_classify_time;  // [s], 0 means no limit
+        int         m_unidir;         // match by one direction alone
+        int         m_flush_latency;  // [ms] max delay of batched output
+        long        m_backlog_bytes;  // per reader, -1 means global one
+        ifoverflow  m_overflow;
+        bool        m_is_shm;         // write to shared memory rings
+        bool        m_is_group;       // readers of a path share flows
+        long        m_max_body;       // payload per direction, -1 means no limit
+        int         m_max_event_len;  // payload per DATA, -1 means no limit
+        int         m_sample;         // send 1 of N flows
+        bool        m_is_summary;     // counters of the flow at DESTROYED
+        std::string m_capture_dir;    // write frames to pcap files
+        uint64_t    m_capture_bytes;  // rotate a pcap file at this size
+        time_t      m_capture_time;   // [s] and at this age, 0 means never
+        std::shared_ptr<fabs_capture> m_capture; // kept by reloading
+        std::string m_spill_dir;      // spill events of lagging readers
+        uint64_t    m_spill_quota;    // bytes on disk per reader
+        std::string m_listen;         // host:port of a TCP listener
+        std::set<int> m_tcp_fd;       // TCP listen sockets
+        size_t      m_shm_size;
         std::vector<std::string>   m_balance_name;
         std::map<int, std::string> m_fd2path; // listen socket to path
+        std::map<int, event*> m_listen_ev;    // accept events of m_fd2path
         std::unique_ptr<std::list<std::pair<uint16_t, uint16_t> > > m_port;
+        std::atomic<route*> m_route;  // readers, published by update_route
 
+        ~ifrule();
         ifrule() : m_proto(IF_OTHER), m_format(IF_TEXT), m_is_body(true),
-                   m_nice(100), m_balance(1),
-                   m_port(new std::list<std::pair<uint16_t, uint16_t> >) { }
+                   m_nice(100), m_balance(1), m_classify_bytes(-1),
+                   m_classify_time(-1), m_unidir(-1), m_flush_latency(0),
+                   m_backlog_bytes(-1), m_overflow(OVERFLOW_DEFAULT),
+                   m_is_shm(false), m_is_group(false), m_max_body(-1),
+                   m_max_event_len(-1), m_sample(1), m_is_summary(false),
+                   m_capture_bytes(100 * 1024 * 1024), m_capture_time(0),
+                   m_spill_quota(1024 * 1024 * 1024),
+                   m_shm_size(16 * 1024 * 1024),
+                   m_port(new std::list<std::pair<uint16_t, uint16_t> >),
+                   m_route(nullptr) { }
     };
 
     typedef std::shared_ptr<ifrule> ptr_ifrule;
 
-    struct event_buf {
-        std::string       m_header_str;
-        fabs_appif_header m_header;
+    // serialized event waiting for a writer thread
+    struct out_event {
+        fabs_stream_event m_event;
+        std::string       m_header; // text or binary header
+        sptr_fabs_bytes   m_body;
+
+        size_t get_len() const {
+            return m_header.size() + (m_body ? m_body->get_len() : 0);
+        }
     };
 
+    typedef std::shared_ptr<out_event> ptr_out_event;
+
     struct uxpeer {
         int            m_fd;
         event         *m_ev;
         bool           m_is_avail;
         ptr_ifrule     m_ifrule;
         std::string    m_path;
+        int            m_writer;    // index of the writer thread
+        uint64_t       m_id;        // unique, fd may be reused
+        volatile bool  m_is_closed; // closed by the listener thread
         fabs_spin_lock m_lock;
-        std::deque<std::unique_ptr<event_buf>> m_event_buf;
+        std::deque<ptr_out_event> m_event_buf; // control events overflowed
+        std::atomic<size_t> m_num_event_buf; // read without m_lock
+        fabs_cb<ptr_out_event>    m_queue;     // consumers to the writer
+
+        // backlog is bounded by bytes of queued but unwritten events
+        size_t              m_backlog_max;
+        ifoverflow          m_overflow;
+        std::atomic<size_t> m_backlog;
+        std::atomic<bool>   m_is_slow;   // disconnected due to overflow
+        std::atomic<uint64_t> m_num_drop;
+        std::atomic<uint64_t> m_num_drop_bytes;
+
+        // used only by the writer thread
+        std::deque<ptr_out_event> m_batch; // events written by a writev
+        size_t         m_batch_pos;   // written bytes of the first event
+        size_t         m_batch_bytes;
+        uint64_t       m_batch_time;  // [ms] when the batch was started
+        bool           m_is_blocked;  // waiting for EV_WRITE
+        bool           m_is_err;
+        bool           m_is_shut;     // shut down due to m_is_slow
+        event         *m_ev_write;    // EV_WRITE, or EV_READ of shm space
+        std::unique_ptr<fabs_shm> m_shm; // transport: shm
+        std::unique_ptr<fabs_spill> m_spill; // events over the backlog
+        volatile uint64_t m_num_sent;
+        volatile uint64_t m_pending_time; // [ms] batch_time, 0 if no event
+
+        uxpeer() : m_fd(-1), m_ev(nullptr), m_is_avail(true), m_writer(-1),
+                   m_id(0), m_is_closed(false), m_num_event_buf(0),
+                   m_backlog_max(0),
+                   m_overflow(OVERFLOW_KEEP_CONTROL), m_backlog(0),
+                   m_is_slow(false), m_num_drop(0), m_num_drop_bytes(0),
+                   m_batch_pos(0), m_batch_bytes(0), m_batch_time(0),
+                   m_is_blocked(false), m_is_err(false), m_is_shut(false),
+                   m_ev_write(nullptr), m_num_sent(0), m_pending_time(0) { }
+
+        ~uxpeer() {
+            fabs_mem::sub(MEM_BACKLOG, m_backlog,
+                          m_queue.get_len() + m_batch.size());
+        }
+
+        // queue an event if the backlog has room for it, and memory is
+        // not over the hard limit
+        bool push(ptr_out_event &ev) {
+            size_t len = ev->get_len();
+
+            if (fabs_mem::get_level() == fabs_mem::LEVEL_HARD)
+                return false;
+
+            if (m_backlog.fetch_add(len) + len <= m_backlog_max &&
+                m_queue.push(ev)) {
+                fabs_mem::add(MEM_BACKLOG, len);
+                return true;
+            }
+
+            m_backlog -= len;
+            return false;
+        }
     };
 
     enum match_dir {
@@ -142,13 +278,19 @@ private:
     };
 
     struct loopback_state {
+        ifformat format;  // of the rule when accepted
         bool is_header;
         fabs_appif_header header;
         fabs_id_dir id_dir;
         std::set<fabs_id> streams;
-
-        loopback_state() : is_header(true) {
-        }
+        std::vector<char> buf;  // received bytes are in [head, tail)
+        size_t head;
+        size_t tail;
+        ptr_fabs_bytes body;    // a large body being read directly
+        size_t body_pos;
+
+        loopback_state(ifformat fmt) : format(fmt), is_header(true), head(0),
+                                       tail(0), body_pos(0) { }
     };
 
     typedef std::unique_ptr<timeval> ptr_timeval;
@@ -173,6 +315,22 @@ private:
         fabs_appif_header m_header;
         ptr_timeval m_tm;
         CLOSED_REASON m_reason;
+        fabs_direction m_client_dir; // sender of the first SYN, if seen
+        std::string m_meta; // metadata by classifier
+        std::string m_prefix; // text header prefix, made at the first event
+        bool       m_is_classifying; // classify job is in flight
+        bool       m_is_closing;
+        bool       m_is_force; // classify ignoring the limits
+        uint64_t   m_job_seq;
+        timeval    m_last_time;
+        int        m_last_len1, m_last_len2; // of the last failed attempt
+        bool       m_last_both;
+        uint64_t   m_flow_id;
+        uint64_t   m_sent[2];    // payload sent for max_body_per_dir
+        int        m_group_fd;   // reader of a consumer group
+        int        m_group_idx;  // index of the reader in its route slot
+        uint64_t   m_group_peer; // ID of the reader
+        uint64_t   m_group_gen;  // generation of the group when assigned
 
         void clear_buf();
 
@@ -183,55 +341,196 @@ private:
     enum ifpcap_state {
         IFPCAP_GLOBAL,
         IFPCAP_HEADER,
-        IFPCAP_DATA,
     };
 
     struct ifpcap_info {
-        ifpcap_state               m_state;
-        std::deque<ptr_fabs_bytes> m_bytes;
-        uint32_t                   m_dlen;
-        timeval                    m_tm;
-        bool                       m_is_native;
-        bool                       m_is_fail;
-        char                       m_global_header[12];
-
-        ifpcap_info() : m_state(IFPCAP_GLOBAL), m_is_fail(false) { }
+        ifpcap_state      m_state;
+        std::vector<char> m_buf;  // received bytes are in [m_head, m_tail)
+        size_t            m_head;
+        size_t            m_tail;
+        bool              m_is_native;
+        bool              m_is_fail;
+        char              m_global_header[12];
+
+        ifpcap_info() : m_state(IFPCAP_GLOBAL), m_head(0), m_tail(0),
+                        m_is_fail(false) { }
     };
 
+    // classification limits of a priority are the largest of its rules
     struct ifrule_storage {
         std::list<ptr_ifrule> ifrule;
         std::list<ptr_ifrule> ifrule_no_regex;
+        std::list<ptr_ifrule> ifrule_classifier;
+        int max_bytes;
+        int max_time;
+
+        ifrule_storage() : max_bytes(-1), max_time(-1) { }
+    };
+
+    typedef std::shared_ptr<uxpeer>         ptr_uxpeer;
+
+    // readers of a path sharing flows by consistent hashing
+    struct group {
+        uint64_t m_gen; // incremented whenever a reader joins or leaves
+        std::map<int, uint64_t> m_member; // fd to ID of the reader
+        std::map<uint32_t, int> m_ring;   // hash ring of virtual nodes
+
+        group() : m_gen(0) { }
+
+        void add(int fd, uint64_t id);
+        void remove(int fd);
+        int  lookup(uint32_t hash) const;
+    };
+
+    // immutable snapshot of the readers of a rule, replaced whenever a
+    // reader joins or leaves, so that consumers route events without locks
+    // snapshots are reclaimed by m_rcu after consumers leave them
+    struct route_slot {
+        std::vector<ptr_uxpeer> m_owner; // keeps peers alive
+        std::vector<uxpeer*>    m_peer;
+        std::map<int, size_t>   m_fd2idx; // index in m_peer
+        group                   m_group;  // copy, if the rule is a group
+
+        // the reader of hash in the group, or -1
+        int lookup(uint32_t hash) const {
+            int fd = m_group.lookup(hash);
+            if (fd < 0)
+                return -1;
+
+            auto it = m_fd2idx.find(fd);
+            return it == m_fd2idx.end() ? -1 : it->second;
+        }
+    };
+
+    struct route {
+        std::vector<route_slot> m_slot; // indexed by balance
+    };
+
+    // readers of a flow, valid while the read section of m_rcu lasts
+    struct peer_list {
+        uxpeer *const *m_ptr;
+        size_t         m_num;
+
+        peer_list() : m_ptr(nullptr), m_num(0) { }
+        peer_list(uxpeer *const *ptr, size_t num) : m_ptr(ptr), m_num(num) { }
+
+        uxpeer *const *begin() const { return m_ptr; }
+        uxpeer *const *end() const { return m_ptr + m_num; }
+        bool empty() const { return m_num == 0; }
     };
 
-    typedef std::unique_ptr<uxpeer>         ptr_uxpeer;
     typedef std::unique_ptr<std::thread>    ptr_thread;
     typedef std::unique_ptr<loopback_state> ptr_loopback_state;
     typedef std::unique_ptr<stream_info>    ptr_info;
     typedef std::unique_ptr<ifrule_storage> ptr_ifrule_storage;
     typedef std::unique_ptr<ifpcap_info>    ptr_ifpcap_info;
 
+    // stored in the queues of consumers by value
     struct appif_event {
         fabs_stream_event st_event;
         fabs_id_dir       id_dir;
-        ptr_fabs_bytes    bytes;
+        timeval           tm;
+        ptr_fabs_bytes    bytes;   // nullptr if the event has no payload
+        bool              is_stat;
+        fabs_flow_stat    stat;    // of DESTROYED if is_stat
     };
 
     struct ifrule_storage2 {
         std::list<ptr_ifrule> ifrule;
         std::list<ptr_ifrule> ifrule_no_regex;
+        std::list<ptr_ifrule> ifrule_classifier;
+        int max_bytes;
+        int max_time;
         ptr_ifrule cache_up[256];
         ptr_ifrule cache_down[256];
+
+        ifrule_storage2() : max_bytes(-1), max_time(-1) { }
     };
 
     typedef std::unique_ptr<ifrule_storage2> ptr_ifrule_storage2;
 
+    // key of the server endpoint cache
+    // m_client is masked by the configured prefix length, or zero
+    struct ep_key {
+        fabs_peer m_server;
+        fabs_peer m_client;
+        uint8_t   m_l3_proto;
+
+        bool operator< (const ep_key &rhs) const {
+            if (m_l3_proto == rhs.m_l3_proto) {
+                if (m_server == rhs.m_server)
+                    return m_client < rhs.m_client;
+
+                return m_server < rhs.m_server;
+            }
+
+            return m_l3_proto < rhs.m_l3_proto;
+        }
+    };
+
+    struct ep_entry {
+        ep_key     m_key;
+        ptr_ifrule m_ifrule;
+        match_dir  m_server_match; // match direction of the server side
+        mutable time_t m_expire;
+
+        ep_entry(const ep_key &key, ptr_ifrule ifrule, match_dir server_match,
+                 time_t expire)
+            : m_key(key), m_ifrule(ifrule), m_server_match(server_match),
+              m_expire(expire) { }
+    };
+
+    // classification of the buffered prefix of a flow
+    // any consumer can run it, but only the owner applies the result
+    struct classify_job {
+        int             m_owner; // id of the consumer
+        fabs_id_dir     m_id_dir;
+        uint64_t        m_seq;
+        char            m_buf1[4096], m_buf2[4096];
+        int             m_len1, m_len2;
+        bool            m_is_both;  // both directions are available
+        bool            m_is_force; // ignore the limits
+        uint64_t        m_dsize;    // buffered bytes of the larger direction
+        time_t          m_elapsed;
+
+        // result
+        ptr_ifrule      m_ifrule;
+        match_dir       m_match_dir[2];
+        bool            m_is_ep; // insert into the endpoint cache
+        std::string     m_meta;
+
+        classify_job() : m_owner(-1), m_seq(0), m_len1(0), m_len2(0),
+                         m_is_both(false), m_is_force(false), m_dsize(0),
+                         m_elapsed(0), m_is_ep(false) {
+            m_match_dir[0] = MATCH_NONE;
+            m_match_dir[1] = MATCH_NONE;
+        }
+    };
+
+    // jobs of a consumer, the owner pops from the back and
+    // the others steal from the front
+    struct job_queue {
+        fabs_spin_lock            m_lock;
+        std::deque<classify_job*> m_jobs;
+    };
+
+    typedef std::unique_ptr<job_queue> ptr_job_queue;
+
+    typedef boost::multi_index::multi_index_container<
+        ep_entry,
+        boost::multi_index::indexed_by<
+            boost::multi_index::ordered_unique<
+                boost::multi_index::member<ep_entry, ep_key, &ep_entry::m_key> >,
+            boost::multi_index::sequenced<>
+            > > ep_cache;
+
 public:
     class appif_consumer {
     public:
         appif_consumer(int id, fabs_appif &appif);
         virtual ~appif_consumer();
 
-        void produce(appif_event *ev);
+        void produce(appif_event &ev);
         void consume(int id);
         void run();
         void stop() { m_is_break = true; }
@@ -242,36 +541,194 @@ public:
         bool m_is_consuming;
         fabs_appif &m_appif;
         std::map<fabs_id, ptr_info> m_info;
+
+        // UDP flows, which are only counted for the flows interface
+        // ordered by the last datagram, so idle ones are expired from the
+        // front
+        struct udp_flow {
+            fabs_id                m_id;
+            mutable uint64_t       m_flow_id;
+            mutable ptr_ifrule     m_ifrule; // of the first classified datagram
+            mutable time_t         m_time;   // the last datagram
+            mutable fabs_flow_stat m_stat;
+
+            udp_flow(const fabs_id &id)
+                : m_id(id), m_flow_id(0), m_time(0), m_stat() { }
+        };
+
+        typedef boost::multi_index::multi_index_container<
+            udp_flow,
+            boost::multi_index::indexed_by<
+                boost::multi_index::ordered_unique<
+                    boost::multi_index::member<udp_flow, fabs_id,
+                                               &udp_flow::m_id> >,
+                boost::multi_index::sequenced<>
+                > > udp_flows;
+
+        udp_flows m_udp_flow;
+        time_t m_udp_check;
         std::map<int, ptr_ifrule_storage2> m_ifrule_tcp;
         std::map<int, ptr_ifrule_storage2> m_ifrule_udp;
-        fabs_cb<appif_event*> m_ev_queue;
+
+        // copies of the rules of fabs_appif, replaced at the generation
+        uint64_t   m_rule_gen;
+        ptr_ifrule m_tcp_default;
+        ptr_ifrule m_udp_default;
+        ptr_ifrule m_ifflows;
+        int        m_classify_bytes_max;
+        int        m_classify_time_max;
+        bool       m_has_unidir;
+
+        fabs_cb<appif_event> m_ev_queue;
+        fabs_cb<classify_job*> m_done_queue; // jobs run by other consumers
+        uint64_t m_job_seq;
+        volatile uint64_t m_job_local;
+        volatile uint64_t m_job_stolen;
+
+        // server endpoint cache
+        ep_cache m_ep_cache;
+        volatile uint64_t m_ep_hit;
+        volatile uint64_t m_ep_miss;
+        volatile uint64_t m_ep_expire;
+        std::atomic<size_t> m_ep_len; // entries, read by print_stat
 
         // for threads
         std::mutex              m_mutex;
         std::condition_variable m_condition;
         std::thread             m_thread;
 
-        void in_stream_event(fabs_stream_event st_event,
-                             const fabs_id_dir &id_dir, ptr_fabs_bytes bytes);
+        void load_rules();
+        void in_stream_event(appif_event &ev);
         bool send_tcp_data(stream_info *p_info, fabs_id_dir id_dir);
+        bool get_peers(stream_info *p_info, peer_list &peers);
+        const route_slot *get_slot(const ifrule &rule, uint32_t hash);
+        bool flush_tcp_data(stream_info *p_info, const fabs_id_dir &id_dir,
+                            bool is_classified);
+        void classify_tcp(classify_job *job);
+        bool match_oneway(const ifrule &rule, classify_job *job);
+        bool apply_job(stream_info *p_info, classify_job *job);
+        void submit_job(classify_job *job);
+        void done_job(classify_job *job);
+        bool take_done_jobs();
+        bool run_jobs();
+        void wakeup();
+        bool classify_ep(stream_info *p_info, const fabs_id_dir &id_dir,
+                         const char *buf1, int len1,
+                         const char *buf2, int len2);
+        void insert_ep(stream_info *p_info, const fabs_id_dir &id_dir);
+        void get_ep_key(const fabs_id &id, fabs_direction server,
+                        ep_key &key);
         void in_datagram(const fabs_id_dir &id_dir, ptr_fabs_bytes bytes);
+        void send_flow(const fabs_id_dir &id_dir, uint64_t flow_id,
+                       const ptr_ifrule &ifrule, CLOSED_REASON reason,
+                       const fabs_flow_stat &stat);
+        void count_udp_flow(const fabs_id_dir &id_dir,
+                            const ptr_ifrule &ifrule, fabs_bytes &bytes);
+        void expire_udp_flow();
+        void pop_udp_flow();
+        void clear_udp_flow();
+
+        friend class fabs_appif;
+    };
+
+    // writes serialized events to the peers assigned to it so that
+    // consumer threads never block on the sockets
+    class appif_writer {
+    public:
+        appif_writer(int id, fabs_appif &appif);
+        virtual ~appif_writer();
 
+        void add_peer(ptr_uxpeer peer);
+        void notify();
+        void notify_idle();
+        void stop();
+
+    private:
+        int  m_id;
+        volatile bool     m_is_break;
+        std::atomic<bool> m_is_idle;
+        std::atomic<bool> m_is_flush_all; // consumers have become idle
+        fabs_appif &m_appif;
+        event_base *m_ev_base;
+        event      *m_ev_notify;
+        event      *m_ev_deadline; // the earliest deadline of batches
+        uint64_t    m_deadline;
+        volatile uint64_t m_num_writev;
+        volatile uint64_t m_num_event;
+        int         m_pipe[2];
+        fabs_spin_lock          m_lock; // for m_new_peer
+        std::vector<ptr_uxpeer> m_new_peer;
+        std::list<ptr_uxpeer>   m_peer;
+        std::thread m_thread;
+
+        void run(int id);
+        void flush();
+        bool flush_peer(uxpeer *peer, uint64_t now, bool is_all);
+        void write_batch(uxpeer *peer);
+        bool write_spill(uxpeer *peer);
+
+        friend void writer_notify(int fd, short events, void *arg);
+        friend void writer_writable(int fd, short events, void *arg);
+        friend void writer_deadline(int fd, short events, void *arg);
         friend class fabs_appif;
     };
+
+    // reads loopback7 and pcap connections, which are assigned to I/O
+    // threads round-robin, so that heavy input neither delays accepting
+    // analyzers nor is bound to a core
+    class appif_io {
+    public:
+        appif_io(int id, fabs_appif &appif);
+        virtual ~appif_io();
+
+        void add_conn(int fd, bool is_lb7, ifformat format);
+        void close_conns(bool is_lb7);
+        void stop();
+
+    private:
+        int  m_id;
+        volatile bool m_is_break;
+        fabs_appif &m_appif;
+        event_base *m_ev_base;
+        event      *m_ev_notify;
+        int         m_pipe[2];
+        // connections accepted by the listener thread
+        struct new_conn {
+            int      m_fd;
+            bool     m_is_lb7;
+            ifformat m_format;
+        };
+
+        fabs_spin_lock m_lock; // for m_new_conn and m_close_*
+        std::vector<new_conn> m_new_conn;
+        bool m_close_lb7;  // close loopback7 connections
+        bool m_close_pcap; // close pcap connections
+        std::map<int, event*>             m_ev;
+        std::map<int, ptr_loopback_state> m_lb7_state;
+        std::map<int, ptr_ifpcap_info>    m_ifpcap_info;
+        std::thread m_thread;
+
+        void run(int id);
+        void close_conn(int fd);
+
+        friend void io_notify(int fd, short events, void *arg);
+        friend void ux_read_loopback7(int fd, short events, void *arg);
+        friend void ux_read_pcap(int fd, short events, void *arg);
+        friend void ux_accept(int fd, short events, void *arg);
+    };
 private:
 
     std::mutex m_mutex_init;
     std::condition_variable m_condition_init;
 
     typedef std::unique_ptr<appif_consumer> ptr_consumer;
+    typedef std::unique_ptr<appif_writer>   ptr_writer;
+    typedef std::unique_ptr<appif_io>       ptr_io;
 
     int m_fd7;
     int m_fd3;
 
-    std::map<int, ptr_loopback_state> m_lb7_state;
-    ifformat m_lb7_format;
-
-    std::map<int, ptr_ifpcap_info> m_ifpcap_info;
+    std::string m_conf_path;
 
     std::map<int, ptr_ifrule_storage> m_ifrule_tcp;
     std::map<int, ptr_ifrule_storage> m_ifrule_udp;
@@ -279,35 +736,107 @@ private:
     ptr_ifrule m_tcp_default;
     ptr_ifrule m_udp_default;
     ptr_ifrule m_ifpcap;
+    ptr_ifrule m_ifflows; // summary of every flow
+    std::vector<ptr_ifrule> m_ifcapture; // rules writing pcap files
+    std::atomic<uint64_t> m_rule_gen; // incremented whenever rules are reloaded
+    std::list<std::weak_ptr<ifrule>> m_routed; // rules having routes,
+                                               // including replaced ones
+    time_t     m_udp_timeout;
+    size_t     m_udp_flow_size; // max UDP flows per consumer, 0: no limit
     std::map<int, ptr_ifrule> m_fd2ifrule; // listen socket
     std::map<int, ptr_uxpeer> m_fd2uxpeer; // accepted socket
     std::map<std::string, std::set<int> > m_name2uxpeer;
 
-    fabs_spin_rwlock m_rw_mutex;
+    std::map<std::string, group> m_name2group;
+    uint64_t m_peer_id;
+    std::atomic<uint64_t> m_flow_id; // the last ID of flows
+
+    fabs_spin_rwlock m_rw_mutex; // for m_fd2uxpeer, m_name2uxpeer, groups
+                                 // and rules
+    std::unique_ptr<fabs_rcu> m_rcu; // for routes, a slot per consumer
 
     int m_num_tcp_threads;
     int m_num_consumer;
+    bool m_is_classify_pool;
+    std::atomic<int> m_num_job; // queued classify jobs
+    std::vector<ptr_job_queue> m_job_queue; // indexed by consumer
+    int m_num_writer;
+    int m_writer_rr;
+    int m_num_io;
+    int m_io_rr;
+    size_t m_flush_bytes; // batched output is written at this size
+    size_t m_backlog_bytes;
+    ifoverflow m_overflow;
+    std::vector<ptr_writer>   m_writer;   // destroyed after consumers
     std::vector<ptr_consumer> m_consumer;
+    std::vector<ptr_io>       m_io;       // destroyed before consumers
 
     ptr_thread  m_thread_listen;
 
     event_base *m_ev_base;
+    event      *m_ev_reload; // SIGHUP
     ptr_path    m_home;
 
     bool        m_is_lru;
     bool        m_is_cache;
 
+    // server endpoint cache
+    bool        m_is_ep_cache;
+    bool        m_is_ep_validate;
+    time_t      m_ep_ttl;
+    size_t      m_ep_size;
+    int         m_ep_prefix4;
+    int         m_ep_prefix6;
+
     int         m_tcp_timeout;
 
+    // classification limits
+    int         m_classify_bytes;
+    int         m_classify_time;
+    bool        m_is_unidir;
+    int         m_classify_bytes_max;
+    int         m_classify_time_max;
+    bool        m_has_unidir; // any TCP rule is unidirectional
+
     fabs_ether &m_ether;
 
-    void makedir(boost::filesystem::path path);
-    bool write_event(int fd, const fabs_id_dir &id_dir, ptr_ifrule ifrule,
-                     fabs_stream_event event, match_dir match, CLOSED_REASON reason,
-                     fabs_appif_header *header, char *body, int bodylen,
-                     timeval *tm);
+    typedef std::vector<std::pair<std::string, std::string>> renames_t;
+
+    bool makedir(boost::filesystem::path path);
+    ptr_ifrule read_ifrule(const std::string &name,
+                           const std::map<std::string, std::string> &conf);
+    void add_ifrule(ptr_ifrule rule);
+    void get_ifrules(std::vector<ptr_ifrule> &rules);
+    bool is_same_if(const ifrule &lhs, const ifrule &rhs);
+    void take_over_ifrule(ptr_ifrule old, ptr_ifrule rule);
+    void disconnect_ifrule(ptr_ifrule rule);
+    void set_classify_limit();
+    ptr_out_event make_event(const fabs_id_dir &id_dir, ptr_ifrule ifrule,
+                             fabs_stream_event event, match_dir match,
+                             CLOSED_REASON reason, fabs_appif_header *header,
+                             const sptr_fabs_bytes &body, const timeval *tm,
+                             std::string *prefix,
+                             const std::string *meta = nullptr,
+                             uint64_t flow_id = 0, uint64_t dsize1 = 0,
+                             uint64_t dsize2 = 0,
+                             const fabs_flow_stat *stat = nullptr);
+    ptr_out_event make_flow_event(const ifrule &flows,
+                                  const fabs_id_dir &id_dir, uint64_t flow_id,
+                                  const ptr_ifrule &ifrule,
+                                  CLOSED_REASON reason,
+                                  const fabs_flow_stat &stat);
+    bool write_event(uxpeer *peer, const ptr_out_event &ev);
+    void update_route(ifrule &rule);
+    void update_routes(const std::string &path);
+    bool push_event(uxpeer *peer, ptr_out_event ev);
+    bool spill_event(uxpeer *peer, ptr_out_event &ev);
+    void disconnect_slow(uxpeer *peer);
     void ux_listen();
-    void ux_listen_ifrule(ptr_ifrule ifrule);
+    bool prepare_ifrule(ptr_ifrule ifrule);
+    bool ux_listen_ifrule(ptr_ifrule ifrule, renames_t *renames);
+    bool tcp_listen_ifrule(ptr_ifrule ifrule, int idx, const std::string &path);
+    void register_ifrule(ptr_ifrule ifrule);
+    void close_listen(ifrule &rule, bool is_unlink);
     bool is_in_port(const std::list<std::pair<uint16_t, uint16_t>> &range,
                     uint16_t port1, uint16_t port2);
 
@@ -315,8 +844,13 @@ private:
     friend void ux_read(int fd, short events, void *arg);
     friend void ux_read_loopback7(int fd, short events, void *arg);
     friend void ux_read_pcap(int fd, short events, void *arg);
+    friend void io_notify(int fd, short events, void *arg);
     friend void ux_close(int fd, fabs_appif *appif);
-    friend bool read_loopback7(int fd, fabs_appif *appif);
+    friend void ux_reload(int fd, short events, void *arg);
+    friend bool read_loopback7(int fd, fabs_appif *appif,
+                               loopback_state &state);
+    friend bool input_loopback7(int fd, fabs_appif *appif,
+                                loopback_state &state);
 //    friend bool read_loopback3(int fd, fabs_appif *appif);
 };
 
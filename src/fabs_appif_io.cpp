@@ -0,0 +1,253 @@
+#include "fabs_appif.hpp"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <sys/socket.h>
+
+#include <iostream>
+#include <sstream>
+#include <functional>
+
+void io_notify(int fd, short events, void *arg);
+void ux_read_loopback7(int fd, short events, void *arg);
+void ux_read_pcap(int fd, short events, void *arg);
+
+fabs_appif::appif_io::appif_io(int id, fabs_appif &appif) :
+    m_id(id),
+    m_is_break(false),
+    m_appif(appif),
+    m_close_lb7(false),
+    m_close_pcap(false)
+{
+    m_ev_base = event_base_new();
+    if (m_ev_base == NULL) {
+        std::cerr << "could not new ev_base" << std::endl;
+        exit(-1);
+    }
+
+    if (pipe(m_pipe) < 0) {
+        perror("pipe");
+        exit(-1);
+    }
+
+    fcntl(m_pipe[0], F_SETFL, fcntl(m_pipe[0], F_GETFL) | O_NONBLOCK);
+    fcntl(m_pipe[1], F_SETFL, fcntl(m_pipe[1], F_GETFL) | O_NONBLOCK);
+
+    m_ev_notify = event_new(m_ev_base, m_pipe[0], EV_READ | EV_PERSIST,
+                            io_notify, this);
+    event_add(m_ev_notify, NULL);
+
+    m_thread = std::thread(std::bind(&fabs_appif::appif_io::run, this, id));
+}
+
+fabs_appif::appif_io::~appif_io()
+{
+    stop();
+
+    m_thread.join();
+
+    while (! m_ev.empty()) {
+        close_conn(m_ev.begin()->first);
+    }
+
+    for (auto &conn: m_new_conn) {
+        close(conn.m_fd);
+    }
+
+    event_free(m_ev_notify);
+    event_base_free(m_ev_base);
+
+    close(m_pipe[0]);
+    close(m_pipe[1]);
+}
+
+void
+fabs_appif::appif_io::run(int id)
+{
+    std::ostringstream os;
+    os << "SF-TAP io[" << id << "]";
+    SET_THREAD_NAME(pthread_self(), os.str().c_str());
+    fabs_mem::set_thread_name(os.str());
+
+    event_base_dispatch(m_ev_base);
+}
+
+void
+fabs_appif::appif_io::stop()
+{
+    char c = 0;
+
+    m_is_break = true;
+
+    if (write(m_pipe[1], &c, 1) < 0) {
+        // already notified
+    }
+}
+
+// called by the listener thread after accepting a connection
+// loopback7 headers are read in format
+void
+fabs_appif::appif_io::add_conn(int fd, bool is_lb7, ifformat format)
+{
+    {
+        fabs_spin_lock_ac lock(m_lock);
+
+        new_conn conn;
+
+        conn.m_fd     = fd;
+        conn.m_is_lb7 = is_lb7;
+        conn.m_format = format;
+
+        m_new_conn.push_back(conn);
+    }
+
+    char c = 0;
+
+    if (write(m_pipe[1], &c, 1) < 0) {
+        // already notified
+    }
+}
+
+// called by the listener thread after removing the loopback7 or pcap rule
+// connections accepted before are closed, including those not added yet
+void
+fabs_appif::appif_io::close_conns(bool is_lb7)
+{
+    {
+        fabs_spin_lock_ac lock(m_lock);
+
+        for (auto it = m_new_conn.begin(); it != m_new_conn.end(); ) {
+            if (it->m_is_lb7 == is_lb7) {
+                close(it->m_fd);
+                it = m_new_conn.erase(it);
+            } else {
+                ++it;
+            }
+        }
+
+        if (is_lb7)
+            m_close_lb7 = true;
+        else
+            m_close_pcap = true;
+    }
+
+    char c = 0;
+
+    if (write(m_pipe[1], &c, 1) < 0) {
+        // already notified
+    }
+}
+
+void
+fabs_appif::appif_io::close_conn(int fd)
+{
+    auto it1 = m_ev.find(fd);
+    if (it1 != m_ev.end()) {
+        event_del(it1->second);
+        event_free(it1->second);
+        m_ev.erase(it1);
+    }
+
+    shutdown(fd, SHUT_RDWR);
+    close(fd);
+
+    auto it2 = m_lb7_state.find(fd);
+    if (it2 != m_lb7_state.end()) {
+        fabs_id_dir id_dir;
+        timeval     tm;
+
+        gettimeofday(&tm, nullptr);
+
+        // streams left open by the connection
+        for (auto &id: it2->second->streams) {
+            id_dir.m_id  = id;
+            id_dir.m_dir = FROM_NONE;
+
+            m_appif.in_event(STREAM_DESTROYED, id_dir, tm);
+        }
+
+        m_lb7_state.erase(it2);
+
+        std::cout << "closed on loopback7 (fd = " << fd << ")" << std::endl;
+    }
+
+    auto it3 = m_ifpcap_info.find(fd);
+    if (it3 != m_ifpcap_info.end()) {
+        m_ifpcap_info.erase(it3);
+
+        std::cout << "closed on pcap (fd = " << fd << ")" << std::endl;
+    }
+}
+
+void
+io_notify(int fd, short events, void *arg)
+{
+    auto io = static_cast<fabs_appif::appif_io*>(arg);
+    char buf[256];
+
+    while (read(fd, buf, sizeof(buf)) > 0);
+
+    if (io->m_is_break) {
+        event_base_loopbreak(io->m_ev_base);
+        return;
+    }
+
+    std::vector<fabs_appif::appif_io::new_conn> conns;
+    bool close_lb7, close_pcap;
+
+    {
+        fabs_spin_lock_ac lock(io->m_lock);
+        conns.swap(io->m_new_conn);
+
+        close_lb7  = io->m_close_lb7;
+        close_pcap = io->m_close_pcap;
+
+        io->m_close_lb7  = false;
+        io->m_close_pcap = false;
+    }
+
+    // connections to be closed were accepted before those in conns
+    std::vector<int> fds;
+
+    if (close_lb7) {
+        for (auto &it: io->m_lb7_state) {
+            fds.push_back(it.first);
+        }
+    }
+
+    if (close_pcap) {
+        for (auto &it: io->m_ifpcap_info) {
+            fds.push_back(it.first);
+        }
+    }
+
+    for (auto fd: fds) {
+        io->close_conn(fd);
+    }
+
+    for (auto &conn: conns) {
+        int    sock = conn.m_fd;
+        event *ev;
+
+        if (conn.m_is_lb7) {
+            auto ptr = fabs_appif::ptr_loopback_state(
+                new fabs_appif::loopback_state(conn.m_format));
+            io->m_lb7_state[sock] = std::move(ptr);
+            ev = event_new(io->m_ev_base, sock, EV_READ | EV_PERSIST,
+                           ux_read_loopback7, io);
+
+            // read until EAGAIN
+            fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+        } else {
+            auto ptr = fabs_appif::ptr_ifpcap_info(new fabs_appif::ifpcap_info);
+            io->m_ifpcap_info[sock] = std::move(ptr);
+            ev = event_new(io->m_ev_base, sock, EV_READ | EV_PERSIST,
+                           ux_read_pcap, io);
+        }
+
+        io->m_ev[sock] = ev;
+        event_add(ev, NULL);
+    }
+}
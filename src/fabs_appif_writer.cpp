@@ -0,0 +1,519 @@
+#include "fabs_appif.hpp"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include <iostream>
+#include <sstream>
+#include <functional>
+#include <chrono>
+
+#ifndef IOV_MAX
+    #define IOV_MAX 1024
+#endif
+
+#define WRITER_IOV (IOV_MAX < 1024 ? IOV_MAX : 1024)
+
+void writer_notify(int fd, short events, void *arg);
+void writer_writable(int fd, short events, void *arg);
+void writer_deadline(int fd, short events, void *arg);
+
+static inline uint64_t
+get_msec()
+{
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+fabs_appif::appif_writer::appif_writer(int id, fabs_appif &appif) :
+    m_id(id),
+    m_is_break(false),
+    m_is_idle(true),
+    m_is_flush_all(false),
+    m_appif(appif),
+    m_deadline(0),
+    m_num_writev(0),
+    m_num_event(0)
+{
+    m_ev_base = event_base_new();
+    if (m_ev_base == NULL) {
+        std::cerr << "could not new ev_base" << std::endl;
+        exit(-1);
+    }
+
+    if (pipe(m_pipe) < 0) {
+        perror("pipe");
+        exit(-1);
+    }
+
+    fcntl(m_pipe[0], F_SETFL, fcntl(m_pipe[0], F_GETFL) | O_NONBLOCK);
+    fcntl(m_pipe[1], F_SETFL, fcntl(m_pipe[1], F_GETFL) | O_NONBLOCK);
+
+    m_ev_notify = event_new(m_ev_base, m_pipe[0], EV_READ | EV_PERSIST,
+                            writer_notify, this);
+    event_add(m_ev_notify, NULL);
+
+    m_ev_deadline = evtimer_new(m_ev_base, writer_deadline, this);
+
+    m_thread = std::thread(std::bind(&fabs_appif::appif_writer::run, this, id));
+}
+
+fabs_appif::appif_writer::~appif_writer()
+{
+    stop();
+
+    m_thread.join();
+
+    for (auto &peer: m_peer) {
+        event_free(peer->m_ev_write);
+    }
+
+    event_free(m_ev_notify);
+    event_free(m_ev_deadline);
+    event_base_free(m_ev_base);
+
+    close(m_pipe[0]);
+    close(m_pipe[1]);
+}
+
+void
+fabs_appif::appif_writer::run(int id)
+{
+    std::ostringstream os;
+    os << "SF-TAP wrt[" << id << "]";
+    SET_THREAD_NAME(pthread_self(), os.str().c_str());
+    fabs_mem::set_thread_name(os.str());
+
+    event_base_dispatch(m_ev_base);
+}
+
+void
+fabs_appif::appif_writer::stop()
+{
+    char c = 0;
+
+    m_is_break = true;
+
+    if (write(m_pipe[1], &c, 1) < 0) {
+        // already notified
+    }
+}
+
+void
+fabs_appif::appif_writer::add_peer(ptr_uxpeer peer)
+{
+    {
+        fabs_spin_lock_ac lock(m_lock);
+        m_new_peer.push_back(peer);
+    }
+
+    notify();
+}
+
+// called by consumers after queueing events
+// the pipe is written only when the writer is idle
+void
+fabs_appif::appif_writer::notify()
+{
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+
+    if (m_is_idle.load(std::memory_order_relaxed) && m_is_idle.exchange(false)) {
+        char c = 0;
+
+        if (write(m_pipe[1], &c, 1) < 0) {
+            // already notified
+        }
+    }
+}
+
+// called by consumers before sleeping, so batches need not wait for
+// their deadlines
+void
+fabs_appif::appif_writer::notify_idle()
+{
+    if (! m_is_flush_all.exchange(true))
+        notify();
+}
+
+void
+writer_notify(int fd, short events, void *arg)
+{
+    auto writer = static_cast<fabs_appif::appif_writer*>(arg);
+    char buf[256];
+
+    while (read(fd, buf, sizeof(buf)) > 0);
+
+    if (writer->m_is_break) {
+        event_base_loopbreak(writer->m_ev_base);
+        return;
+    }
+
+    writer->flush();
+}
+
+// the socket of a blocked peer has become writable, or the reader has
+// consumed the shared memory ring
+void
+writer_writable(int fd, short events, void *arg)
+{
+    auto writer = static_cast<fabs_appif::appif_writer*>(arg);
+
+    for (auto &peer: writer->m_peer) {
+        if (peer->m_shm && peer->m_shm->get_space_fd() == fd) {
+            peer->m_shm->clear_space();
+            peer->m_is_blocked = false;
+        } else if (! peer->m_shm && peer->m_fd == fd) {
+            peer->m_is_blocked = false;
+        }
+    }
+
+    writer->flush();
+}
+
+void
+writer_deadline(int fd, short events, void *arg)
+{
+    auto writer = static_cast<fabs_appif::appif_writer*>(arg);
+
+    writer->m_deadline = 0;
+    writer->flush();
+}
+
+void
+fabs_appif::appif_writer::flush()
+{
+    uint64_t deadline;
+
+    for (;;) {
+        {
+            fabs_spin_lock_ac lock(m_lock);
+
+            for (auto &peer: m_new_peer) {
+                if (peer->m_shm) {
+                    peer->m_ev_write = event_new(m_ev_base,
+                                                 peer->m_shm->get_space_fd(),
+                                                 EV_READ, writer_writable, this);
+                } else {
+                    peer->m_ev_write = event_new(m_ev_base, peer->m_fd, EV_WRITE,
+                                                 writer_writable, this);
+                }
+                m_peer.push_back(std::move(peer));
+            }
+
+            m_new_peer.clear();
+        }
+
+        bool     is_remain = false;
+        bool     is_all    = m_is_flush_all.exchange(false);
+        uint64_t now       = get_msec();
+
+        deadline = 0;
+
+        for (auto it = m_peer.begin(); it != m_peer.end(); ) {
+            auto peer = it->get();
+
+            if (peer->m_is_closed) {
+                ptr_out_event ev;
+                while (peer->m_queue.pop(&ev)) {
+                    peer->m_backlog -= ev->get_len();
+                    fabs_mem::sub(MEM_BACKLOG, ev->get_len());
+                }
+
+                event_free(peer->m_ev_write);
+                close(peer->m_fd);
+                it = m_peer.erase(it);
+                continue;
+            }
+
+            // the fd is valid until this thread closes it above
+            if (peer->m_is_slow && ! peer->m_is_shut) {
+                shutdown(peer->m_fd, SHUT_RDWR);
+                peer->m_is_shut = true;
+            }
+
+            if (! peer->m_is_blocked && ! flush_peer(peer, now, is_all))
+                is_remain = true;
+
+            if (peer->m_batch.empty()) {
+                peer->m_pending_time = 0;
+            } else {
+                uint64_t t = peer->m_batch_time + peer->m_ifrule->m_flush_latency;
+
+                if (! peer->m_is_blocked && (deadline == 0 || t < deadline))
+                    deadline = t;
+
+                peer->m_pending_time = peer->m_batch_time;
+            }
+
+            ++it;
+        }
+
+        if (is_remain)
+            continue;
+
+        m_is_idle = true;
+
+        // check again not to miss events queued before m_is_idle was set
+        for (auto &peer: m_peer) {
+            if (peer->m_is_closed || (peer->m_is_slow && ! peer->m_is_shut) ||
+                (! peer->m_is_blocked &&
+                 (peer->m_queue.get_len() > 0 ||
+                  (peer->m_spill && peer->m_spill->get_bytes() > 0)))) {
+                is_remain = true;
+                break;
+            }
+        }
+
+        if (! is_remain) {
+            fabs_spin_lock_ac lock(m_lock);
+            is_remain = ! m_new_peer.empty();
+        }
+
+        if (! is_remain || ! m_is_idle.exchange(false))
+            break;
+    }
+
+    // wake up at the earliest deadline of waiting batches
+    if (deadline != 0 && (m_deadline == 0 || deadline < m_deadline)) {
+        uint64_t now = get_msec();
+        uint64_t ms  = deadline > now ? deadline - now : 0;
+        timeval  tv;
+
+        tv.tv_sec  = ms / 1000;
+        tv.tv_usec = (ms % 1000) * 1000;
+
+        m_deadline = deadline;
+        evtimer_add(m_ev_deadline, &tv);
+    }
+}
+
+// move queued events of a peer to its batch, and write the batch if
+// it is large or old enough
+// return false if events still remain in the queue
+bool
+fabs_appif::appif_writer::flush_peer(uxpeer *peer, uint64_t now, bool is_all)
+{
+    size_t max_bytes = m_appif.m_flush_bytes;
+    int    latency   = peer->m_ifrule->m_flush_latency;
+
+    for (;;) {
+        ptr_out_event ev;
+
+        if (peer->m_num_event_buf > 0) {
+            // control events overflowed are queued again as the backlog
+            // shrinks
+            fabs_spin_lock_ac lock(peer->m_lock);
+
+            auto &ebuf = peer->m_event_buf;
+
+            while (! ebuf.empty() && peer->push(ebuf.front())) {
+                ebuf.pop_front();
+            }
+
+            peer->m_num_event_buf = ebuf.size();
+        }
+
+        while (peer->m_batch_bytes < max_bytes &&
+               (int)peer->m_batch.size() < WRITER_IOV / 2 &&
+               peer->m_queue.pop(&ev)) {
+            if (peer->m_batch.empty())
+                peer->m_batch_time = now;
+
+            peer->m_batch_bytes += ev->get_len();
+            peer->m_batch.push_back(std::move(ev));
+        }
+
+        if (peer->m_batch.empty()) {
+            // events spilled are replayed after the backlog is written
+            if (peer->m_spill)
+                return write_spill(peer);
+
+            return true;
+        }
+
+        bool is_full = peer->m_batch_bytes >= max_bytes ||
+                       (int)peer->m_batch.size() >= WRITER_IOV / 2;
+
+        if (! is_full && ! is_all && latency > 0 &&
+            now < peer->m_batch_time + latency) {
+            // wait for more events until the deadline
+            return true;
+        }
+
+        write_batch(peer);
+
+        if (peer->m_is_blocked)
+            return true;
+
+        if (! is_full)
+            return peer->m_queue.get_len() == 0 &&
+                peer->m_num_event_buf == 0;
+    }
+}
+
+// write the batch of a peer by writev
+void
+fabs_appif::appif_writer::write_batch(uxpeer *peer)
+{
+    auto &batch = peer->m_batch;
+
+    while (! batch.empty()) {
+        iovec iov[WRITER_IOV];
+        int   n   = 0;
+        size_t pos = peer->m_batch_pos;
+
+        if (peer->m_is_err) {
+            // the listener thread will close the socket
+            for (auto &ev: batch) {
+                peer->m_backlog -= ev->get_len();
+                fabs_mem::sub(MEM_BACKLOG, ev->get_len());
+            }
+
+            batch.clear();
+            break;
+        }
+
+        for (auto &ev: batch) {
+            size_t hlen = ev->m_header.size();
+            size_t blen = ev->m_body ? ev->m_body->get_len() : 0;
+
+            if (n + 2 > WRITER_IOV)
+                break;
+
+            if (pos < hlen) {
+                iov[n].iov_base = &ev->m_header[pos];
+                iov[n].iov_len  = hlen - pos;
+                n++;
+                pos = 0;
+            } else {
+                pos -= hlen;
+            }
+
+            if (blen > 0) {
+                iov[n].iov_base = ev->m_body->get_head() + pos;
+                iov[n].iov_len  = blen - pos;
+                n++;
+            }
+
+            pos = 0;
+        }
+
+        ssize_t len;
+
+        if (peer->m_shm)
+            len = peer->m_shm->writev(iov, n);
+        else
+            len = writev(peer->m_fd, iov, n);
+
+        if (len < 0) {
+            if (errno == EINTR) {
+                continue;
+            } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                if (peer->m_shm && ! peer->m_shm->wait_space())
+                    continue;
+
+                // the batch is kept until the socket becomes writable,
+                // and consumers bound the backlog meanwhile
+                peer->m_is_blocked = true;
+                event_add(peer->m_ev_write, nullptr);
+                return;
+            }
+
+            peer->m_is_err = true;
+            continue;
+        }
+
+        m_num_writev++;
+
+        // remove written events
+        size_t written = len;
+
+        while (written > 0) {
+            size_t all  = batch.front()->get_len();
+            size_t rest = all - peer->m_batch_pos;
+
+            if (written < rest) {
+                peer->m_batch_pos += written;
+                peer->m_batch_bytes -= written;
+                break;
+            }
+
+            written -= rest;
+            peer->m_batch_bytes -= rest;
+            peer->m_batch_pos = 0;
+            peer->m_backlog  -= all;
+            fabs_mem::sub(MEM_BACKLOG, all);
+            peer->m_num_sent++;
+            batch.pop_front();
+            m_num_event++;
+        }
+    }
+
+    peer->m_batch_bytes = 0;
+    peer->m_batch_pos   = 0;
+}
+
+// replay events spilled to the disk
+// return false if events still remain in the spill
+bool
+fabs_appif::appif_writer::write_spill(uxpeer *peer)
+{
+    auto &spill = peer->m_spill;
+
+    // not to starve other peers
+    for (int i = 0; i < WRITER_IOV; i++) {
+        const char *buf;
+        size_t      len;
+
+        if (! spill->peek(&buf, &len))
+            return true;
+
+        if (peer->m_is_err) {
+            // the listener thread will close the socket
+            spill->consume(len);
+            continue;
+        }
+
+        if (len > m_appif.m_flush_bytes)
+            len = m_appif.m_flush_bytes;
+
+        ssize_t n;
+
+        if (peer->m_shm) {
+            iovec iov;
+
+            iov.iov_base = (void*)buf;
+            iov.iov_len  = len;
+
+            n = peer->m_shm->writev(&iov, 1);
+        } else {
+            n = write(peer->m_fd, buf, len);
+        }
+
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                if (peer->m_shm && ! peer->m_shm->wait_space())
+                    continue;
+
+                peer->m_is_blocked = true;
+                event_add(peer->m_ev_write, nullptr);
+                return true;
+            }
+
+            peer->m_is_err = true;
+            continue;
+        }
+
+        m_num_writev++;
+        spill->consume(n);
+    }
+
+    return false;
+}
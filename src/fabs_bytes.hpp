@@ -2,6 +2,8 @@
 #define FABS_BYTES_HPP
 
 #include "fabs_common.hpp"
+#include "fabs_pool.hpp"
+#include "fabs_mem.hpp"
 
 #include <sys/time.h>
 
@@ -15,21 +17,38 @@
 
 class fabs_bytes;
 typedef std::unique_ptr<fabs_bytes> ptr_fabs_bytes;
+typedef std::shared_ptr<fabs_bytes> sptr_fabs_bytes;
 
 class fabs_bytes {
 public:
-    fabs_bytes() : m_ptr(nullptr), m_pos(0), m_len(0) { }
-    fabs_bytes(const char *str) { *this = str; }
+    fabs_bytes() : m_ptr(nullptr), m_pos(0), m_len(0), m_mem(MEM_NONE) { }
+    fabs_bytes(const char *str) : m_mem(MEM_NONE) { *this = str; }
 
-    virtual ~fabs_bytes() { delete[] m_ptr; }
+    virtual ~fabs_bytes() {
+        uncharge();
+        fabs_pool::free(m_ptr);
+    }
+
+    // objects and buffers are taken from the packet buffer pool
+    static void *operator new(size_t size) {
+        void *p = fabs_pool::alloc(size);
+        if (p == nullptr)
+            throw std::bad_alloc();
+
+        return p;
+    }
+
+    static void operator delete(void *p) {
+        fabs_pool::free(p);
+    }
 
     fabs_bytes & operator = (const char *str) {
         int len = strlen(str);
-        try {
-            m_ptr = new char[len];
-        } catch (std::bad_alloc e) {
+
+        m_ptr = (char*)fabs_pool::alloc(len);
+        if (m_ptr == nullptr) {
             std::cerr << __FILE__ << ":" << __LINE__ << ":" << ":"
-                      <<__func__ << ": " << e.what() << std::endl;
+                      <<__func__ << ": out of memory" << std::endl;
             m_len = 0;
             m_pos = 0;
             return *this;
@@ -101,31 +120,25 @@ public:
     }
 
     void alloc(size_t len) {
-        try {
-            m_ptr = new char[len];
-        } catch (std::bad_alloc e) {
+        m_ptr = (char*)fabs_pool::alloc(len);
+        if (m_ptr == nullptr) {
             std::cerr << __FILE__ << ":" << __LINE__ << ":" << ":"
-                      <<__func__ << ": " << e.what() << ", len = " << len
+                      <<__func__ << ": out of memory, len = " << len
                       << std::endl;
             m_len = 0;
             m_pos = 0;
             return;
         }
 
-        if (m_ptr == nullptr) {
-            PERROR();
-            exit(-1);
-        }
-
         m_len = len;
     }
 
     void set_buf(const char *buf, int len) {
-        try {
-            delete[] m_ptr;
-            m_ptr = new char[len];
-        } catch (std::bad_alloc e) {
-            std::cerr << __func__ << e.what() << std::endl;
+        fabs_pool::free(m_ptr);
+
+        m_ptr = (char*)fabs_pool::alloc(len);
+        if (m_ptr == nullptr) {
+            std::cerr << __func__ << ": out of memory" << std::endl;
             m_len = 0;
             m_pos = 0;
             return;
@@ -138,12 +151,29 @@ public:
     }
 
     void clear() {
-        delete[] m_ptr;
+        fabs_pool::free(m_ptr);
         m_ptr = nullptr;
         m_pos = 0;
         m_len = 0;
     }
 
+    // account the buffer to a subsystem while it is buffered there
+    void charge(fabs_mem_kind kind) {
+        uncharge();
+
+        m_mem     = kind;
+        m_mem_len = m_pos + m_len;
+        fabs_mem::add(kind, m_mem_len);
+    }
+
+    void uncharge() {
+        if (m_mem == MEM_NONE)
+            return;
+
+        fabs_mem::sub(m_mem, m_mem_len);
+        m_mem = MEM_NONE;
+    }
+
     char* get_head() {
         return m_ptr + m_pos;
     }
@@ -152,6 +182,15 @@ public:
         return m_len;
     }
 
+    // the buffer including skipped bytes, e.g. the frame of a payload
+    char* get_base() {
+        return m_ptr;
+    }
+
+    int get_base_len() {
+        return m_pos + m_len;
+    }
+
     bool skip_tail(int len) {
         m_len -= len;
 
@@ -177,6 +216,8 @@ private:
     char *m_ptr;
     int   m_pos;
     int   m_len;
+    fabs_mem_kind m_mem;
+    int   m_mem_len;
 
     fabs_bytes(const fabs_bytes &rhs) { }
     fabs_bytes & operator = (const fabs_bytes &rhs) { return *this; }
@@ -0,0 +1,362 @@
+#include "fabs_capture.hpp"
+#include "fabs_appif.hpp"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <pcap.h>
+
+#include <algorithm>
+#include <iostream>
+#include <sstream>
+#include <functional>
+
+#define CAPTURE_WRITE_BYTES (1024 * 1024)      // wake up the I/O thread
+#define CAPTURE_BUF_BYTES   (64 * 1024 * 1024) // frames are dropped over this
+#define CAPTURE_SNAPLEN     65535
+
+fabs_capture::fabs_capture(const std::string &dir, const std::string &name,
+                           uint64_t max_file_bytes, time_t max_file_time) :
+    m_dir(dir),
+    m_name(name),
+    m_max_file_bytes(max_file_bytes),
+    m_max_file_time(max_file_time),
+    m_fd(-1),
+    m_file_bytes(0),
+    m_file_time(0),
+    m_file_seq(0),
+    m_num_packets(0),
+    m_num_bytes(0),
+    m_num_drop(0),
+    m_num_file(0),
+    m_is_break(false)
+{
+    m_data.reserve(CAPTURE_WRITE_BYTES * 2);
+
+    m_thread = std::thread(std::bind(&fabs_capture::run, this));
+}
+
+fabs_capture::~fabs_capture()
+{
+    m_is_break = true;
+    m_condition.notify_one();
+
+    m_thread.join();
+}
+
+void
+fabs_capture::write(const std::string &desc, fabs_bytes &bytes)
+{
+    int len = bytes.get_base_len();
+
+    if (len <= 0)
+        return;
+
+    if (len > CAPTURE_SNAPLEN)
+        len = CAPTURE_SNAPLEN;
+
+    pcaprec_hdr_t hdr;
+
+    hdr.ts_sec   = bytes.m_tm.tv_sec;
+    hdr.ts_usec  = bytes.m_tm.tv_usec;
+    hdr.incl_len = len;
+    hdr.orig_len = bytes.get_base_len();
+
+    record rec;
+    bool   is_notify;
+
+    {
+        fabs_spin_lock_ac lock(m_lock);
+
+        if (m_data.size() + sizeof(hdr) + len > CAPTURE_BUF_BYTES) {
+            // the disk does not keep up
+            m_num_drop++;
+            return;
+        }
+
+        rec.m_pos      = m_data.size();
+        rec.m_len      = sizeof(hdr) + len;
+        rec.m_desc_pos = m_desc.size();
+        rec.m_desc_len = desc.size();
+
+        m_data.append((char*)&hdr, sizeof(hdr));
+        m_data.append(bytes.get_base(), len);
+        m_desc += desc;
+        m_rec.push_back(rec);
+
+        is_notify = m_data.size() >= CAPTURE_WRITE_BYTES &&
+                    rec.m_pos < CAPTURE_WRITE_BYTES;
+    }
+
+    if (is_notify)
+        m_condition.notify_one();
+}
+
+void
+fabs_capture::run()
+{
+    std::ostringstream os;
+    os << "SF-TAP cap[" << m_name << "]";
+    SET_THREAD_NAME(pthread_self(), os.str().c_str());
+    fabs_mem::set_thread_name(os.str());
+
+    std::string         data, desc;
+    std::vector<record> rec;
+
+    data.reserve(CAPTURE_WRITE_BYTES * 2);
+
+    for (;;) {
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            if (! m_is_break)
+                m_condition.wait_for(lock, std::chrono::milliseconds(100));
+        }
+
+        bool is_break = m_is_break;
+
+        {
+            fabs_spin_lock_ac lock(m_lock);
+
+            data.swap(m_data);
+            desc.swap(m_desc);
+            rec.swap(m_rec);
+        }
+
+        if (! rec.empty()) {
+            flush(data, desc, rec);
+
+            data.clear();
+            desc.clear();
+            rec.clear();
+        } else if (! m_path.empty() && m_max_file_time > 0 &&
+                   time(NULL) - m_file_time >= m_max_file_time) {
+            // rotate idle files too
+            close_file();
+        }
+
+        if (is_break) {
+            close_file();
+            return;
+        }
+    }
+}
+
+// write staged frames, rotating the file at frame boundaries
+void
+fabs_capture::flush(const std::string &data, const std::string &desc,
+                    const std::vector<record> &rec)
+{
+    time_t   now     = time(NULL);
+    size_t   begin   = 0; // of frames not written yet
+    uint64_t pending = 0; // bytes of them
+
+    for (size_t i = 0; i < rec.size(); i++) {
+        auto    &r     = rec[i];
+        uint64_t bytes = m_file_bytes + pending;
+
+        if (m_fd >= 0 && bytes > sizeof(pcap_hdr_t) &&
+            (bytes + r.m_len > m_max_file_bytes ||
+             (m_max_file_time > 0 && now - m_file_time >= m_max_file_time))) {
+            write_frames(data, desc, rec, begin, i);
+            begin   = i;
+            pending = 0;
+
+            close_file();
+        }
+
+        if (m_fd < 0) {
+            // index the file a write error has closed
+            close_file();
+
+            if (! open_file(now)) {
+                // frames before r have been written to the last file
+                m_num_drop += rec.size() - i;
+                return;
+            }
+        }
+
+        pending += r.m_len;
+    }
+
+    write_frames(data, desc, rec, begin, rec.size());
+}
+
+// write frames [begin, end) to the file and index them, or count them
+// as dropped if the write fails
+void
+fabs_capture::write_frames(const std::string &data, const std::string &desc,
+                           const std::vector<record> &rec,
+                           size_t begin, size_t end)
+{
+    if (begin == end)
+        return;
+
+    size_t pos = rec[begin].m_pos;
+    size_t len = (end < rec.size() ? rec[end].m_pos : data.size()) - pos;
+
+    if (! write_file(&data[pos], len)) {
+        m_num_drop += end - begin;
+        return;
+    }
+
+    auto last = m_index.end();
+
+    for (size_t i = begin; i < end; i++) {
+        auto &r = rec[i];
+
+        // frames of a flow are often consecutive
+        if (last == m_index.end() ||
+            desc.compare(r.m_desc_pos, r.m_desc_len, last->first) != 0) {
+            std::string key(desc, r.m_desc_pos, r.m_desc_len);
+
+            last = m_index.find(key);
+            if (last == m_index.end()) {
+                index_entry entry;
+
+                entry.m_offset  = m_file_bytes;
+                entry.m_packets = 0;
+                entry.m_bytes   = 0;
+
+                last = m_index.insert(std::make_pair(key, entry)).first;
+            }
+        }
+
+        last->second.m_packets++;
+        last->second.m_bytes += r.m_len - sizeof(pcaprec_hdr_t);
+
+        m_file_bytes += r.m_len;
+        m_num_packets++;
+        m_num_bytes += r.m_len - sizeof(pcaprec_hdr_t);
+    }
+}
+
+bool
+fabs_capture::open_file(time_t now)
+{
+    char tstr[32];
+    tm   t;
+
+    localtime_r(&now, &t);
+    strftime(tstr, sizeof(tstr), "%Y%m%d-%H%M%S", &t);
+
+    std::ostringstream os;
+    os << m_dir << "/" << m_name << "-" << tstr << "-" << m_file_seq++
+       << ".pcap";
+
+    m_path = os.str();
+    m_fd   = open(m_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                  0644);
+
+    if (m_fd < 0) {
+        perror(m_path.c_str());
+        m_path.clear();
+        return false;
+    }
+
+    pcap_hdr_t hdr;
+
+    hdr.magic_number  = 0xa1b2c3d4;
+    hdr.version_major = 2;
+    hdr.version_minor = 4;
+    hdr.thiszone      = 0;
+    hdr.sigfigs       = 0;
+    hdr.snaplen       = CAPTURE_SNAPLEN;
+    hdr.network       = DLT_EN10MB;
+
+    m_file_bytes = 0;
+    m_file_time  = now;
+    m_index.clear();
+    m_num_file++;
+
+    if (! write_file((char*)&hdr, sizeof(hdr)))
+        return false;
+
+    m_file_bytes = sizeof(hdr);
+
+    return true;
+}
+
+// close the file and write its index, one line per flow in order of
+// the first frame
+// the frames written before a write error are indexed too
+void
+fabs_capture::close_file()
+{
+    if (m_path.empty())
+        return;
+
+    if (m_fd >= 0) {
+        close(m_fd);
+        m_fd = -1;
+    }
+
+    std::vector<std::pair<uint64_t, const std::string*> > order;
+
+    for (auto &it: m_index) {
+        order.push_back(std::make_pair(it.second.m_offset, &it.first));
+    }
+
+    std::sort(order.begin(), order.end());
+
+    std::string buf;
+
+    for (auto &it: order) {
+        auto &entry = m_index[*it.second];
+
+        buf += *it.second;
+        buf += ",offset=" + std::to_string(entry.m_offset);
+        buf += ",packets=" + std::to_string(entry.m_packets);
+        buf += ",bytes=" + std::to_string(entry.m_bytes);
+        buf += "\n";
+    }
+
+    std::string path = m_path.substr(0, m_path.size() - 5) + ".idx";
+
+    m_fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (m_fd < 0) {
+        perror(path.c_str());
+    } else if (write_file(buf.data(), buf.size())) {
+        close(m_fd);
+        m_fd = -1;
+    }
+
+    m_index.clear();
+    m_path.clear();
+}
+
+bool
+fabs_capture::write_file(const char *buf, size_t len)
+{
+    if (m_fd < 0)
+        return false;
+
+    while (len > 0) {
+        ssize_t n = ::write(m_fd, buf, len);
+
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+
+            perror(m_path.c_str());
+            close(m_fd);
+            m_fd = -1;
+
+            return false;
+        }
+
+        buf += n;
+        len -= n;
+    }
+
+    return true;
+}
+
+void
+fabs_capture::print_stat()
+{
+    std::cout << "capture " << m_name << ": files = " << m_num_file
+              << ", packets = " << m_num_packets
+              << ", bytes = " << m_num_bytes
+              << ", dropped = " << m_num_drop << std::endl;
+}
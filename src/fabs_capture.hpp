@@ -0,0 +1,91 @@
+#ifndef FABS_CAPTURE_HPP
+#define FABS_CAPTURE_HPP
+
+#include "fabs_common.hpp"
+#include "fabs_bytes.hpp"
+#include "fabs_spin_lock.hpp"
+
+#include <stdint.h>
+#include <time.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// writes frames of the flows matched by a rule to pcap files rotated by
+// size or time
+// regex threads append frames to a staging buffer, and an I/O thread
+// writes them to the file by large writes
+// the flows in a file are listed in its index (.idx) when it is closed
+class fabs_capture {
+public:
+    fabs_capture(const std::string &dir, const std::string &name,
+                 uint64_t max_file_bytes, time_t max_file_time);
+    virtual ~fabs_capture();
+
+    // queue the frame which the payload of bytes was cut from
+    // desc identifies the flow in the index
+    void write(const std::string &desc, fabs_bytes &bytes);
+
+    void print_stat();
+
+private:
+    struct record {
+        size_t   m_pos;      // of pcaprec_hdr_t in the staging buffer
+        uint32_t m_len;      // of pcaprec_hdr_t and the frame
+        uint32_t m_desc_pos;
+        uint32_t m_desc_len;
+    };
+
+    struct index_entry {
+        uint64_t m_offset;   // of the first frame of the flow in the file
+        uint64_t m_packets;
+        uint64_t m_bytes;
+    };
+
+    std::string m_dir;
+    std::string m_name;
+    uint64_t    m_max_file_bytes;
+    time_t      m_max_file_time;
+
+    // staging buffer, shared with regex threads
+    fabs_spin_lock      m_lock;
+    std::string         m_data;
+    std::string         m_desc;
+    std::vector<record> m_rec;
+
+    // the current file, owned by the I/O thread
+    // m_fd is -1 after a write error until the file is closed
+    int         m_fd;
+    std::string m_path;  // empty if no file is open
+    uint64_t    m_file_bytes;
+    time_t      m_file_time;
+    int         m_file_seq;
+    std::map<std::string, index_entry> m_index;
+
+    std::atomic<uint64_t> m_num_packets;
+    std::atomic<uint64_t> m_num_bytes;
+    std::atomic<uint64_t> m_num_drop;
+    std::atomic<uint64_t> m_num_file;
+
+    volatile bool           m_is_break;
+    std::mutex              m_mutex;
+    std::condition_variable m_condition;
+    std::thread             m_thread;
+
+    void run();
+    void flush(const std::string &data, const std::string &desc,
+               const std::vector<record> &rec);
+    void write_frames(const std::string &data, const std::string &desc,
+                      const std::vector<record> &rec,
+                      size_t begin, size_t end);
+    bool open_file(time_t now);
+    void close_file();
+    bool write_file(const char *buf, size_t len);
+};
+
+#endif // FABS_CAPTURE_HPP
@@ -4,6 +4,7 @@
 #include "fabs_spin_lock.hpp"
 
 #include <iostream>
+#include <utility>
 
 #define QNUM (1024 * 10)
 
@@ -42,7 +43,7 @@ inline bool fabs_cb<T>::pop(T *p)
         return false;
     }
 
-    *p = *m_head;
+    *p = std::move(*m_head);
 
     {
         fabs_spin_lock_ac lock(m_lock);
@@ -71,53 +72,6 @@ inline bool fabs_cb<T>::push(T &val)
         return false;
     }
 
-    *m_tail = val;
-    m_len++;
-    m_tail++;
-
-    if (m_tail == m_buf_end) {
-        m_tail = m_buf;
-    }
-
-    return true;
-}
-
-template <>
-inline bool fabs_cb<ptr_fabs_bytes>::pop(ptr_fabs_bytes *p)
-{
-    if (m_len == 0) {
-        return false;
-    }
-
-    *p = std::move(*m_head);
-
-    {
-        fabs_spin_lock_ac lock(m_lock);
-        m_len--;
-    }
-
-    m_head++;
-
-    if (m_head == m_buf_end) {
-        m_head = m_buf;
-    }
-
-    return true;
-}
-
-template <>
-inline bool fabs_cb<ptr_fabs_bytes>::push(ptr_fabs_bytes &val)
-{
-    if (m_len == m_max_len) {
-        return false;
-    }
-
-    fabs_spin_lock_ac lock(m_lock);
-
-    if (m_len == m_max_len) {
-        return false;
-    }
-
     *m_tail = std::move(val);
     m_len++;
     m_tail++;
@@ -0,0 +1,568 @@
+#include "fabs_classifier.hpp"
+
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+
+#define MAX_META_LEN 255
+
+static inline uint16_t
+get_be16(const uint8_t *p)
+{
+    return ((uint16_t)p[0] << 8) | p[1];
+}
+
+static inline uint32_t
+get_be24(const uint8_t *p)
+{
+    return ((uint32_t)p[0] << 16) | ((uint32_t)p[1] << 8) | p[2];
+}
+
+// append ",key=value" to meta
+// characters which break the text header are replaced by '_'
+static void
+append_meta(std::string *meta, const char *key, const char *val, int len)
+{
+    if (meta == nullptr || len <= 0)
+        return;
+
+    if (len > MAX_META_LEN)
+        len = MAX_META_LEN;
+
+    if (! meta->empty())
+        *meta += ",";
+
+    *meta += key;
+    *meta += "=";
+
+    for (int i = 0; i < len; i++) {
+        char c = val[i];
+        if (c <= 0x20 || c >= 0x7f || c == ',' || c == '=') {
+            *meta += '_';
+        } else {
+            *meta += c;
+        }
+    }
+}
+
+static inline bool
+is_digit(char c)
+{
+    return '0' <= c && c <= '9';
+}
+
+fabs_classifier_type
+fabs_classifier::get_type(const std::string &name)
+{
+    if (name == "tls" || name == "ssl") {
+        return CLASSIFIER_TLS;
+    } else if (name == "http") {
+        return CLASSIFIER_HTTP;
+    } else if (name == "ssh") {
+        return CLASSIFIER_SSH;
+    } else if (name == "dns") {
+        return CLASSIFIER_DNS;
+    }
+
+    return CLASSIFIER_NONE;
+}
+
+bool
+fabs_classifier::match_stream(const char *buf1, int len1,
+                              const char *buf2, int len2,
+                              bool &is_up1, std::string &meta) const
+{
+    switch (m_type) {
+    case CLASSIFIER_TLS:
+        if (is_tls_hello(buf1, len1, 1, nullptr) &&
+            is_tls_hello(buf2, len2, 2, nullptr)) {
+            is_up1 = true;
+            is_tls_hello(buf1, len1, 1, &meta);
+            is_tls_hello(buf2, len2, 2, &meta);
+            return true;
+        } else if (is_tls_hello(buf2, len2, 1, nullptr) &&
+                   is_tls_hello(buf1, len1, 2, nullptr)) {
+            is_up1 = false;
+            is_tls_hello(buf2, len2, 1, &meta);
+            is_tls_hello(buf1, len1, 2, &meta);
+            return true;
+        }
+        break;
+    case CLASSIFIER_HTTP:
+        if (is_http_request(buf1, len1, nullptr) &&
+            is_http_response(buf2, len2, nullptr)) {
+            is_up1 = true;
+            is_http_request(buf1, len1, &meta);
+            is_http_response(buf2, len2, &meta);
+            return true;
+        } else if (is_http_request(buf2, len2, nullptr) &&
+                   is_http_response(buf1, len1, nullptr)) {
+            is_up1 = false;
+            is_http_request(buf2, len2, &meta);
+            is_http_response(buf1, len1, &meta);
+            return true;
+        }
+        break;
+    case CLASSIFIER_SSH:
+        if (is_ssh_banner(buf1, len1, "ssh_1", nullptr) &&
+            is_ssh_banner(buf2, len2, "ssh_2", nullptr)) {
+            // both sides send the same banner, so the client is unknown
+            is_up1 = true;
+            is_ssh_banner(buf1, len1, "ssh_1", &meta);
+            is_ssh_banner(buf2, len2, "ssh_2", &meta);
+            return true;
+        }
+        break;
+    case CLASSIFIER_DNS:
+    {
+        // DNS over TCP has 2 bytes length prefix
+        if (len1 < 2 || len2 < 2)
+            break;
+
+        if (is_dns_message(buf1 + 2, len1 - 2, 0, nullptr) &&
+            is_dns_message(buf2 + 2, len2 - 2, 1, nullptr)) {
+            is_up1 = true;
+            is_dns_message(buf1 + 2, len1 - 2, 0, &meta);
+            return true;
+        } else if (is_dns_message(buf2 + 2, len2 - 2, 0, nullptr) &&
+                   is_dns_message(buf1 + 2, len1 - 2, 1, nullptr)) {
+            is_up1 = false;
+            is_dns_message(buf2 + 2, len2 - 2, 0, &meta);
+            return true;
+        }
+        break;
+    }
+    default:
+        break;
+    }
+
+    return false;
+}
+
+bool
+fabs_classifier::match_oneway(const char *buf, int len, bool &is_client,
+                              std::string &meta) const
+{
+    switch (m_type) {
+    case CLASSIFIER_TLS:
+        if (is_tls_hello(buf, len, 1, nullptr)) {
+            is_client = true;
+            is_tls_hello(buf, len, 1, &meta);
+            return true;
+        } else if (is_tls_hello(buf, len, 2, nullptr)) {
+            is_client = false;
+            is_tls_hello(buf, len, 2, &meta);
+            return true;
+        }
+        break;
+    case CLASSIFIER_HTTP:
+        if (is_http_request(buf, len, nullptr)) {
+            is_client = true;
+            is_http_request(buf, len, &meta);
+            return true;
+        } else if (is_http_response(buf, len, nullptr)) {
+            is_client = false;
+            is_http_response(buf, len, &meta);
+            return true;
+        }
+        break;
+    case CLASSIFIER_SSH:
+        if (is_ssh_banner(buf, len, "ssh_1", nullptr)) {
+            // both sides send the same banner, so the client is unknown
+            is_client = true;
+            is_ssh_banner(buf, len, "ssh_1", &meta);
+            return true;
+        }
+        break;
+    case CLASSIFIER_DNS:
+        // DNS over TCP has 2 bytes length prefix
+        if (len < 2)
+            break;
+
+        if (is_dns_message(buf + 2, len - 2, 0, nullptr)) {
+            is_client = true;
+            is_dns_message(buf + 2, len - 2, 0, &meta);
+            return true;
+        } else if (is_dns_message(buf + 2, len - 2, 1, nullptr)) {
+            is_client = false;
+            is_dns_message(buf + 2, len - 2, 1, &meta);
+            return true;
+        }
+        break;
+    default:
+        break;
+    }
+
+    return false;
+}
+
+bool
+fabs_classifier::match_datagram(const char *buf, int len,
+                                std::string &meta) const
+{
+    if (m_type == CLASSIFIER_DNS) {
+        return is_dns_message(buf, len, -1, &meta);
+    }
+
+    return false;
+}
+
+// type = 1: ClientHello, 2: ServerHello
+bool
+fabs_classifier::is_tls_hello(const char *buf, int len, uint8_t type,
+                              std::string *meta) const
+{
+    const uint8_t *p   = (const uint8_t*)buf;
+    const uint8_t *end = p + len;
+
+    if (len < 6)
+        return false;
+
+    if (p[0] != 0x16) {
+        // SSL 2.0 compatible hello
+        return (p[0] & 0x80) && p[2] == type &&
+            ((p[3] == 0x02 && p[4] == 0x00) || (p[3] == 0x03 && p[4] <= 0x03));
+    }
+
+    if (p[1] != 0x03 || p[2] > 0x04)
+        return false;
+
+    uint16_t reclen = get_be16(p + 3);
+    if (reclen < 4)
+        return false;
+
+    p += 5;
+    if (p + reclen < end)
+        end = p + reclen;
+
+    if (end - p < 6 || p[0] != type)
+        return false;
+
+    uint32_t hslen = get_be24(p + 1);
+    if (hslen < 38)
+        return false;
+
+    p += 4;
+    if (p + hslen < end)
+        end = p + hslen;
+
+    if (p[0] != 0x03 || p[1] > 0x04)
+        return false;
+
+    if (meta == nullptr)
+        return true;
+
+    // extract metadata as far as the buffer has
+    uint16_t version = get_be16(p);
+    const uint8_t *q = p + 2 + 32;
+
+    if (q + 1 > end)
+        goto ver;
+    q += 1 + q[0]; // session ID
+
+    if (type == 1) {
+        if (q + 2 > end)
+            goto ver;
+        q += 2 + get_be16(q); // cipher suites
+
+        if (q + 1 > end)
+            goto ver;
+        q += 1 + q[0]; // compression methods
+    } else {
+        q += 3; // cipher suite and compression method
+    }
+
+    if (q + 2 > end)
+        goto ver;
+
+    {
+        const uint8_t *ext_end = q + 2 + get_be16(q);
+        if (ext_end < end)
+            end = ext_end;
+
+        q += 2;
+
+        while (q + 4 <= end) {
+            uint16_t ext_type = get_be16(q);
+            uint16_t ext_len  = get_be16(q + 2);
+            const uint8_t *e  = q + 4;
+
+            q = e + ext_len;
+            if (q > end)
+                break;
+
+            if (type == 1 && ext_type == 0 && ext_len >= 5) {
+                // server_name
+                const uint8_t *e_end = e + 2 + get_be16(e);
+                if (e_end > q)
+                    e_end = q;
+
+                e += 2;
+                while (e + 3 <= e_end) {
+                    uint16_t nlen = get_be16(e + 1);
+                    if (e + 3 + nlen > e_end)
+                        break;
+
+                    if (e[0] == 0) {
+                        append_meta(meta, "tls_sni", (const char*)e + 3, nlen);
+                        break;
+                    }
+
+                    e += 3 + nlen;
+                }
+            } else if (type == 2 && ext_type == 16 && ext_len >= 3) {
+                // application_layer_protocol_negotiation
+                uint8_t plen = e[2];
+                if (e + 3 + plen <= q)
+                    append_meta(meta, "tls_alpn", (const char*)e + 3, plen);
+            } else if (type == 2 && ext_type == 43 && ext_len == 2) {
+                // supported_versions
+                version = get_be16(e);
+            }
+        }
+    }
+
+ver:
+    if (type == 2) {
+        switch (version) {
+        case 0x0300:
+            append_meta(meta, "tls_version", "ssl3", 4);
+            break;
+        case 0x0301:
+            append_meta(meta, "tls_version", "1.0", 3);
+            break;
+        case 0x0302:
+            append_meta(meta, "tls_version", "1.1", 3);
+            break;
+        case 0x0303:
+            append_meta(meta, "tls_version", "1.2", 3);
+            break;
+        case 0x0304:
+            append_meta(meta, "tls_version", "1.3", 3);
+            break;
+        default:
+            break;
+        }
+    }
+
+    return true;
+}
+
+// METHOD SP request-target SP HTTP/1.x CRLF
+bool
+fabs_classifier::is_http_request(const char *buf, int len,
+                                 std::string *meta) const
+{
+    int i = 0;
+
+    for (; i < len && i < 16; i++) {
+        char c = buf[i];
+        if (! (('A' <= c && c <= 'Z') || ('a' <= c && c <= 'z') || c == '-'))
+            break;
+    }
+
+    int mlen = i;
+    if (mlen == 0 || i >= len || buf[i] != ' ')
+        return false;
+
+    i++;
+
+    int target = i;
+    for (; i < len; i++) {
+        if (buf[i] == ' ' || buf[i] == '\r' || buf[i] == '\n')
+            break;
+    }
+
+    if (i == target || len - i < 10 || buf[i] != ' ')
+        return false;
+
+    i++;
+
+    if (memcmp(buf + i, "HTTP/1.", 7) != 0 || ! is_digit(buf[i + 7]))
+        return false;
+
+    i += 8;
+    if (buf[i] == '\r')
+        i++;
+
+    if (i >= len || buf[i] != '\n')
+        return false;
+
+    if (meta == nullptr)
+        return true;
+
+    append_meta(meta, "http_method", buf, mlen);
+
+    // find Host header
+    i++;
+    while (i < len) {
+        int eol = i;
+        while (eol < len && buf[eol] != '\n')
+            eol++;
+
+        int n = eol - i;
+        if (n > 0 && buf[eol - 1] == '\r')
+            n--;
+
+        if (n == 0)
+            break;
+
+        if (n > 5 && strncasecmp(buf + i, "host:", 5) == 0) {
+            int v = i + 5;
+            while (v < i + n && buf[v] == ' ')
+                v++;
+
+            append_meta(meta, "http_host", buf + v, i + n - v);
+            break;
+        }
+
+        i = eol + 1;
+    }
+
+    return true;
+}
+
+// HTTP/1.x SP 3DIGIT SP
+bool
+fabs_classifier::is_http_response(const char *buf, int len,
+                                  std::string *meta) const
+{
+    if (len < 13)
+        return false;
+
+    if (memcmp(buf, "HTTP/1.", 7) != 0 || ! is_digit(buf[7]) || buf[8] != ' ')
+        return false;
+
+    if (buf[9] < '1' || buf[9] > '9' || ! is_digit(buf[10]) ||
+        ! is_digit(buf[11]))
+        return false;
+
+    if (buf[12] != ' ' && buf[12] != '\r' && buf[12] != '\n')
+        return false;
+
+    append_meta(meta, "http_status", buf + 9, 3);
+
+    return true;
+}
+
+// SSH-protoversion-softwareversion [SP comments] CR LF
+bool
+fabs_classifier::is_ssh_banner(const char *buf, int len, const char *key,
+                               std::string *meta) const
+{
+    if (len < 9 || memcmp(buf, "SSH-", 4) != 0)
+        return false;
+
+    if ((buf[4] != '1' && buf[4] != '2') || buf[5] != '.' || ! is_digit(buf[6]))
+        return false;
+
+    int i = 7;
+    while (i < len && is_digit(buf[i]))
+        i++;
+
+    if (i >= len || buf[i] != '-')
+        return false;
+
+    int sw = ++i;
+    for (; i < len && i < 255; i++) {
+        if (buf[i] == '\n')
+            break;
+    }
+
+    if (i >= len || i == sw)
+        return false;
+
+    int n = i - sw;
+    for (int j = sw; j < i; j++) {
+        if (buf[j] == ' ' || buf[j] == '\r') {
+            n = j - sw;
+            break;
+        }
+    }
+
+    append_meta(meta, key, buf + sw, n);
+
+    return true;
+}
+
+// qr = 0: query, 1: response, -1: either
+bool
+fabs_classifier::is_dns_message(const char *buf, int len, int qr,
+                                std::string *meta) const
+{
+    const uint8_t *p = (const uint8_t*)buf;
+
+    if (len < 12)
+        return false;
+
+    uint16_t flags   = get_be16(p + 2);
+    uint16_t qdcount = get_be16(p + 4);
+    uint16_t ancount = get_be16(p + 6);
+    uint16_t nscount = get_be16(p + 8);
+    uint16_t arcount = get_be16(p + 10);
+
+    int is_resp = flags >> 15;
+    int opcode  = (flags >> 11) & 0x0f;
+    int z       = (flags >> 6) & 0x01;
+    int rcode   = flags & 0x0f;
+
+    if (qr >= 0 && is_resp != qr)
+        return false;
+
+    if (opcode == 3 || opcode > 6 || z != 0)
+        return false;
+
+    if (! is_resp && (rcode != 0 || ancount > 16))
+        return false;
+
+    if (qdcount > 16 || nscount > 256 || arcount > 256 || ancount > 1024)
+        return false;
+
+    if (qdcount == 0)
+        return is_resp;
+
+    // the first question must be well-formed
+    char name[256];
+    int  nlen = 0;
+    int  i    = 12;
+
+    for (;;) {
+        if (i >= len)
+            return false;
+
+        uint8_t l = p[i];
+
+        if (l == 0) {
+            i++;
+            break;
+        } else if ((l & 0xc0) == 0xc0) {
+            i += 2;
+            break;
+        } else if (l > 63) {
+            return false;
+        }
+
+        if (i + 1 + l > len || nlen + l + 1 > (int)sizeof(name))
+            return false;
+
+        if (nlen > 0)
+            name[nlen++] = '.';
+
+        memcpy(name + nlen, p + i + 1, l);
+        nlen += l;
+        i += 1 + l;
+    }
+
+    if (i + 4 > len)
+        return false;
+
+    if (meta) {
+        append_meta(meta, "dns_qname", name, nlen);
+
+        char qtype[8];
+        int  n = snprintf(qtype, sizeof(qtype), "%u", get_be16(p + i));
+        append_meta(meta, "dns_qtype", qtype, n);
+    }
+
+    return true;
+}
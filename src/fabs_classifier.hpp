@@ -0,0 +1,56 @@
+#ifndef FABS_CLASSIFIER_HPP
+#define FABS_CLASSIFIER_HPP
+
+#include "fabs_common.hpp"
+
+#include <stdint.h>
+
+#include <memory>
+#include <string>
+
+enum fabs_classifier_type {
+    CLASSIFIER_NONE,
+    CLASSIFIER_TLS,
+    CLASSIFIER_HTTP,
+    CLASSIFIER_SSH,
+    CLASSIFIER_DNS,
+};
+
+// built-in protocol classifiers which can be used instead of regex
+class fabs_classifier {
+public:
+    fabs_classifier(fabs_classifier_type type) : m_type(type) { }
+    virtual ~fabs_classifier() { }
+
+    static fabs_classifier_type get_type(const std::string &name);
+
+    // buf1 and buf2 are the first bytes of each direction
+    // is_up1 is set true if buf1 was sent by the client
+    // metadata is appended to meta as "key=value" separated by ','
+    bool match_stream(const char *buf1, int len1, const char *buf2, int len2,
+                      bool &is_up1, std::string &meta) const;
+    bool match_datagram(const char *buf, int len, std::string &meta) const;
+
+    // match the first bytes of one direction alone for asymmetric taps
+    // is_client is set true if buf was sent by the client
+    bool match_oneway(const char *buf, int len, bool &is_client,
+                      std::string &meta) const;
+
+    fabs_classifier_type get_type() const { return m_type; }
+
+private:
+    fabs_classifier_type m_type;
+
+    bool is_tls_hello(const char *buf, int len, uint8_t type,
+                      std::string *meta) const;
+    bool is_http_request(const char *buf, int len, std::string *meta) const;
+    bool is_http_response(const char *buf, int len, std::string *meta) const;
+    bool is_ssh_banner(const char *buf, int len, const char *key,
+                       std::string *meta) const;
+    bool is_dns_message(const char *buf, int len, int qr,
+                        std::string *meta) const;
+};
+
+typedef std::unique_ptr<fabs_classifier> ptr_classifier;
+
+#endif // FABS_CLASSIFIER_HPP
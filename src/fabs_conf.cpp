@@ -37,7 +37,13 @@ fabs_conf::read_conf(string conf)
         }
     } catch (YAML::BadFile e) {
         return false;
+    } catch (YAML::Exception e) {
+        // reloading must not abort on a broken file
+        std::cerr << conf << ": " << e.what() << std::endl;
+        return false;
     }
 
+    m_path = conf;
+
     return true;
 }
@@ -14,6 +14,7 @@ public:
     bool read_conf(std::string conf);
 
     std::map<std::string, std::map<std::string, std::string> > m_conf;
+    std::string m_path; // the last file read
 
 };
 
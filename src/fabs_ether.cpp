@@ -72,6 +72,13 @@ fabs_ether::~fabs_ether()
 void
 fabs_ether::produce(int idx, ptr_fabs_bytes buf)
 {
+    if (fabs_mem::get_level() == fabs_mem::LEVEL_HARD) {
+        __sync_fetch_and_add(&m_num_dropped, 1);
+        return;
+    }
+
+    buf->charge(MEM_QUEUE);
+
     if (! m_queue[idx].push(buf)) {
         __sync_fetch_and_add(&m_num_dropped, 1);
         return;
@@ -138,10 +145,15 @@ fabs_ether::timer()
             }
 
             m_callback.print_stat();
+            m_appif->print_stat();
+            fabs_pool::print_stat();
+            fabs_mem::print_stat();
 
             std::cout << std::endl;
         }
 
+        fabs_mem::update();
+
         std::this_thread::sleep_for(std::chrono::milliseconds(500));
         if (m_is_break)
             return;
@@ -154,6 +166,7 @@ fabs_ether::consume(int idx)
     std::ostringstream os;
     os << "SF-TAP TCP[" << idx << "]";
     SET_THREAD_NAME(pthread_self(), os.str().c_str());
+    fabs_mem::set_thread_name(os.str());
 
     for (;;) {
         {
@@ -303,7 +316,7 @@ fabs_ether::consume_fragment()
 void
 fabs_ether::ether_input(const uint8_t *bytes, int len, const timeval &tm, bool is_pcap)
 {
-    if (is_pcap) m_num_pcap++;
+    if (is_pcap) __sync_fetch_and_add(&m_num_pcap, 1);
 
     uint8_t proto;
     const uint8_t *ip_hdr = get_ip_hdr(bytes, len, proto);
@@ -60,7 +60,7 @@ private:
     bool *m_is_consuming;
     bool  m_is_consuming_frag;
 
-    uint64_t m_num_pcap;
+    volatile uint64_t m_num_pcap; // by I/O threads of appif
 
     std::mutex *m_mutex;
     std::mutex  m_mutex_frag;
@@ -1,6 +1,8 @@
 #include "fabs_fragment.hpp"
 #include "fabs_ether.hpp"
 
+#include <net/ethernet.h>
+
 #include <functional>
 
 #define FRAGMENT_GC_TIMER 30
@@ -133,6 +135,15 @@ fabs_fragment::input_ip(ptr_fabs_bytes buf)
 
         std::unique_lock<std::mutex> lock(m_mutex);
         auto it = m_fragments.find(frag);
+        auto level = fabs_mem::get_level();
+
+        // over the limits, give up new datagrams first
+        if (level == fabs_mem::LEVEL_HARD ||
+            (level == fabs_mem::LEVEL_SOFT && it == m_fragments.end()))
+            return true;
+
+        buf->charge(MEM_FRAGMENT);
+
         if (it == m_fragments.end()) {
             m_fragments.insert(fragments(iph4, std::move(buf)));
         } else {
@@ -183,12 +194,21 @@ fabs_fragment::defragment(const fragments &frg, ptr_fabs_bytes &buf)
     iph = (ip*)frg.m_bytes->begin()->second->get_head();
     hlen = iph->ip_hl * 4;
 
-    buf->alloc(frg.m_size + hlen);
+    // the packet is parsed again from its Ethernet header, which is
+    // also written to pcap files of captured flows
+    buf->alloc(sizeof(ether_header) + frg.m_size + hlen);
 
     if (buf->get_len() == 0)
         return false;
 
-    memcpy(buf->get_head(), iph, hlen);
+    ether_header *ehdr = (ether_header*)buf->get_head();
+
+    memset(ehdr, 0, sizeof(*ehdr));
+    ehdr->ether_type = htons(ETHERTYPE_IP);
+
+    char *l3 = buf->get_head() + sizeof(ether_header);
+
+    memcpy(l3, iph, hlen);
 
     for (auto it = frg.m_bytes->begin(); it != frg.m_bytes->end(); ++it) {
         int offset = it->first;
@@ -206,16 +226,17 @@ fabs_fragment::defragment(const fragments &frg, ptr_fabs_bytes &buf)
             return false;
         }
 
-        memcpy(buf->get_head() + pos + hlen,
+        memcpy(l3 + pos + hlen,
                it->second->get_head() + iph4->ip_hl * 4, len);
 
         next += len;
     }
 
-    iph = (ip*)buf->get_head();
+    iph = (ip*)l3;
 
     iph->ip_id  = 0;
     iph->ip_off = 0;
+    iph->ip_len = htons(frg.m_size + hlen);
 
     return true;
 }
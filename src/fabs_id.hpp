@@ -50,6 +50,57 @@ struct fabs_appif_header {
 
 typedef std::shared_ptr<fabs_appif_header> ptr_appif_header;
 
+// binary format version 2 (format: binary2)
+// every event begins with fabs_appif_header2 followed by len bytes
+//   CREATED:   fabs_appif_tuple and metadata of the classifier
+//   DESTROYED: nothing, or bytes of each direction (2 x uint64_t) if
+//              the rule has max_body_per_dir, followed by fabs_flow_stat if
+//              the rule has summary
+//   DATA:      the payload
+//   DATAGRAM:  fabs_appif_tuple and the payload, ID is 0
+//   FLOW:      fabs_appif_tuple, fabs_flow_stat and the name of the rule,
+//              only to the flows interface
+// a flow is identified by ID, which is unique and increases monotonically
+enum fabs_appif_event2 {
+    APPIF2_CREATED   = 0,
+    APPIF2_DESTROYED = 1,
+    APPIF2_DATA      = 2,
+    APPIF2_DATAGRAM  = 3,
+    APPIF2_FLOW      = 4,
+};
+
+struct fabs_appif_header2 {
+    uint64_t id;     // machine-dependent endian
+    uint64_t tm;     // [us] since the epoch, machine-dependent endian
+    uint32_t len;    // machine-dependent endian
+    uint8_t  event;  // fabs_appif_event2
+    uint8_t  from;   // FROM_ADDR1: from addr1, FROM_ADDR2: from addr2
+    uint8_t  match;  // 0: matched up's regex, 1: matched down's regex, 2: none
+    uint8_t  reason; // 0: normal, 1: reset, 2: timeout, 3: compromised
+} __attribute__((packed));
+
+struct fabs_appif_tuple {
+    uint8_t  l3_addr1[16]; // IPv4 uses the first 4 bytes
+    uint8_t  l3_addr2[16];
+    uint16_t l4_port1; // big endian
+    uint16_t l4_port2; // big endian
+    uint8_t  hop;
+    uint8_t  l3_proto; // IPPROTO_IP or IPPROTO_IPV6
+    uint8_t  l4_proto; // IPPROTO_TCP or IPPROTO_UDP
+    uint8_t  unused;
+} __attribute__((packed));
+
+// counters of a flow, [0] is from addr1 and [1] is from addr2
+// TCP counts segments and in-order payload, UDP counts datagrams
+struct fabs_flow_stat {
+    uint64_t start;      // [us] since the epoch, machine-dependent endian
+    uint64_t end;        // [us] since the epoch, machine-dependent endian
+    uint64_t packets[2];
+    uint64_t bytes[2];   // payload, without retransmissions
+    uint32_t retrans[2]; // retransmitted segments
+    uint32_t ooo[2];     // segments arrived out of order
+} __attribute__((packed));
+
 struct fabs_peer {
     union {
         uint32_t b32; // big endian
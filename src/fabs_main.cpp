@@ -8,6 +8,8 @@
     #include "fabs_netmap.hpp"
 #endif // USE_NETMAP
 
+#include <errno.h>
+#include <string.h>
 #include <unistd.h>
 #include <signal.h>
 
@@ -36,6 +38,18 @@ fabs_netmap *nm;
 
 volatile bool is_break = false;
 
+#ifndef USE_PERF
+pid_t child_pid = -1;
+
+// the child reloads rules on SIGHUP
+void
+forward_sighup(int sig)
+{
+    if (child_pid > 0)
+        kill(child_pid, SIGHUP);
+}
+#endif // USE_PERF
+
 void
 print_usage(char *cmd)
 {
@@ -195,11 +209,26 @@ main(int argc, char *argv[])
             exit(1);
         }
 
+        child_pid = result_pid;
+
+        struct sigaction sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = forward_sighup;
+        sigemptyset(&sa.sa_mask);
+        sigaction(SIGHUP, &sa, NULL);
+
         int status;
-        waitpid(result_pid, &status, 0);
+        while (waitpid(result_pid, &status, 0) < 0 && errno == EINTR) {
+        }
         std::cout << std::endl;
 
         remove_uxfile(conf);
+
+        // interfaces added by reloading
+        fabs_conf last;
+        if (last.read_conf(confpath))
+            remove_uxfile(last);
+
         return 0;
     }
 #endif // USE_PERF
@@ -227,6 +256,7 @@ main(int argc, char *argv[])
 #endif // USE_NETMAP
 
     SET_THREAD_NAME(pthread_self(), "SF-TAP main");
+    fabs_mem::set_thread_name("SF-TAP main");
 
 #ifdef USE_PERF
     pc = new fabs_pcap(conf, t);
@@ -0,0 +1,211 @@
+#include "fabs_mem.hpp"
+#include "fabs_spin_lock.hpp"
+
+#include <iostream>
+#include <vector>
+
+std::atomic<int> fabs_mem::m_level(fabs_mem::LEVEL_NORMAL);
+
+namespace {
+
+// written only by the owner thread
+struct counter {
+    std::atomic<int64_t> m_bytes[MEM_NUM];
+    std::atomic<int64_t> m_num[MEM_NUM];
+    std::string          m_name; // guarded by g_lock
+
+    counter() {
+        for (int i = 0; i < MEM_NUM; i++) {
+            m_bytes[i] = 0;
+            m_num[i]   = 0;
+        }
+    }
+};
+
+// counters are never deleted, since buffers charged by a thread may be
+// released after it exits
+fabs_spin_lock         g_lock;
+std::vector<counter*> *g_counter = new std::vector<counter*>;
+
+std::atomic<uint64_t> g_soft(0);
+std::atomic<uint64_t> g_hard(0);
+
+const char *g_name[MEM_NUM] = {
+    "fragment",
+    "tcp",
+    "queue",
+    "classify",
+    "backlog",
+    "flow",
+};
+
+thread_local counter *t_counter = nullptr;
+
+counter *
+get_counter()
+{
+    if (t_counter == nullptr) {
+        t_counter = new counter;
+
+        fabs_spin_lock_ac lock(g_lock);
+        g_counter->push_back(t_counter);
+    }
+
+    return t_counter;
+}
+
+void
+sum(int64_t *bytes, int64_t *num)
+{
+    for (int i = 0; i < MEM_NUM; i++) {
+        bytes[i] = 0;
+        num[i]   = 0;
+    }
+
+    fabs_spin_lock_ac lock(g_lock);
+
+    for (auto c: *g_counter) {
+        for (int i = 0; i < MEM_NUM; i++) {
+            bytes[i] += c->m_bytes[i].load(std::memory_order_relaxed);
+            num[i]   += c->m_num[i].load(std::memory_order_relaxed);
+        }
+    }
+}
+
+} // namespace
+
+void
+fabs_mem::add(fabs_mem_kind kind, int64_t bytes, int64_t num)
+{
+    counter *c = get_counter();
+
+    // no lock prefix, since only this thread writes
+    c->m_bytes[kind].store(c->m_bytes[kind].load(std::memory_order_relaxed) +
+                           bytes, std::memory_order_relaxed);
+    c->m_num[kind].store(c->m_num[kind].load(std::memory_order_relaxed) +
+                         num, std::memory_order_relaxed);
+}
+
+void
+fabs_mem::set_thread_name(const std::string &name)
+{
+    counter *c = get_counter();
+
+    fabs_spin_lock_ac lock(g_lock);
+    c->m_name = name;
+}
+
+void
+fabs_mem::set_limit(uint64_t soft, uint64_t hard)
+{
+    g_soft = soft;
+    g_hard = hard;
+}
+
+void
+fabs_mem::update()
+{
+    uint64_t soft = g_soft;
+    uint64_t hard = g_hard;
+
+    if (soft == 0 && hard == 0)
+        return;
+
+    int64_t bytes[MEM_NUM], num[MEM_NUM];
+    int64_t total = 0;
+
+    sum(bytes, num);
+
+    for (int i = 0; i < MEM_NUM; i++) {
+        total += bytes[i];
+    }
+
+    int level = LEVEL_NORMAL;
+
+    if (hard > 0 && total > (int64_t)hard) {
+        level = LEVEL_HARD;
+    } else if (soft > 0 && total > (int64_t)soft) {
+        level = LEVEL_SOFT;
+    }
+
+    int old = m_level.exchange(level);
+
+    if (level > old) {
+        std::cerr << "buffered memory (" << total << " bytes) exceeds the "
+                  << (level == LEVEL_HARD ? "hard" : "soft") << " limit"
+                  << std::endl;
+    } else if (level < old) {
+        std::cerr << "buffered memory (" << total << " bytes) is back "
+                  << (level == LEVEL_SOFT ? "under the hard limit" :
+                                            "within the limits")
+                  << std::endl;
+    }
+}
+
+void
+fabs_mem::print_stat()
+{
+    int64_t bytes[MEM_NUM], num[MEM_NUM];
+    int64_t total = 0;
+
+    sum(bytes, num);
+
+    std::cout << "buffered memory:";
+
+    for (int i = 0; i < MEM_NUM; i++) {
+        std::cout << " " << g_name[i] << " = " << bytes[i] << " bytes ("
+                  << num[i] << ")" << (i < MEM_NUM - 1 ? "," : "");
+        total += bytes[i];
+    }
+
+    std::cout << std::endl;
+
+    std::cout << "    total = " << total << " bytes";
+
+    if (g_soft > 0)
+        std::cout << ", soft limit = " << g_soft;
+
+    if (g_hard > 0)
+        std::cout << ", hard limit = " << g_hard;
+
+    if (get_level() != LEVEL_NORMAL)
+        std::cout << " (shedding)";
+
+    std::cout << std::endl;
+
+    // counters of threads, which are negative when releasing buffers
+    // charged by others
+    fabs_spin_lock_ac lock(g_lock);
+
+    for (size_t n = 0; n < g_counter->size(); n++) {
+        counter *c = (*g_counter)[n];
+        bool     is_first = true;
+
+        for (int i = 0; i < MEM_NUM; i++) {
+            int64_t b = c->m_bytes[i].load(std::memory_order_relaxed);
+
+            if (b == 0)
+                continue;
+
+            if (is_first) {
+                std::cout << "    ";
+
+                if (c->m_name.empty())
+                    std::cout << "thread " << n;
+                else
+                    std::cout << c->m_name;
+
+                std::cout << ":";
+                is_first = false;
+            } else {
+                std::cout << ",";
+            }
+
+            std::cout << " " << g_name[i] << " = " << b << " bytes ("
+                      << c->m_num[i].load(std::memory_order_relaxed) << ")";
+        }
+
+        if (! is_first)
+            std::cout << std::endl;
+    }
+}
@@ -0,0 +1,57 @@
+#ifndef FABS_MEM_HPP
+#define FABS_MEM_HPP
+
+#include <stdint.h>
+
+#include <atomic>
+#include <string>
+
+// subsystems buffering packets or events
+enum fabs_mem_kind {
+    MEM_FRAGMENT, // IP fragments waiting for the rest
+    MEM_TCP,      // TCP segments waiting for reassembly
+    MEM_QUEUE,    // packets and events queued between threads
+    MEM_CLASSIFY, // payloads of flows not classified yet
+    MEM_BACKLOG,  // events queued for readers
+    MEM_FLOW,     // UDP flows counted for the flows interface
+    MEM_NUM,
+    MEM_NONE = MEM_NUM,
+};
+
+// memory accounting of buffering subsystems
+// every thread counts bytes and objects in its own counters, which are
+// summed up on reading, so a thread releasing buffers charged by another
+// one may have negative counters
+class fabs_mem {
+public:
+    enum mem_level {
+        LEVEL_NORMAL,
+        LEVEL_SOFT, // subsystems stop buffering what can be given up
+        LEVEL_HARD, // subsystems drop new packets and events
+    };
+
+    static void add(fabs_mem_kind kind, int64_t bytes, int64_t num = 1);
+    static void sub(fabs_mem_kind kind, int64_t bytes, int64_t num = 1) {
+        add(kind, -bytes, -num);
+    }
+
+    // limits of the total bytes, 0 means no limit
+    static void set_limit(uint64_t soft, uint64_t hard);
+
+    // sum up the counters, and update the level
+    static void update();
+
+    static mem_level get_level() {
+        return (mem_level)m_level.load(std::memory_order_relaxed);
+    }
+
+    // name the counters of the calling thread in print_stat
+    static void set_thread_name(const std::string &name);
+
+    static void print_stat();
+
+private:
+    static std::atomic<int> m_level;
+};
+
+#endif // FABS_MEM_HPP
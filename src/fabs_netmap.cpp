@@ -77,6 +77,7 @@ fabs_netmap::run_netmap(int idx, int fd)
     std::ostringstream os;
     os << "SF-TAP nm[" << idx << "]";
     SET_THREAD_NAME(pthread_self(), os.str().c_str());
+    fabs_mem::set_thread_name(os.str());
 
     memset(&pfd, 0, sizeof(pfd));
 
@@ -0,0 +1,293 @@
+#include "fabs_pool.hpp"
+#include "fabs_spin_lock.hpp"
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <sys/mman.h>
+
+#include <atomic>
+#include <iostream>
+
+#define POOL_HEADER     16                // keeps blocks 16 bytes aligned
+#define POOL_NUM_CLASS  11                // 64B to 64KB
+#define POOL_MIN_SHIFT  6
+#define POOL_SLAB_BYTES (2 * 1024 * 1024) // a hugepage
+#define POOL_BATCH      32                // blocks moved to the depot at once
+#define POOL_NONE       0xffffffff        // allocated by malloc
+
+namespace {
+
+// the data area of a free block, linked in a batch, and batches are linked
+// in the depot
+struct free_block {
+    free_block *m_next;
+    free_block *m_next_batch;
+};
+
+struct header {
+    uint32_t m_class;
+    uint32_t m_padding[3];
+};
+
+struct depot {
+    fabs_spin_lock m_lock;
+    free_block    *m_batch;    // full batches
+    free_block    *m_loose;    // blocks freed after the cache of a thread
+    char          *m_slab_pos; // blocks not carved yet
+    char          *m_slab_end;
+
+    depot() : m_batch(nullptr), m_loose(nullptr), m_slab_pos(nullptr),
+              m_slab_end(nullptr) { }
+};
+
+// never destroyed, since threads may free blocks at exit
+depot *g_depot = new depot[POOL_NUM_CLASS];
+
+std::atomic<bool>     g_is_hugepage(false);
+std::atomic<uint64_t> g_num_slab(0);
+std::atomic<uint64_t> g_num_hugepage(0);
+std::atomic<uint64_t> g_num_malloc(0); // larger than the largest class
+
+inline size_t
+class_size(int cls)
+{
+    return (size_t)1 << (cls + POOL_MIN_SHIFT);
+}
+
+inline int
+get_class(size_t len)
+{
+    for (int i = 0; i < POOL_NUM_CLASS; i++) {
+        if (len <= class_size(i))
+            return i;
+    }
+
+    return -1;
+}
+
+char *
+map_slab()
+{
+    void *p = MAP_FAILED;
+
+#ifdef MAP_HUGETLB
+    if (g_is_hugepage) {
+        p = mmap(nullptr, POOL_SLAB_BYTES, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+
+        if (p != MAP_FAILED) {
+            g_num_hugepage++;
+        } else {
+            static std::atomic<bool> is_warned(false);
+
+            if (! is_warned.exchange(true))
+                std::cerr << "could not map hugepages for packet buffers, "
+                          << "use normal pages" << std::endl;
+        }
+    }
+#endif // MAP_HUGETLB
+
+    if (p == MAP_FAILED) {
+        p = mmap(nullptr, POOL_SLAB_BYTES, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED)
+            return nullptr;
+
+#ifdef MADV_HUGEPAGE
+        if (g_is_hugepage)
+            madvise(p, POOL_SLAB_BYTES, MADV_HUGEPAGE);
+#endif // MADV_HUGEPAGE
+    }
+
+    g_num_slab++;
+
+    return (char*)p;
+}
+
+// blocks cached by a thread
+struct cache {
+    void *m_block[POOL_NUM_CLASS][POOL_BATCH * 2];
+    int   m_num[POOL_NUM_CLASS];
+
+    cache() {
+        for (int i = 0; i < POOL_NUM_CLASS; i++)
+            m_num[i] = 0;
+    }
+
+    ~cache();
+
+    bool refill(int cls);
+    void drain(int cls, int num);
+};
+
+thread_local cache t_cache;
+thread_local bool  t_is_exited = false;
+
+// move num blocks to the depot as a batch
+void
+cache::drain(int cls, int num)
+{
+    free_block *batch = nullptr;
+
+    for (int i = 0; i < num; i++) {
+        auto blk = (free_block*)((char*)m_block[cls][--m_num[cls]] +
+                                 POOL_HEADER);
+        blk->m_next = batch;
+        batch = blk;
+    }
+
+    if (batch == nullptr)
+        return;
+
+    auto &d = g_depot[cls];
+
+    fabs_spin_lock_ac lock(d.m_lock);
+
+    batch->m_next_batch = d.m_batch;
+    d.m_batch = batch;
+}
+
+cache::~cache()
+{
+    for (int i = 0; i < POOL_NUM_CLASS; i++) {
+        while (m_num[i] > 0)
+            drain(i, m_num[i] < POOL_BATCH ? m_num[i] : POOL_BATCH);
+    }
+
+    t_is_exited = true;
+}
+
+// get a batch from the depot, or carve a slab
+bool
+cache::refill(int cls)
+{
+    auto  &d    = g_depot[cls];
+    size_t size = POOL_HEADER + class_size(cls);
+
+    fabs_spin_lock_ac lock(d.m_lock);
+
+    free_block *batch = d.m_batch;
+
+    if (batch != nullptr) {
+        d.m_batch = batch->m_next_batch;
+    } else if (d.m_loose != nullptr) {
+        batch = d.m_loose;
+        d.m_loose = nullptr;
+    }
+
+    if (batch != nullptr) {
+        while (batch != nullptr && m_num[cls] < POOL_BATCH * 2) {
+            m_block[cls][m_num[cls]++] = (char*)batch - POOL_HEADER;
+            batch = batch->m_next;
+        }
+
+        if (batch != nullptr) {
+            // only loose blocks may be more than a batch
+            batch->m_next_batch = nullptr;
+            free_block *last = batch;
+            while (last->m_next)
+                last = last->m_next;
+
+            last->m_next = d.m_loose;
+            d.m_loose = batch;
+        }
+
+        return true;
+    }
+
+    for (int i = 0; i < POOL_BATCH; i++) {
+        if (d.m_slab_pos == nullptr || d.m_slab_pos + size > d.m_slab_end) {
+            char *slab = map_slab();
+            if (slab == nullptr)
+                return m_num[cls] > 0;
+
+            d.m_slab_pos = slab;
+            d.m_slab_end = slab + POOL_SLAB_BYTES;
+        }
+
+        auto hdr = (header*)d.m_slab_pos;
+        hdr->m_class = cls;
+
+        m_block[cls][m_num[cls]++] = d.m_slab_pos;
+        d.m_slab_pos += size;
+    }
+
+    return true;
+}
+
+} // namespace
+
+void *
+fabs_pool::alloc(size_t len)
+{
+    int cls = get_class(len);
+
+    if (cls < 0) {
+        auto hdr = (header*)malloc(POOL_HEADER + len);
+        if (hdr == nullptr)
+            return nullptr;
+
+        hdr->m_class = POOL_NONE;
+        g_num_malloc++;
+
+        return (char*)hdr + POOL_HEADER;
+    }
+
+    auto &c = t_cache;
+
+    if (c.m_num[cls] == 0 && ! c.refill(cls))
+        return nullptr;
+
+    return (char*)c.m_block[cls][--c.m_num[cls]] + POOL_HEADER;
+}
+
+void
+fabs_pool::free(void *ptr)
+{
+    if (ptr == nullptr)
+        return;
+
+    auto hdr = (header*)((char*)ptr - POOL_HEADER);
+    int  cls = hdr->m_class;
+
+    if (hdr->m_class == POOL_NONE) {
+        ::free(hdr);
+        return;
+    }
+
+    if (t_is_exited) {
+        // the cache of this thread has gone
+        auto &d   = g_depot[cls];
+        auto  blk = (free_block*)ptr;
+
+        fabs_spin_lock_ac lock(d.m_lock);
+
+        blk->m_next = d.m_loose;
+        d.m_loose = blk;
+
+        return;
+    }
+
+    auto &c = t_cache;
+
+    if (c.m_num[cls] == POOL_BATCH * 2)
+        c.drain(cls, POOL_BATCH);
+
+    c.m_block[cls][c.m_num[cls]++] = hdr;
+}
+
+void
+fabs_pool::set_hugepage(bool is_hugepage)
+{
+    g_is_hugepage = is_hugepage;
+}
+
+void
+fabs_pool::print_stat()
+{
+    std::cout << "packet buffer pool: slabs = " << g_num_slab
+              << " (" << g_num_slab * (POOL_SLAB_BYTES / 1024 / 1024)
+              << " MB, hugepages = " << g_num_hugepage
+              << "), large buffers by malloc = " << g_num_malloc << std::endl;
+}
@@ -0,0 +1,22 @@
+#ifndef FABS_POOL_HPP
+#define FABS_POOL_HPP
+
+#include <stddef.h>
+
+// size class slab pool for packet buffers
+// blocks are cached per thread, and a thread freeing blocks allocated by
+// another one returns them to the shared depot in batches
+// slabs are never returned to the system, and may be backed by hugepages
+class fabs_pool {
+public:
+    // return nullptr if memory is exhausted
+    static void *alloc(size_t len);
+    static void  free(void *ptr);
+
+    // slabs mapped after this are backed by hugepages if possible
+    static void set_hugepage(bool is_hugepage);
+
+    static void print_stat();
+};
+
+#endif // FABS_POOL_HPP
@@ -0,0 +1,118 @@
+#ifndef FABS_RCU_HPP
+#define FABS_RCU_HPP
+
+#include "fabs_spin_lock.hpp"
+
+#include <stdint.h>
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <utility>
+#include <vector>
+
+class fabs_rcu_read;
+
+// epoch based reclamation of objects published by pointers
+// readers are threads with fixed slots, and enter a read section by
+// recording the global epoch in their slots
+// an object retired at epoch e is deleted once no reader is in a section
+// entered at e or before, since readers entered later see its successor
+class fabs_rcu {
+public:
+    fabs_rcu(int num_reader) : m_reader(new reader[num_reader]),
+                               m_num_reader(num_reader), m_epoch(1) { }
+    virtual ~fabs_rcu() {
+        for (auto &r: m_retired) {
+            r.second();
+        }
+    }
+
+    // called by writers after replacing the pointer to ptr
+    template <typename T>
+    void retire(T *ptr) {
+        if (ptr == nullptr)
+            return;
+
+        uint64_t epoch = m_epoch.fetch_add(1);
+
+        {
+            fabs_spin_lock_ac lock(m_lock);
+            m_retired.push_back(std::make_pair(epoch, [ptr]() { delete ptr; }));
+        }
+
+        reclaim();
+    }
+
+    // delete retired objects no reader can see
+    void reclaim() {
+        uint64_t min = m_epoch.load();
+
+        for (int i = 0; i < m_num_reader; i++) {
+            uint64_t e = m_reader[i].m_epoch.load();
+            if (e != 0 && e < min)
+                min = e;
+        }
+
+        std::vector<std::function<void()>> dels;
+
+        {
+            fabs_spin_lock_ac lock(m_lock);
+
+            auto it = m_retired.begin();
+            while (it != m_retired.end()) {
+                if (it->first < min) {
+                    dels.push_back(std::move(it->second));
+                    it = m_retired.erase(it);
+                } else {
+                    ++it;
+                }
+            }
+        }
+
+        for (auto &del: dels) {
+            del();
+        }
+    }
+
+private:
+    struct reader {
+        std::atomic<uint64_t> m_epoch; // 0 if not in a section
+        char m_padding[64 - sizeof(std::atomic<uint64_t>)];
+
+        reader() : m_epoch(0) { }
+    };
+
+    std::unique_ptr<reader[]> m_reader;
+    int                       m_num_reader;
+    std::atomic<uint64_t>     m_epoch;
+
+    fabs_spin_lock m_lock; // for m_retired
+    std::vector<std::pair<uint64_t, std::function<void()>>> m_retired;
+
+    friend class fabs_rcu_read;
+};
+
+// read section of a reader slot, which may be nested
+class fabs_rcu_read {
+public:
+    fabs_rcu_read(fabs_rcu &rcu, int slot) : m_epoch(rcu.m_reader[slot].m_epoch)
+    {
+        m_is_outer = m_epoch.load(std::memory_order_relaxed) == 0;
+
+        if (m_is_outer)
+            m_epoch.store(rcu.m_epoch.load());
+    }
+
+    ~fabs_rcu_read()
+    {
+        if (m_is_outer)
+            m_epoch.store(0, std::memory_order_release);
+    }
+
+private:
+    std::atomic<uint64_t> &m_epoch;
+    bool                   m_is_outer;
+};
+
+#endif // FABS_RCU_HPP
@@ -0,0 +1,205 @@
+#include "fabs_shm.hpp"
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/socket.h>
+
+#ifdef __linux__
+    #include <sys/eventfd.h>
+#endif // __linux__
+
+#include <iostream>
+
+#define SHM_RING_OFFSET 4096
+
+fabs_shm::fabs_shm() : m_header(nullptr),
+                       m_ring(nullptr),
+                       m_size(0),
+                       m_map_len(0),
+                       m_mem_fd(-1),
+                       m_data_fd(-1),
+                       m_space_fd(-1)
+{
+
+}
+
+fabs_shm::~fabs_shm()
+{
+    if (m_header != nullptr)
+        munmap(m_header, m_map_len);
+
+    if (m_mem_fd >= 0)
+        close(m_mem_fd);
+
+    if (m_data_fd >= 0)
+        close(m_data_fd);
+
+    if (m_space_fd >= 0)
+        close(m_space_fd);
+}
+
+#ifdef __linux__
+
+bool
+fabs_shm::open(int sock, size_t size)
+{
+    m_size = 4096;
+    while (m_size < size)
+        m_size <<= 1;
+
+    m_map_len = SHM_RING_OFFSET + m_size;
+
+    m_mem_fd = memfd_create("sf-tap", MFD_CLOEXEC);
+    if (m_mem_fd < 0) {
+        perror("memfd_create");
+        return false;
+    }
+
+    if (ftruncate(m_mem_fd, m_map_len) < 0) {
+        perror("ftruncate");
+        return false;
+    }
+
+    void *addr = mmap(nullptr, m_map_len, PROT_READ | PROT_WRITE, MAP_SHARED,
+                      m_mem_fd, 0);
+    if (addr == MAP_FAILED) {
+        perror("mmap");
+        return false;
+    }
+
+    m_header = (fabs_shm_header*)addr;
+    m_ring   = (char*)addr + SHM_RING_OFFSET;
+
+    memcpy(m_header->magic, FABS_SHM_MAGIC, sizeof(m_header->magic));
+    m_header->size   = m_size;
+    m_header->offset = SHM_RING_OFFSET;
+
+    m_data_fd  = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    m_space_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (m_data_fd < 0 || m_space_fd < 0) {
+        perror("eventfd");
+        return false;
+    }
+
+    // pass the memory and eventfds to the reader
+    fabs_shm_hello hello;
+    memcpy(hello.magic, FABS_SHM_MAGIC, sizeof(hello.magic));
+    hello.size = m_map_len;
+
+    int  fds[3] = {m_mem_fd, m_data_fd, m_space_fd};
+    char cbuf[CMSG_SPACE(sizeof(fds))];
+    memset(cbuf, 0, sizeof(cbuf));
+
+    iovec  iov;
+    msghdr msg;
+
+    iov.iov_base = &hello;
+    iov.iov_len  = sizeof(hello);
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov        = &iov;
+    msg.msg_iovlen     = 1;
+    msg.msg_control    = cbuf;
+    msg.msg_controllen = sizeof(cbuf);
+
+    cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type  = SCM_RIGHTS;
+    cmsg->cmsg_len   = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    if (sendmsg(sock, &msg, MSG_NOSIGNAL) != sizeof(hello)) {
+        perror("sendmsg");
+        return false;
+    }
+
+    return true;
+}
+
+#else
+
+bool
+fabs_shm::open(int sock, size_t size)
+{
+    std::cerr << "shared memory transport is supported only on Linux"
+              << std::endl;
+    return false;
+}
+
+#endif // __linux__
+
+ssize_t
+fabs_shm::writev(const iovec *iov, int iovcnt)
+{
+    uint64_t head  = m_header->head;
+    uint64_t tail  = __atomic_load_n(&m_header->tail, __ATOMIC_ACQUIRE);
+    size_t   space = m_size - (head - tail);
+    size_t   len   = 0;
+
+    if (space == 0) {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    for (int i = 0; i < iovcnt && space > 0; i++) {
+        const char *p = (const char*)iov[i].iov_base;
+        size_t      n = iov[i].iov_len < space ? iov[i].iov_len : space;
+
+        while (n > 0) {
+            size_t pos  = (head + len) & (m_size - 1);
+            size_t size = m_size - pos < n ? m_size - pos : n;
+
+            memcpy(m_ring + pos, p, size);
+
+            p     += size;
+            n     -= size;
+            len   += size;
+            space -= size;
+        }
+    }
+
+    __atomic_store_n(&m_header->head, head + len, __ATOMIC_RELEASE);
+
+    // wake up the reader only if it sleeps
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    if (m_header->reader_wait &&
+        __sync_lock_test_and_set(&m_header->reader_wait, 0)) {
+        uint64_t one = 1;
+        if (write(m_data_fd, &one, sizeof(one)) < 0) {
+            // already notified
+        }
+    }
+
+    return len;
+}
+
+bool
+fabs_shm::wait_space()
+{
+    __sync_lock_test_and_set(&m_header->writer_wait, 1);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    // the reader may have consumed the ring before writer_wait was set
+    uint64_t tail = __atomic_load_n(&m_header->tail, __ATOMIC_ACQUIRE);
+
+    if (m_header->head - tail < m_size) {
+        m_header->writer_wait = 0;
+        return false;
+    }
+
+    return true;
+}
+
+void
+fabs_shm::clear_space()
+{
+    uint64_t n;
+
+    if (read(m_space_fd, &n, sizeof(n)) < 0) {
+        // not notified
+    }
+}
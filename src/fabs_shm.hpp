@@ -0,0 +1,72 @@
+#ifndef FABS_SHM_HPP
+#define FABS_SHM_HPP
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <sys/uio.h>
+
+#define FABS_SHM_MAGIC "SFTAPSHM"
+
+// layout of the shared memory given to an analyzer
+// the ring follows this header, and carries the same byte stream as the
+// UNIX domain socket would (text or fabs_appif_header framing)
+// head and tail increase monotonically, offset in the ring is pos % size
+struct fabs_shm_header {
+    char     magic[8];     // FABS_SHM_MAGIC
+    uint64_t size;         // bytes of the ring, power of 2
+    uint64_t offset;       // offset of the ring from the header
+    uint8_t  pad0[40];
+
+    volatile uint64_t head;        // written by SF-TAP
+    volatile uint32_t reader_wait; // set by the reader before sleeping
+    uint8_t  pad1[52];
+
+    volatile uint64_t tail;        // written by the reader
+    volatile uint32_t writer_wait; // set by SF-TAP before sleeping
+    uint8_t  pad2[52];
+};
+
+// sent with 3 file descriptors by SCM_RIGHTS when a reader connects
+// fds[0]: memfd of fabs_shm_header and the ring
+// fds[1]: eventfd written by SF-TAP when reader_wait is set
+// fds[2]: eventfd written by the reader when writer_wait is set
+struct fabs_shm_hello {
+    char     magic[8];     // FABS_SHM_MAGIC
+    uint64_t size;         // bytes of the memfd
+};
+
+// single producer and single consumer ring in shared memory
+class fabs_shm {
+public:
+    fabs_shm();
+    virtual ~fabs_shm();
+
+    // create the ring of size bytes (rounded up to power of 2), and pass
+    // it to the reader connected to sock
+    bool open(int sock, size_t size);
+
+    // copy iov to the ring like writev(2)
+    // return -1 with errno = EAGAIN if the ring is full
+    ssize_t writev(const iovec *iov, int iovcnt);
+
+    // prepare to sleep until the reader consumes the ring
+    // return false if the ring has room already
+    bool wait_space();
+
+    // called when space_fd becomes readable
+    void clear_space();
+
+    int get_space_fd() const { return m_space_fd; }
+
+private:
+    fabs_shm_header *m_header;
+    char    *m_ring;
+    size_t   m_size;
+    size_t   m_map_len;
+    int      m_mem_fd;
+    int      m_data_fd;
+    int      m_space_fd;
+};
+
+#endif // FABS_SHM_HPP
@@ -0,0 +1,231 @@
+#include "fabs_spill.hpp"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+
+#include <chrono>
+#include <iostream>
+#include <vector>
+
+#define SPILL_SEGMENT (4 * 1024 * 1024)
+
+fabs_spill::fabs_spill(const std::string &dir, uint64_t quota) :
+    m_dir(dir),
+    m_quota(quota),
+    m_is_active(false),
+    m_bytes(0),
+    m_total(0),
+    m_time(0)
+{
+
+}
+
+fabs_spill::~fabs_spill()
+{
+    for (auto &seg: m_seg) {
+        free_segment(seg);
+    }
+}
+
+bool
+fabs_spill::make_segment(const std::string &dir, size_t len, segment &seg)
+{
+    size_t size = SPILL_SEGMENT;
+
+    if (len > size)
+        size = (len + 4095) & ~(size_t)4095;
+
+    std::string       path = dir + "/sf-tap-spill-XXXXXX";
+    std::vector<char> tmpl(path.begin(), path.end());
+
+    tmpl.push_back('\0');
+
+    int fd = mkstemp(&tmpl[0]);
+    if (fd < 0) {
+        perror(&tmpl[0]);
+        return false;
+    }
+
+    // nobody else opens the file, and it is removed when closed
+    unlink(&tmpl[0]);
+
+#ifdef __linux__
+    // reserve blocks, or writes to the mapping raise SIGBUS if the disk
+    // is full
+    int err = posix_fallocate(fd, 0, size);
+    if (err != 0) {
+        std::cerr << "could not allocate a spill segment in " << dir
+                  << ": " << strerror(err) << std::endl;
+        close(fd);
+        return false;
+    }
+#else
+    if (ftruncate(fd, size) < 0) {
+        perror("ftruncate");
+        close(fd);
+        return false;
+    }
+#endif // __linux__
+
+    void *addr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (addr == MAP_FAILED) {
+        perror("mmap");
+        close(fd);
+        return false;
+    }
+
+    seg.m_fd        = fd;
+    seg.m_addr      = (char*)addr;
+    seg.m_size      = size;
+    seg.m_read_pos  = 0;
+    seg.m_write_pos = 0;
+
+    return true;
+}
+
+void
+fabs_spill::free_segment(segment &seg)
+{
+    munmap(seg.m_addr, seg.m_size);
+    close(seg.m_fd);
+}
+
+// append to the last segment with m_lock held, return false if it has no
+// room
+bool
+fabs_spill::write_last(const std::string &header, const char *body,
+                       size_t blen)
+{
+    size_t len = header.size() + blen;
+
+    if (m_seg.empty() || m_seg.back().m_size - m_seg.back().m_write_pos < len)
+        return false;
+
+    auto &seg = m_seg.back();
+
+    memcpy(seg.m_addr + seg.m_write_pos, header.data(), header.size());
+
+    if (blen > 0)
+        memcpy(seg.m_addr + seg.m_write_pos + header.size(), body, blen);
+
+    seg.m_write_pos += len;
+
+    if (! m_is_active) {
+        m_is_active = true;
+        m_time = std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    m_bytes += len;
+    m_total += len;
+
+    return true;
+}
+
+fabs_spill::result
+fabs_spill::append(const std::string &header, const char *body, size_t blen,
+                   bool is_control, bool is_start)
+{
+    size_t  len = header.size() + blen;
+    segment seg;
+    bool    is_seg = false; // seg is made but not linked
+    result  ret;
+
+    for (;;) {
+        {
+            fabs_spin_lock_ac lock(m_lock);
+
+            if (! m_is_active && ! is_start) {
+                ret = SPILL_INACTIVE;
+                break;
+            }
+
+            uint64_t limit = is_control ? m_quota + m_quota / 8 : m_quota;
+
+            if (m_bytes + len > limit) {
+                ret = SPILL_FULL;
+                break;
+            }
+
+            if (write_last(header, body, blen)) {
+                ret = SPILL_OK;
+                break;
+            }
+
+            if (is_seg) {
+                m_seg.push_back(seg);
+                is_seg = false;
+
+                write_last(header, body, blen);
+
+                ret = SPILL_OK;
+                break;
+            }
+        }
+
+        if (! make_segment(m_dir, len, seg))
+            return SPILL_FULL;
+
+        is_seg = true;
+    }
+
+    // another consumer has linked a segment, or the spill is full
+    if (is_seg)
+        free_segment(seg);
+
+    return ret;
+}
+
+bool
+fabs_spill::peek(const char **buf, size_t *len)
+{
+    std::vector<segment> done;
+    bool                 is_peek = false;
+
+    {
+        fabs_spin_lock_ac lock(m_lock);
+
+        while (! m_seg.empty()) {
+            auto &seg = m_seg.front();
+
+            if (seg.m_read_pos < seg.m_write_pos) {
+                *buf = seg.m_addr + seg.m_read_pos;
+                *len = seg.m_write_pos - seg.m_read_pos;
+                is_peek = true;
+                break;
+            }
+
+            // replayed, or the last one is empty
+            done.push_back(seg);
+            m_seg.pop_front();
+        }
+
+        if (! is_peek) {
+            // the reader has caught up
+            m_is_active = false;
+            m_time      = 0;
+        }
+    }
+
+    // unmapped without the lock as well as mapped
+    for (auto &seg: done) {
+        free_segment(seg);
+    }
+
+    return is_peek;
+}
+
+void
+fabs_spill::consume(size_t len)
+{
+    fabs_spin_lock_ac lock(m_lock);
+
+    m_seg.front().m_read_pos += len;
+    m_bytes -= len;
+}
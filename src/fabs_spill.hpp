@@ -0,0 +1,73 @@
+#ifndef FABS_SPILL_HPP
+#define FABS_SPILL_HPP
+
+#include "fabs_spin_lock.hpp"
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <atomic>
+#include <deque>
+#include <string>
+
+// events of a reader lagging behind, spilled to mmap'd segment files
+// once spilling starts, every event is appended to the spill until the
+// writer thread has replayed all of it, so that the order is kept
+// segment files are unlinked as soon as they are created
+class fabs_spill {
+public:
+    enum result {
+        SPILL_OK,
+        SPILL_INACTIVE, // not spilling, and is_start is false
+        SPILL_FULL,     // over the quota
+    };
+
+    fabs_spill(const std::string &dir, uint64_t quota);
+    virtual ~fabs_spill();
+
+    // called by consumers
+    // control events may exceed the quota by 1/8 of it
+    result append(const std::string &header, const char *body, size_t blen,
+                  bool is_control, bool is_start);
+
+    // called by the writer thread
+    // get the oldest bytes not replayed, return false if nothing is spilled
+    // the spill becomes inactive if it is empty
+    bool peek(const char **buf, size_t *len);
+    void consume(size_t len);
+
+    uint64_t get_bytes() const { return m_bytes; }
+    uint64_t get_total() const { return m_total; }
+    uint64_t get_time() const { return m_time; }
+
+private:
+    struct segment {
+        int    m_fd;
+        char  *m_addr;
+        size_t m_size;
+        size_t m_read_pos;  // by the writer thread
+        size_t m_write_pos; // by consumers
+    };
+
+    std::string m_dir;
+    uint64_t    m_quota;
+
+    fabs_spin_lock      m_lock;
+    std::deque<segment> m_seg;
+    bool                m_is_active;
+
+    std::atomic<uint64_t> m_bytes; // spilled but not replayed
+    std::atomic<uint64_t> m_total; // spilled
+    std::atomic<uint64_t> m_time;  // [ms] when spilling started, 0 if not
+
+    // segment files are created and mapped without m_lock, since it is
+    // slow
+    static bool make_segment(const std::string &dir, size_t len,
+                             segment &seg);
+    static void free_segment(segment &seg);
+
+    bool write_last(const std::string &header, const char *body,
+                    size_t blen);
+};
+
+#endif // FABS_SPILL_HPP
@@ -164,6 +164,7 @@ fabs_tcp::garbage_collector()
     std::ostringstream os;
     os << "SF-TAP GC[" << m_idx << "]";
     SET_THREAD_NAME(pthread_self(), os.str().c_str());
+    fabs_mem::set_thread_name(os.str());
 
     for (;;) {
         std::unique_lock<std::mutex> lock_gc(m_mutex_gc);
@@ -234,27 +235,24 @@ fabs_tcp::input_tcp_event(int idx, fabs_id_dir tcp_event)
                     dtm = f2->second.m_bytes->m_tm;
             }
 
-            ptr_fabs_bytes buf(new fabs_bytes);
-            buf->m_tm = dtm;
-
             if (it_flow->second->m_flow1.m_is_compromised || it_flow->second->m_flow2.m_is_compromised) {
-                m_appif->in_event(STREAM_COMPROMISED, tcp_event, std::move(buf));
+                m_appif->in_event(STREAM_COMPROMISED, tcp_event, dtm);
             } else {
-                m_appif->in_event(STREAM_TIMEOUT, tcp_event, std::move(buf));
+                m_appif->in_event(STREAM_TIMEOUT, tcp_event, dtm);
             }
 
             is_rm = true;
         }
 
         if (is_rm) {
+            fabs_flow_stat stat;
+
             lock.unlock();
-            rm_flow(idx, tcp_event.m_id, tcp_event.m_dir);
+            rm_flow(idx, tcp_event.m_id, tcp_event.m_dir, dtm, stat);
 
             fabs_id_dir id_dir = tcp_event;
             id_dir.m_dir = FROM_NONE;
-            ptr_fabs_bytes buf(new fabs_bytes);
-            buf->m_tm = dtm;
-            m_appif->in_event(STREAM_DESTROYED, id_dir, std::move(buf));
+            m_appif->in_event(STREAM_DESTROYED, id_dir, dtm, &stat);
 
             return;
         }
@@ -286,9 +284,7 @@ fabs_tcp::input_tcp_event(int idx, fabs_id_dir tcp_event)
                 m_appif->in_event(STREAM_DATA, tcp_event, std::move(packet.m_bytes));
             }
 
-            ptr_fabs_bytes buf = ptr_fabs_bytes(new fabs_bytes);
-            buf->m_tm = tm;
-            m_appif->in_event(STREAM_FIN, tcp_event, std::move(buf));
+            m_appif->in_event(STREAM_FIN, tcp_event, tm);
 
 #ifdef DEBUG
             cout << "connection closed: addr1 = "
@@ -301,12 +297,12 @@ fabs_tcp::input_tcp_event(int idx, fabs_id_dir tcp_event)
                  << endl;
 #endif // DEBUG
 
-            if (recv_fin(idx, tcp_event.m_id, tcp_event.m_dir)) {
+            fabs_flow_stat stat;
+
+            if (recv_fin(idx, tcp_event.m_id, tcp_event.m_dir, tm, stat)) {
                 fabs_id_dir id_dir = tcp_event;
                 id_dir.m_dir = FROM_NONE;
-                buf = ptr_fabs_bytes(new fabs_bytes);
-                buf->m_tm = tm;
-                m_appif->in_event(STREAM_DESTROYED, id_dir, std::move(buf));
+                m_appif->in_event(STREAM_DESTROYED, id_dir, tm, &stat);
             }
         } else if (packet.m_flags & TH_RST) {
 #ifdef DEBUG
@@ -323,13 +319,13 @@ fabs_tcp::input_tcp_event(int idx, fabs_id_dir tcp_event)
 
             m_appif->in_event(STREAM_RST, tcp_event, std::move(packet.m_bytes));
 
-            rm_flow(idx, tcp_event.m_id, tcp_event.m_dir);
+            fabs_flow_stat stat;
+
+            rm_flow(idx, tcp_event.m_id, tcp_event.m_dir, tm, stat);
 
             fabs_id_dir id_dir = tcp_event;
             id_dir.m_dir = FROM_NONE;
-            ptr_fabs_bytes buf = ptr_fabs_bytes(new fabs_bytes);
-            buf->m_tm = tm;
-            m_appif->in_event(STREAM_DESTROYED, id_dir, std::move(buf));
+            m_appif->in_event(STREAM_DESTROYED, id_dir, tm, &stat);
         } else {
 #ifdef DEBUG
             cout << "data in: addr1 = "
@@ -349,8 +345,26 @@ fabs_tcp::input_tcp_event(int idx, fabs_id_dir tcp_event)
     }
 }
 
+// counters of the flow are copied to stat, as DESTROYED carries them
+void
+fabs_tcp_flow::get_stat(const timeval &end, fabs_flow_stat &stat) const
+{
+    stat.start = m_start.tv_sec * 1000000ULL + m_start.tv_usec;
+    stat.end   = end.tv_sec * 1000000ULL + end.tv_usec;
+
+    stat.packets[0] = m_flow1.m_num_packets;
+    stat.packets[1] = m_flow2.m_num_packets;
+    stat.bytes[0]   = m_flow1.m_num_bytes;
+    stat.bytes[1]   = m_flow2.m_num_bytes;
+    stat.retrans[0] = m_flow1.m_num_retrans;
+    stat.retrans[1] = m_flow2.m_num_retrans;
+    stat.ooo[0]     = m_flow1.m_num_ooo;
+    stat.ooo[1]     = m_flow2.m_num_ooo;
+}
+
 bool
-fabs_tcp::recv_fin(int idx, const fabs_id &id, fabs_direction dir)
+fabs_tcp::recv_fin(int idx, const fabs_id &id, fabs_direction dir,
+                   const timeval &tm, fabs_flow_stat &stat)
 {
     std::unique_lock<std::mutex> lock(m_mutex_flow[idx]);
 
@@ -366,6 +380,7 @@ fabs_tcp::recv_fin(int idx, const fabs_id &id, fabs_direction dir)
         peer = &it_flow->second->m_flow1;
 
     if (peer->m_is_fin) {
+        it_flow->second->get_stat(tm, stat);
         m_flow[idx].erase(it_flow);
         return true;
     }
@@ -374,14 +389,18 @@ fabs_tcp::recv_fin(int idx, const fabs_id &id, fabs_direction dir)
 }
 
 void
-fabs_tcp::rm_flow(int idx, const fabs_id &id, fabs_direction dir)
+fabs_tcp::rm_flow(int idx, const fabs_id &id, fabs_direction dir,
+                  const timeval &tm, fabs_flow_stat &stat)
 {
     std::unique_lock<std::mutex> lock(m_mutex_flow[idx]);
 
+    memset(&stat, 0, sizeof(stat));
+
     auto it_flow = m_flow[idx].find(id);
     if (it_flow == m_flow[idx].end())
         return;
 
+    it_flow->second->get_stat(tm, stat);
     m_flow[idx].erase(it_flow);
 }
 
@@ -461,6 +480,7 @@ fabs_tcp::input_tcp(fabs_id &id, fabs_direction dir, ptr_fabs_bytes buf)
 
         if ((tcph->th_flags & TH_SYN) && it_flow == m_flow[idx].end()) {
             auto ptr = ptr_fabs_tcp_flow(new fabs_tcp_flow);
+            ptr->m_start = buf->m_tm;
             p_tcp_flow = ptr.get();
             m_flow[idx][id] = std::move(ptr);
             __sync_fetch_and_add(&m_total_session, 1);
@@ -488,21 +508,45 @@ fabs_tcp::input_tcp(fabs_id &id, fabs_direction dir, ptr_fabs_bytes buf)
             return;
         }
 
+        p_uniflow->m_num_packets++;
+
         if (packet.m_flags & TH_SYN) {
             if (! p_uniflow->m_is_syn) {
                 p_uniflow->m_min_seq = packet.m_seq;
                 p_uniflow->m_is_syn  = true;
                 packet.m_nxt_seq = packet.m_seq + 1;
             } else {
+                p_uniflow->m_num_retrans++;
                 return;
             }
         } else if (! (packet.m_flags & TH_RST) &&
                    (int32_t)packet.m_seq - (int32_t)p_uniflow->m_min_seq < 0) {
+            // already delivered
+            if (packet.m_data_len > 0 || packet.m_flags & TH_FIN)
+                p_uniflow->m_num_retrans++;
             return;
         }
 
+        if (packet.m_seq != p_uniflow->m_min_seq &&
+            ! (packet.m_flags & TH_RST) &&
+            fabs_mem::get_level() == fabs_mem::LEVEL_HARD) {
+            // over the limit, out of order segments are lost
+            return;
+        }
+
+        packet.m_bytes->charge(MEM_TCP);
+
         if (packet.m_flags & TH_SYN || packet.m_flags & TH_FIN ||
             packet.m_data_len > 0) {
+            if (p_uniflow->m_packets.count(packet.m_seq) > 0) {
+                p_uniflow->m_num_retrans++;
+            } else {
+                p_uniflow->m_num_bytes += packet.m_data_len;
+
+                if (packet.m_seq != p_uniflow->m_min_seq)
+                    p_uniflow->m_num_ooo++;
+            }
+
             p_uniflow->m_packets[packet.m_seq].m_bytes    = std::move(packet.m_bytes);
             p_uniflow->m_packets[packet.m_seq].m_seq      = packet.m_seq;
             p_uniflow->m_packets[packet.m_seq].m_nxt_seq  = packet.m_nxt_seq;
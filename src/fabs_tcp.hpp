@@ -33,18 +33,27 @@ struct fabs_tcp_uniflow {
     std::map<uint32_t, fabs_tcp_packet> m_packets;
     time_t   m_time;
     uint32_t m_min_seq;
+    uint64_t m_num_packets;
+    uint64_t m_num_bytes;
+    uint32_t m_num_retrans;
+    uint32_t m_num_ooo;
     bool     m_is_gaveup;
     bool     m_is_syn;
     bool     m_is_fin;
     bool     m_is_rm;
     bool     m_is_compromised;
 
-    fabs_tcp_uniflow() : m_time(0), m_min_seq(0), m_is_gaveup(false),
+    fabs_tcp_uniflow() : m_time(0), m_min_seq(0), m_num_packets(0),
+                         m_num_bytes(0), m_num_retrans(0), m_num_ooo(0),
+                         m_is_gaveup(false),
                          m_is_syn(false), m_is_fin(false), m_is_rm(false), m_is_compromised(false) { }
 };
 
 struct fabs_tcp_flow {
     fabs_tcp_uniflow m_flow1, m_flow2;
+    timeval m_start;
+
+    void get_stat(const timeval &end, fabs_flow_stat &stat) const;
 };
 
 typedef std::unique_ptr<fabs_tcp_flow> ptr_fabs_tcp_flow;
@@ -71,8 +80,10 @@ private:
 
     bool get_packet(int idx, const fabs_id &id, fabs_direction dir,
                     fabs_tcp_packet &packet);
-    bool recv_fin(int idx, const fabs_id &id, fabs_direction dir);
-    void rm_flow(int idx, const fabs_id &id, fabs_direction dir);
+    bool recv_fin(int idx, const fabs_id &id, fabs_direction dir,
+                  const timeval &tm, fabs_flow_stat &stat);
+    void rm_flow(int idx, const fabs_id &id, fabs_direction dir,
+                 const timeval &tm, fabs_flow_stat &stat);
     void input_tcp_event(int idx, fabs_id_dir tcp_event);
     void garbage_collector2(int idx, time_t now);
 